@@ -0,0 +1,110 @@
+/*
+ * FILE: rdt_async.h
+ * DESCRIPTION: Asynchronous send API of the RDT sender.
+ * NOTE: Sender_Send() queues a message and returns a handle that completes once every packet carrying the
+ *       message has been ACKed. The data is not copied: packets are cut straight out of the caller's buffer, which
+ *       must stay valid until the handle completes and can be reused right after that.
+ *
+ *       Messages not completed yet count against an in-flight budget (RDT_SEND_BUDGET bytes, default 1 MB, 0 for
+ *       unlimited). Sender_Send() refuses a message that does not fit, unless nothing is in flight, so a message
+ *       larger than the budget still gets through. Sender_OnBudget() tells when it is worth trying again.
+ *
+ *       Messages complete in the order their last packets were sent, which is not the order of sending when
+ *       several streams are used. Completion can be polled with Sender_Done(), reported to a callback, or
+ *       awaited in a C++20 coroutine:
+ *
+ *           RDT_Task Producer()
+ *           {
+ *               for (...)
+ *                   co_await Sender_SendAwait(data, size); // Resumes once the message is ACKed.
+ *           }
+ *
+ *       Callbacks run inside the sender's event handlers and may call Sender_Send() again.
+ */
+
+
+#ifndef _RDT_ASYNC_H_
+#define _RDT_ASYNC_H_
+
+#include "rdt_struct.h"
+
+
+// Called with the handle of a message once it is ACKed, or with -handle if it was abandoned after its deadline.
+typedef void (*RDT_SendCallback)(int handle, void *arg);
+
+// Queue a message for sending. `callback`, if not NULL, is called with `arg` once the message is ACKed. Return the
+// handle of the message (> 0), or 0 if it does not fit in the in-flight budget.
+int Sender_Send(const char *data, int size, RDT_SendCallback callback = NULL, void *arg = NULL);
+// The same on stream `stream` (Sender_Send uses stream 0), with a priority and a lifetime as for
+// Sender_FromUpperLayerOnStream().
+int Sender_SendOnStream(int stream, const char *data, int size, RDT_SendCallback callback = NULL, void *arg = NULL,
+    int priority = 0, double lifetime = 0.0);
+
+bool Sender_Done(int handle); // Whether the message with `handle` has been ACKed.
+void Sender_OnBudget(RDT_SendCallback callback, void *arg); // Call once (with handle 0) when budget is freed.
+
+int Sender_InflightBytes(); // Bytes of messages sent by Sender_Send() and not ACKed yet.
+int Sender_Budget();
+void Sender_SetBudget(int bytes); // 0 for unlimited.
+
+
+#ifdef __cpp_impl_coroutine
+
+#include <coroutine>
+#include <exception>
+
+// Awaitable send: suspends the coroutine until the message is ACKed, waiting for budget first if needed. The
+// result of co_await is the handle of the message, as passed to RDT_SendCallback.
+class RDT_SendAwaiter {
+public:
+    RDT_SendAwaiter(const char *data, int size, int stream): data(data), size(size), stream(stream), handle(0) {}
+
+    bool await_ready() const { return false; }
+    void await_suspend(std::coroutine_handle<> coroutine) { waiter = coroutine; Submit(0, this); }
+    int await_resume() const { return handle; }
+
+private:
+    const char *data;
+    int size;
+    int stream;
+    int handle;
+    std::coroutine_handle<> waiter;
+
+    static void Submit(int, void *arg)
+    {
+        RDT_SendAwaiter *self = (RDT_SendAwaiter*)arg;
+        self->handle = Sender_SendOnStream(self->stream, self->data, self->size, Resume, self);
+        if (!self->handle)
+            Sender_OnBudget(Submit, self);
+    }
+
+    static void Resume(int handle, void *arg)
+    {
+        RDT_SendAwaiter *self = (RDT_SendAwaiter*)arg;
+        self->handle = handle;
+        self->waiter.resume();
+    }
+};
+
+inline RDT_SendAwaiter Sender_SendAwait(const char *data, int size, int stream = 0)
+{
+    return RDT_SendAwaiter(data, size, stream);
+}
+
+// Return type of a fire-and-forget coroutine driven by the sender: it starts right away and frees itself when it
+// returns.
+class RDT_Task {
+public:
+    class promise_type {
+    public:
+        RDT_Task get_return_object() { return RDT_Task(); }
+        std::suspend_never initial_suspend() { return std::suspend_never(); }
+        std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+#endif /* __cpp_impl_coroutine */
+
+#endif /* _RDT_ASYNC_H_ */
@@ -0,0 +1,54 @@
+/*
+ * FILE: rdt_buffer.cc
+ * DESCRIPTION: Implementation of the packet pool.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rdt_buffer.h"
+
+
+PacketPool::PacketPool(int capacity): capacity(capacity), in_use(0), high_water(0)
+{
+    ASSERT(capacity > 0);
+
+    packets = (packet*)malloc(capacity * sizeof(packet));
+    next_free = (int*)malloc(capacity * sizeof(int));
+    ASSERT(packets && next_free);
+
+    // Chain all packets into the free list.
+    for (int i = 0; i < capacity; ++i)
+        next_free[i] = i + 1 < capacity ? i + 1 : -1;
+    free_head = 0;
+}
+
+PacketPool::~PacketPool()
+{
+    free(packets);
+    free(next_free);
+}
+
+int PacketPool::Alloc()
+{
+    int index = free_head;
+    if (index < 0) // Exhausted.
+        return -1;
+
+    free_head = next_free[index];
+    if (++in_use > high_water)
+        high_water = in_use;
+
+    return index;
+}
+
+void PacketPool::Free(int index)
+{
+    ASSERT(index >= 0 && index < capacity);
+
+    next_free[index] = free_head;
+    free_head = index;
+    --in_use;
+}
@@ -0,0 +1,117 @@
+/*
+ * FILE: rdt_buffer.h
+ * DESCRIPTION: Allocation-free buffers used on the RDT data path.
+ * NOTE: PacketPool hands out packets from a fixed array and recycles them through a free list, so sending and
+ *       ACKing never touch the heap. Ring is a FIFO that only grows (doubling) when its high-water mark is
+ *       exceeded, so it stops allocating once traffic reaches a steady state.
+ */
+
+
+#ifndef _RDT_BUFFER_H_
+#define _RDT_BUFFER_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rdt_struct.h"
+
+
+class PacketPool {
+public:
+    PacketPool(int capacity);
+    ~PacketPool();
+
+    int Alloc(); // Take a free packet and return its index, or -1 if the pool is exhausted.
+    void Free(int index); // Give a packet back to the pool.
+    packet *Get(int index) { return &packets[index]; }
+
+    bool Empty() const { return free_head < 0; } // Whether all packets are in use.
+    int Capacity() const { return capacity; }
+    int InUse() const { return in_use; }
+    int HighWater() const { return high_water; } // Maximum number of packets in use at the same time.
+
+private:
+    packet *packets; // Packet storage.
+    int *next_free; // Free list links (indexed by packet index).
+    int free_head; // First free packet, -1 if none.
+    int capacity;
+    int in_use;
+    int high_water;
+};
+
+
+template <typename T>
+class Ring {
+public:
+    Ring(): items(NULL), capacity(0), head(0), size(0), high_water(0) {}
+    ~Ring() { free(items); }
+
+    int Size() const { return size; }
+    bool Empty() const { return !size; }
+    int HighWater() const { return high_water; }
+    T &Front() { return items[head]; }
+    T &operator[](int i) { return items[(head + i) & (capacity - 1)]; } // The `i`-th item from the head.
+
+    // Append `n` items at the tail.
+    void Push(const T *src, int n)
+    {
+        if (size + n > capacity)
+            Grow(size + n);
+
+        int tail = (head + size) & (capacity - 1);
+        int first = n < capacity - tail ? n : capacity - tail;
+        memcpy(items + tail, src, first * sizeof(T));
+        memcpy(items, src + first, (n - first) * sizeof(T));
+
+        size += n;
+        if (size > high_water)
+            high_water = size;
+    }
+
+    void Push(const T &item) { Push(&item, 1); }
+
+    // Remove `n` items from the head, copying them to `dst` unless it is NULL.
+    void Pop(T *dst, int n)
+    {
+        ASSERT(n <= size);
+
+        if (dst) {
+            int first = n < capacity - head ? n : capacity - head;
+            memcpy(dst, items + head, first * sizeof(T));
+            memcpy(dst + first, items, (n - first) * sizeof(T));
+        }
+
+        head = (head + n) & (capacity - 1);
+        size -= n;
+    }
+
+private:
+    T *items; // Storage, capacity is always a power of 2.
+    int capacity;
+    int head; // Index of the first item.
+    int size;
+    int high_water;
+
+    void Grow(int min_capacity)
+    {
+        int new_capacity = capacity ? capacity : 64;
+        while (new_capacity < min_capacity)
+            new_capacity *= 2;
+
+        T *new_items = (T*)malloc(new_capacity * sizeof(T));
+        ASSERT(new_items);
+
+        int old_size = size;
+        if (old_size)
+            Pop(new_items, old_size); // Linearize the old content.
+
+        free(items);
+        items = new_items;
+        capacity = new_capacity;
+        head = 0;
+        size = old_size;
+    }
+};
+
+#endif /* _RDT_BUFFER_H_ */
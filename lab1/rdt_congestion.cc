@@ -0,0 +1,206 @@
+/*
+ * FILE: rdt_congestion.cc
+ * DESCRIPTION: Implementation of the congestion controllers used by the RDT sender.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "rdt_struct.h"
+#include "rdt_congestion.h"
+
+const double initial_cwnd = 4.0; // Initial window (RFC 3390 allows up to 4 small segments).
+const double min_cwnd = 1.0; // The window never shrinks below one packet.
+const double max_ssthresh = 1e9; // "Infinite" slow start threshold before the first loss.
+
+
+CongestionControl::CongestionControl(const char *name, double max_cwnd): name(name), cwnd(initial_cwnd),
+    ssthresh(max_ssthresh), max_cwnd(max_cwnd), log_file(NULL) {}
+
+CongestionControl::~CongestionControl()
+{
+    if (log_file)
+        fclose(log_file);
+}
+
+bool CongestionControl::CanSend(int inflight)
+{
+    return inflight < (int)cwnd;
+}
+
+void CongestionControl::SetLog(const char *path)
+{
+    ASSERT(path);
+
+    if (log_file)
+        fclose(log_file);
+
+    log_file = fopen(path, "w");
+    if (!log_file) {
+        fprintf(stderr, "cannot open congestion window log %s\n", path);
+        exit(-1);
+    }
+
+    fprintf(log_file, "# %s: time cwnd ssthresh\n", name);
+    Log(0.0);
+}
+
+void CongestionControl::Log(double now)
+{
+    if (log_file)
+        fprintf(log_file, "%.6f %.3f %.3f\n", now, cwnd, ssthresh < max_ssthresh ? ssthresh : -1.0);
+}
+
+
+// No congestion control: the window is unlimited, which is the behavior of the original sender.
+class NoCongestionControl: public CongestionControl {
+public:
+    NoCongestionControl(double max_cwnd): CongestionControl("none", max_cwnd) {}
+    void OnAck(double now, double rtt, int inflight) {}
+    void OnLoss(double now) {}
+    void OnTimeout(double now) {}
+    bool CanSend(int inflight) { return true; }
+};
+
+
+// Reno: slow start, additive increase by one packet per window, halve on loss, collapse to one packet on timeout.
+class RenoCongestionControl: public CongestionControl {
+public:
+    RenoCongestionControl(double max_cwnd): CongestionControl("reno", max_cwnd) {}
+
+    void OnAck(double now, double rtt, int inflight)
+    {
+        if (!WindowLimited(inflight))
+            return;
+
+        if (cwnd < ssthresh) // Slow start.
+            cwnd += 1.0;
+        else // Congestion avoidance.
+            cwnd += 1.0 / cwnd;
+        cwnd = fmin(cwnd, max_cwnd);
+        Log(now);
+    }
+
+    void OnLoss(double now)
+    {
+        ssthresh = fmax(cwnd / 2.0, 2.0);
+        cwnd = ssthresh;
+        Log(now);
+    }
+
+    void OnTimeout(double now)
+    {
+        ssthresh = fmax(cwnd / 2.0, 2.0);
+        cwnd = min_cwnd;
+        Log(now);
+    }
+};
+
+
+// CUBIC (RFC 8312): the window follows a cubic function of the time since the last reduction, so its growth
+// does not depend on the RTT. Falls back to the Reno-equivalent window when that would be larger.
+class CubicCongestionControl: public CongestionControl {
+public:
+    CubicCongestionControl(double max_cwnd): CongestionControl("cubic", max_cwnd), w_max(0.0), w_est(0.0), k(0.0),
+        epoch_start(-1.0), srtt(-1.0) {}
+
+    void OnAck(double now, double rtt, int inflight)
+    {
+        if (rtt > 0)
+            srtt = srtt < 0 ? rtt : 0.875 * srtt + 0.125 * rtt;
+
+        if (!WindowLimited(inflight)) { // App-limited: restart the epoch once the window is in use again.
+            epoch_start = -1.0;
+            return;
+        }
+
+        if (cwnd < ssthresh) { // Slow start.
+            cwnd = fmin(cwnd + 1.0, max_cwnd);
+            Log(now);
+            return;
+        }
+
+        if (epoch_start < 0) { // First ACK of a new congestion avoidance epoch.
+            epoch_start = now;
+            if (cwnd < w_max) {
+                k = cbrt((w_max - cwnd) / c);
+            } else {
+                k = 0.0;
+                w_max = cwnd;
+            }
+            w_est = cwnd;
+        }
+
+        double t = now - epoch_start + (srtt > 0 ? srtt : 0.0);
+        double target = w_max + c * (t - k) * (t - k) * (t - k);
+
+        if (target > cwnd)
+            cwnd += (target - cwnd) / cwnd;
+        else
+            cwnd += 0.01 / cwnd; // Plateau around w_max: probe very slowly.
+
+        // TCP-friendly region.
+        w_est += 3.0 * (1.0 - beta) / (1.0 + beta) / cwnd;
+        if (w_est > cwnd)
+            cwnd = w_est;
+
+        cwnd = fmin(cwnd, max_cwnd);
+        Log(now);
+    }
+
+    void OnLoss(double now)
+    {
+        Reduce();
+        cwnd = ssthresh;
+        Log(now);
+    }
+
+    void OnTimeout(double now)
+    {
+        Reduce();
+        cwnd = min_cwnd;
+        Log(now);
+    }
+
+private:
+    static constexpr double c = 0.4; // Scaling constant.
+    static constexpr double beta = 0.7; // Multiplicative decrease factor.
+
+    double w_max; // Window just before the last reduction.
+    double w_est; // Window Reno would have reached in the current epoch.
+    double k; // Time to grow back to w_max.
+    double epoch_start; // Start of the current epoch, negative when no epoch is running.
+    double srtt; // Smoothed RTT.
+
+    void Reduce()
+    {
+        epoch_start = -1.0;
+
+        // Fast convergence: release bandwidth faster when the window keeps shrinking.
+        if (cwnd < w_max)
+            w_max = cwnd * (1.0 + beta) / 2.0;
+        else
+            w_max = cwnd;
+
+        ssthresh = fmax(cwnd * beta, 2.0);
+    }
+};
+
+
+CongestionControl *RDT_CreateCongestionControl(const char *name, double max_cwnd)
+{
+    ASSERT(name);
+
+    if (!strcmp(name, "none"))
+        return new NoCongestionControl(max_cwnd);
+    if (!strcmp(name, "reno"))
+        return new RenoCongestionControl(max_cwnd);
+    if (!strcmp(name, "cubic"))
+        return new CubicCongestionControl(max_cwnd);
+
+    fprintf(stderr, "unknown congestion controller %s (expected none, reno or cubic)\n", name);
+    exit(-1);
+}
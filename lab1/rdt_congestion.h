@@ -0,0 +1,51 @@
+/*
+ * FILE: rdt_congestion.h
+ * DESCRIPTION: Pluggable congestion control for the RDT sender.
+ * NOTE: The controller is chosen at runtime by the RDT_CC environment variable:
+ *
+ *       none  - no congestion control, every packet is sent immediately (default).
+ *       reno  - Reno-style AIMD with slow start.
+ *       cubic - CUBIC window growth with fast convergence.
+ *
+ *       If RDT_CC_LOG names a file, "time cwnd ssthresh" is written to it every time the window changes.
+ *       All windows are counted in packets. The window only grows on ACKs of a window in full use (RFC 7661), as
+ *       an app-limited sender does not test it, and never beyond the send window.
+ */
+
+
+#ifndef _RDT_CONGESTION_H_
+#define _RDT_CONGESTION_H_
+
+#include <stdio.h>
+
+
+class CongestionControl {
+public:
+    const char *name; // Name of the algorithm.
+    double cwnd; // Congestion window.
+    double ssthresh; // Slow start threshold.
+    double max_cwnd; // The send window: the sender never has more packets unACKed.
+
+    CongestionControl(const char *name, double max_cwnd);
+    virtual ~CongestionControl();
+
+    // A packet is newly ACKed, out of `inflight` unACKed packets before the ACK. rtt < 0 means no valid sample.
+    virtual void OnAck(double now, double rtt, int inflight) = 0;
+    virtual void OnLoss(double now) = 0; // A packet is detected lost by later ACKs (at most once per window).
+    virtual void OnTimeout(double now) = 0; // The retransmission timer fired.
+    virtual bool CanSend(int inflight); // Whether one more packet can be sent with `inflight` packets unACKed.
+
+    void SetLog(const char *path); // Start logging window changes into a file.
+
+protected:
+    void Log(double now); // Record the current window.
+    bool WindowLimited(int inflight) const { return inflight >= (int)cwnd; } // Whether the window was in full use.
+
+private:
+    FILE *log_file;
+};
+
+// Create the controller named `name` ("none", "reno" or "cubic") for a sender with `max_cwnd` packets of window.
+CongestionControl *RDT_CreateCongestionControl(const char *name, double max_cwnd);
+
+#endif /* _RDT_CONGESTION_H_ */
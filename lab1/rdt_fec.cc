@@ -0,0 +1,426 @@
+/*
+ * FILE: rdt_fec.cc
+ * DESCRIPTION: Implementation of forward error correction for the RDT protocol.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FEC_X86
+#endif
+
+#include "rdt_struct.h"
+#include "rdt_protocol.h"
+#include "rdt_fec.h"
+
+
+/*
+ * GF(2^8) arithmetic with the polynomial x^8 + x^4 + x^3 + x^2 + 1 (0x11d).
+ */
+
+static unsigned char gf_exp[512];
+static unsigned char gf_log[256];
+
+static void GF_Init()
+{
+    static bool initialized = false;
+    if (initialized)
+        return;
+
+    int x = 1;
+    for (int i = 0; i < 255; ++i) {
+        gf_exp[i] = gf_exp[i + 255] = (unsigned char)x;
+        gf_log[x] = (unsigned char)i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= 0x11d;
+    }
+
+    initialized = true;
+}
+
+static unsigned char GF_Mul(unsigned char a, unsigned char b)
+{
+    return a && b ? gf_exp[gf_log[a] + gf_log[b]] : 0;
+}
+
+static unsigned char GF_Inv(unsigned char a)
+{
+    ASSERT(a);
+    return gf_exp[255 - gf_log[a]];
+}
+
+
+/*
+ * Multiply-accumulate kernels. A product c * x is looked up as lo[x & 0xf] ^ hi[x >> 4], which maps onto byte
+ * shuffles, so 32 (AVX2) or 16 (SSSE3) bytes are multiplied per instruction.
+ */
+
+static void MulAddScalar(char *dst, const char *src, unsigned char c, int size)
+{
+    for (int i = 0; i < size; ++i)
+        dst[i] ^= GF_Mul(c, (unsigned char)src[i]);
+}
+
+#ifdef FEC_X86
+
+static void MulTables(unsigned char c, unsigned char *lo, unsigned char *hi)
+{
+    for (int x = 0; x < 16; ++x) {
+        lo[x] = GF_Mul(c, (unsigned char)x);
+        hi[x] = GF_Mul(c, (unsigned char)(x << 4));
+    }
+}
+
+__attribute__((target("avx2")))
+static void MulAddAvx2(char *dst, const char *src, unsigned char c, int size)
+{
+    int i = 0;
+
+    if (c == 1) {
+        for (; i + 32 <= size; i += 32) {
+            __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+            __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+            _mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(d, s));
+        }
+    } else {
+        unsigned char lo[16], hi[16];
+        MulTables(c, lo, hi);
+
+        __m256i table_lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)lo));
+        __m256i table_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)hi));
+        __m256i mask = _mm256_set1_epi8(0x0f);
+
+        for (; i + 32 <= size; i += 32) {
+            __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+            __m256i p = _mm256_xor_si256(
+                _mm256_shuffle_epi8(table_lo, _mm256_and_si256(s, mask)),
+                _mm256_shuffle_epi8(table_hi, _mm256_and_si256(_mm256_srli_epi16(s, 4), mask)));
+            __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+            _mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(d, p));
+        }
+    }
+
+    MulAddScalar(dst + i, src + i, c, size - i);
+}
+
+__attribute__((target("ssse3")))
+static void MulAddSsse3(char *dst, const char *src, unsigned char c, int size)
+{
+    int i = 0;
+
+    if (c == 1) {
+        for (; i + 16 <= size; i += 16) {
+            __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+            __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+            _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(d, s));
+        }
+    } else {
+        unsigned char lo[16], hi[16];
+        MulTables(c, lo, hi);
+
+        __m128i table_lo = _mm_loadu_si128((const __m128i*)lo);
+        __m128i table_hi = _mm_loadu_si128((const __m128i*)hi);
+        __m128i mask = _mm_set1_epi8(0x0f);
+
+        for (; i + 16 <= size; i += 16) {
+            __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+            __m128i p = _mm_xor_si128(
+                _mm_shuffle_epi8(table_lo, _mm_and_si128(s, mask)),
+                _mm_shuffle_epi8(table_hi, _mm_and_si128(_mm_srli_epi16(s, 4), mask)));
+            __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+            _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(d, p));
+        }
+    }
+
+    MulAddScalar(dst + i, src + i, c, size - i);
+}
+
+#endif /* FEC_X86 */
+
+void FEC_MulAdd(char *dst, const char *src, unsigned char c, int size)
+{
+    typedef void (*MulAddFunc)(char*, const char*, unsigned char, int);
+    static MulAddFunc mul_add = NULL;
+
+    if (!mul_add) { // Pick the widest kernel the CPU supports.
+        GF_Init();
+        mul_add = MulAddScalar;
+#ifdef FEC_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            mul_add = MulAddAvx2;
+        else if (__builtin_cpu_supports("ssse3"))
+            mul_add = MulAddSsse3;
+#endif
+    }
+
+    if (c)
+        mul_add(dst, src, c, size);
+}
+
+
+/*
+ * Configuration.
+ */
+
+void FecConfig::Load()
+{
+    GF_Init();
+
+    const char *name = RDT_GetEnvString("RDT_FEC", "none");
+    if (!strcmp(name, "none")) {
+        mode = FEC_NONE;
+    } else if (!strcmp(name, "xor")) {
+        mode = FEC_XOR;
+    } else if (!strcmp(name, "rs")) {
+        mode = FEC_RS;
+    } else {
+        fprintf(stderr, "unknown FEC mode %s (expected none, xor or rs)\n", name);
+        exit(-1);
+    }
+
+    k = RDT_GetEnvInt("RDT_FEC_K", 8);
+    m = mode == FEC_RS ? RDT_GetEnvInt("RDT_FEC_M", 2) : 1;
+    // Parity packets take the sequence numbers of a block's data packets, their row is seq_no % k: M <= K.
+    if (k < 1 || k > FEC_MAX_K || m < 1 || m > FEC_MAX_M || m > k) {
+        fprintf(stderr, "invalid FEC block: K must be in [1, %d] and M in [1, min(K, %d)]\n", FEC_MAX_K,
+                FEC_MAX_M);
+        exit(-1);
+    }
+}
+
+const char *FecConfig::Name() const
+{
+    return mode == FEC_XOR ? "xor" : mode == FEC_RS ? "rs" : "none";
+}
+
+unsigned char FecConfig::Coef(int row, int index) const
+{
+    if (mode == FEC_XOR)
+        return 1;
+
+    // Cauchy matrix 1 / (x_row + y_index) with x_row = row and y_index = m + index: every square submatrix is
+    // invertible, so any M of the K + M packets of a block are enough to rebuild the rest.
+    return GF_Inv((unsigned char)(row ^ (m + index)));
+}
+
+void FEC_PutMeta(char *area, int area_size, int payload_size, bool end_of_msg, int stream, int ssn)
+{
+    char *meta = area + area_size - FEC_META_SIZE;
+    meta[0] = (char)(payload_size & 0xff);
+    meta[1] = (char)(payload_size >> 8);
+    meta[2] = (char)(stream << 1 | end_of_msg);
+    for (int i = 3; i < FEC_META_SIZE; ++i, ssn >>= 8)
+        meta[i] = (char)(ssn & 0xff);
+}
+
+void FEC_GetMeta(const char *area, int area_size, int *payload_size, bool *end_of_msg, int *stream, int *ssn)
+{
+    const unsigned char *meta = (const unsigned char*)area + area_size - FEC_META_SIZE;
+    *payload_size = meta[0] | meta[1] << 8;
+    *end_of_msg = meta[2] & 1;
+    *stream = meta[2] >> 1;
+    *ssn = 0;
+    for (int i = FEC_META_SIZE - 1; i >= 3; --i)
+        *ssn = *ssn << 8 | meta[i];
+}
+
+
+/*
+ * Encoder.
+ */
+
+FecEncoder::FecEncoder(const FecConfig &config, int area_size): config(config), area_size(area_size)
+{
+    parity = (char*)calloc(config.m, area_size);
+    ASSERT(parity);
+}
+
+FecEncoder::~FecEncoder()
+{
+    free(parity);
+}
+
+void FecEncoder::Add(int seq_no, const char *area)
+{
+    int index = seq_no % config.k;
+    for (int row = 0; row < config.m; ++row)
+        FEC_MulAdd(parity + row * area_size, area, config.Coef(row, index), area_size);
+}
+
+void FecEncoder::Reset()
+{
+    memset(parity, 0, config.m * area_size);
+}
+
+
+/*
+ * Decoder.
+ */
+
+FecDecoder::FecDecoder(const FecConfig &config, int area_size, int window): config(config), area_size(area_size)
+{
+    block_num = window / config.k + 2; // Every block that can overlap the window.
+    blocks = new Block[block_num];
+    for (int i = 0; i < block_num; ++i) {
+        blocks[i].start = -1;
+        blocks[i].syndrome = (char*)malloc(config.m * area_size);
+        ASSERT(blocks[i].syndrome);
+    }
+
+    recovered = (char*)malloc(config.m * area_size);
+    ASSERT(recovered);
+}
+
+FecDecoder::~FecDecoder()
+{
+    for (int i = 0; i < block_num; ++i)
+        free(blocks[i].syndrome);
+    delete[] blocks;
+    free(recovered);
+}
+
+FecDecoder::Block *FecDecoder::GetBlock(int start)
+{
+    Block *block = &blocks[start / config.k % block_num];
+
+    if (block->start > start) // The slot already moved on to a later block.
+        return NULL;
+
+    if (block->start < start) { // Reuse the slot.
+        block->start = start;
+        block->received = 0;
+        block->parity_rows = 0;
+        block->done = false;
+        memset(block->syndrome, 0, config.m * area_size);
+    }
+
+    return block;
+}
+
+int FecDecoder::OnData(int seq_no, const char *area)
+{
+    int index = seq_no % config.k;
+    Block *block = GetBlock(seq_no - index);
+    if (!block || block->done || block->received >> index & 1)
+        return 0;
+
+    block->received |= 1ULL << index;
+    for (int row = 0; row < config.m; ++row)
+        FEC_MulAdd(block->syndrome + row * area_size, area, config.Coef(row, index), area_size);
+
+    return TryDecode(block);
+}
+
+int FecDecoder::OnParity(int seq_no, const char *area)
+{
+    int row = seq_no % config.k;
+    Block *block = GetBlock(seq_no - row);
+    if (row >= config.m || !block || block->done || block->parity_rows >> row & 1)
+        return 0;
+
+    block->parity_rows |= 1U << row;
+    FEC_MulAdd(block->syndrome + row * area_size, area, 1, area_size);
+
+    return TryDecode(block);
+}
+
+void FecDecoder::OnReplaced(int seq_no)
+{
+    int index = seq_no % config.k;
+    Block *block = GetBlock(seq_no - index);
+    if (!block)
+        return;
+
+    // Its term of the syndrome is unknown: rebuilding the others would give garbage.
+    block->received |= 1ULL << index;
+    block->done = true;
+}
+
+const char *FecDecoder::Recovered(int i, int *seq_no) const
+{
+    *seq_no = recovered_seq_no[i];
+    return recovered + i * area_size;
+}
+
+int FecDecoder::TryDecode(Block *block)
+{
+    int missing[FEC_MAX_M], rows[FEC_MAX_M];
+    int missing_num = 0, row_num = 0;
+
+    for (int i = 0; i < config.k; ++i) {
+        if (!(block->received >> i & 1)) {
+            if (missing_num == config.m) // More losses than parity rows.
+                return 0;
+            missing[missing_num++] = i;
+        }
+    }
+
+    if (!missing_num) {
+        block->done = true;
+        return 0;
+    }
+
+    for (int row = 0; row < config.m && row_num < missing_num; ++row)
+        if (block->parity_rows >> row & 1)
+            rows[row_num++] = row;
+
+    if (row_num < missing_num) // Not enough parity yet.
+        return 0;
+
+    // The syndromes satisfy sum over missing c of Coef(rows[r], missing[c]) * data c = syndrome r. Invert that
+    // matrix by Gauss-Jordan elimination.
+    int n = missing_num;
+    unsigned char a[FEC_MAX_M][FEC_MAX_M], inv[FEC_MAX_M][FEC_MAX_M];
+    for (int r = 0; r < n; ++r) {
+        for (int c = 0; c < n; ++c) {
+            a[r][c] = config.Coef(rows[r], missing[c]);
+            inv[r][c] = r == c;
+        }
+    }
+
+    for (int c = 0; c < n; ++c) {
+        int pivot = c;
+        while (pivot < n && !a[pivot][c])
+            ++pivot;
+        if (pivot == n) // Singular, cannot happen with a Cauchy matrix.
+            return 0;
+
+        for (int j = 0; j < n; ++j) {
+            unsigned char t = a[c][j]; a[c][j] = a[pivot][j]; a[pivot][j] = t;
+            t = inv[c][j]; inv[c][j] = inv[pivot][j]; inv[pivot][j] = t;
+        }
+
+        unsigned char scale = GF_Inv(a[c][c]);
+        for (int j = 0; j < n; ++j) {
+            a[c][j] = GF_Mul(a[c][j], scale);
+            inv[c][j] = GF_Mul(inv[c][j], scale);
+        }
+
+        for (int r = 0; r < n; ++r) {
+            unsigned char factor = a[r][c];
+            if (r == c || !factor)
+                continue;
+            for (int j = 0; j < n; ++j) {
+                a[r][j] ^= GF_Mul(factor, a[c][j]);
+                inv[r][j] ^= GF_Mul(factor, inv[c][j]);
+            }
+        }
+    }
+
+    for (int c = 0; c < n; ++c) {
+        char *area = recovered + c * area_size;
+        memset(area, 0, area_size);
+        for (int r = 0; r < n; ++r)
+            FEC_MulAdd(area, block->syndrome + rows[r] * area_size, inv[c][r], area_size);
+        recovered_seq_no[c] = block->start + missing[c];
+    }
+
+    block->done = true;
+    return n;
+}
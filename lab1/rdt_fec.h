@@ -0,0 +1,116 @@
+/*
+ * FILE: rdt_fec.h
+ * DESCRIPTION: Optional forward error correction for the RDT protocol.
+ * NOTE: Data packets are grouped into blocks of K consecutive sequence numbers (block = seq_no / K). After the
+ *       last packet of a block is sent for the first time, the sender emits M parity packets for it:
+ *
+ *       xor - one parity packet, the XOR of the K payloads. Repairs a single loss per block.
+ *       rs  - M parity packets of a systematic Reed-Solomon code over GF(2^8) (Cauchy matrix). Repairs up to M
+ *             losses per block.
+ *
+ *       A parity packet has payload_size = 0 and end_of_msg set, with seq_no = first seq_no of the block + row.
+ *       Parity covers the whole payload area, so with FEC enabled every data packet stores its own payload_size,
+ *       end_of_msg, stream and ssn in the last FEC_META_SIZE bytes of the payload area, and carries that much
+ *       less data.
+ *
+ *       SKIP packets cut in place of data are encoded as data packets. A packet that becomes a SKIP after it was
+ *       encoded has its second payload byte set: its encoded payload is gone, so its block can no longer be
+ *       decoded.
+ *
+ *       Selected by RDT_FEC (none, xor or rs), RDT_FEC_K (default 8) and RDT_FEC_M (rs only, default 2, at most
+ *       K). Both ends must use the same settings.
+ */
+
+
+#ifndef _RDT_FEC_H_
+#define _RDT_FEC_H_
+
+#include "rdt_struct.h"
+#include "rdt_protocol.h"
+
+// payload_size (2 bytes), stream << 1 | end_of_msg (1 byte) and ssn (up to 3 bytes) at the end of the payload area.
+#define FEC_META_SIZE (3 + (RDT_PacketLayout::ssn_bits + 7) / 8)
+#define FEC_MAX_K 64 // Data packets per block are tracked in a 64-bit mask.
+#define FEC_MAX_M 8
+
+
+enum FecMode {
+    FEC_NONE = 0,
+    FEC_XOR,
+    FEC_RS
+};
+
+class FecConfig {
+public:
+    FecMode mode;
+    int k; // Data packets per block.
+    int m; // Parity packets per block.
+
+    FecConfig(): mode(FEC_NONE), k(8), m(1) {}
+    void Load(); // Read the configuration from the environment.
+    bool Enabled() const { return mode != FEC_NONE; }
+    const char *Name() const;
+    unsigned char Coef(int row, int index) const; // Coefficient of data packet `index` in parity row `row`.
+};
+
+// Store / load the header fields of a data packet at the end of a payload area of `area_size` bytes.
+void FEC_PutMeta(char *area, int area_size, int payload_size, bool end_of_msg, int stream, int ssn);
+void FEC_GetMeta(const char *area, int area_size, int *payload_size, bool *end_of_msg, int *stream, int *ssn);
+
+// dst ^= c * src over GF(2^8), vectorized with AVX2 or SSSE3 when the CPU supports them.
+void FEC_MulAdd(char *dst, const char *src, unsigned char c, int size);
+
+
+// Sender side: accumulates the parity of the block being sent.
+class FecEncoder {
+public:
+    FecEncoder(const FecConfig &config, int area_size);
+    ~FecEncoder();
+
+    void Add(int seq_no, const char *area); // Add the payload area of data or SKIP packet `seq_no`.
+    void Reset(); // Start the next block, once the parity of this one is sent.
+    bool BlockEnd(int seq_no) const { return seq_no % config.k == config.k - 1; }
+    const char *Parity(int row) const { return parity + row * area_size; } // Valid once the block has ended.
+
+private:
+    FecConfig config;
+    int area_size; // Bytes covered by the code in each packet.
+    char *parity; // m rows of area_size bytes.
+};
+
+
+// Receiver side: rebuilds lost data packets of a block from the packets and parity that did arrive.
+class FecDecoder {
+public:
+    FecDecoder(const FecConfig &config, int area_size, int window);
+    ~FecDecoder();
+
+    // Feed a data or parity packet. Return the number of data packets rebuilt because of it; they can be read
+    // with Recovered() until the next call.
+    int OnData(int seq_no, const char *area);
+    int OnParity(int seq_no, const char *area);
+    void OnReplaced(int seq_no); // Data packet `seq_no` arrived as a SKIP, without the payload it was encoded with.
+    const char *Recovered(int i, int *seq_no) const;
+
+private:
+    class Block {
+    public:
+        int start; // First seq_no of the block, -1 if the slot is unused.
+        unsigned long long received; // Data packets accumulated (bit i for start + i).
+        unsigned parity_rows; // Parity rows received (bit j for row j).
+        bool done; // Nothing is missing any more, or it was repaired.
+        char *syndrome; // Per row: parity ^ sum of Coef(row, i) * data i over received i.
+    };
+
+    FecConfig config;
+    int area_size;
+    int block_num; // Number of block slots.
+    Block *blocks;
+    char *recovered; // Up to m rebuilt payload areas.
+    int recovered_seq_no[FEC_MAX_M];
+
+    Block *GetBlock(int start);
+    int TryDecode(Block *block);
+};
+
+#endif /* _RDT_FEC_H_ */
@@ -45,21 +45,127 @@ static unsigned int crc32_table[256] = {
     0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94, 0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
 };
 
+// Slicing-by-8 tables: crc32_slices[k][b] is the CRC step of byte b followed by k zero bytes.
+static unsigned int crc32_slices[8][256];
+
+static bool crc32_init()
+{
+    for (int b = 0; b < 256; ++b) {
+        crc32_slices[0][b] = crc32_table[b];
+        for (int k = 1; k < 8; ++k)
+            crc32_slices[k][b] = crc32_table[crc32_slices[k - 1][b] & 0xff] ^ (crc32_slices[k - 1][b] >> 8);
+    }
+    return true;
+}
+
+static bool crc32_ready = crc32_init();
+
+// Fold 8 bytes into a running CRC.
+static inline unsigned int crc32_step8(unsigned int crc, const char *buf)
+{
+    unsigned int lo, hi;
+    memcpy(&lo, buf, 4);
+    memcpy(&hi, buf + 4, 4);
+    lo ^= crc;
+
+    return crc32_slices[7][lo & 0xff] ^ crc32_slices[6][(lo >> 8) & 0xff] ^
+        crc32_slices[5][(lo >> 16) & 0xff] ^ crc32_slices[4][lo >> 24] ^
+        crc32_slices[3][hi & 0xff] ^ crc32_slices[2][(hi >> 8) & 0xff] ^
+        crc32_slices[1][(hi >> 16) & 0xff] ^ crc32_slices[0][hi >> 24];
+}
+
 static unsigned int crc32(const char *buf, int size)
 {
+    ASSERT(crc32_ready);
+
     unsigned int result = 0xffffffff;
 
-    while (size--)
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; size >= 8; size -= 8, buf += 8)
+        result = crc32_step8(result, buf);
+#endif
+
+    for (; size > 0; --size)
         result = crc32_table[(result ^ *buf++) & 0xff] ^ (result >> 8);
 
     return ~result;
 }
 
+// CRC of `n` buffers of `size` bytes each. The table lookups of one buffer form a serial dependency chain, so
+// up to RDT_CRC_LANES buffers are processed in lockstep to keep several chains in flight at once.
+#define RDT_CRC_LANES 4
+
+static void crc32_multi(const char **bufs, int n, int size, unsigned int *results)
+{
+    ASSERT(crc32_ready);
+
+    for (; n > 0; n -= RDT_CRC_LANES, bufs += RDT_CRC_LANES, results += RDT_CRC_LANES) {
+        if (n < RDT_CRC_LANES) { // Not enough buffers left to interleave.
+            for (int lane = 0; lane < n; ++lane)
+                results[lane] = crc32(bufs[lane], size);
+            return;
+        }
+
+        unsigned int crc[RDT_CRC_LANES];
+        for (int lane = 0; lane < RDT_CRC_LANES; ++lane)
+            crc[lane] = 0xffffffff;
+
+        int offset = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        for (; offset + 8 <= size; offset += 8)
+            for (int lane = 0; lane < RDT_CRC_LANES; ++lane)
+                crc[lane] = crc32_step8(crc[lane], bufs[lane] + offset);
+#endif
+
+        for (; offset < size; ++offset)
+            for (int lane = 0; lane < RDT_CRC_LANES; ++lane)
+                crc[lane] = crc32_table[(crc[lane] ^ bufs[lane][offset]) & 0xff] ^ (crc[lane] >> 8);
+
+        for (int lane = 0; lane < RDT_CRC_LANES; ++lane)
+            results[lane] = ~crc[lane];
+    }
+}
+
+void RDT_SetHeader(packet *pkt, int payload_size, bool end_of_msg, int seq_no, int stream, int ssn)
+{
+    ASSERT(pkt);
+    ASSERT(payload_size >= 0 && payload_size <= RDT_MAX_PAYLOAD_SIZE);
+    ASSERT(stream >= 0 && stream < RDT_MAX_STREAMS);
+
+    unsigned long header = (unsigned long)(ssn & RDT_MAX_SSN);
+    header = header << RDT_PacketLayout::stream_bits | stream;
+    header = header << RDT_PacketLayout::seq_no_bits | (seq_no & RDT_MAX_SEQ_NO);
+    header = header << RDT_PAYLOAD_SIZE_BITS | payload_size;
+    header = header << RDT_END_OF_MSG_BITS | end_of_msg;
+
+    for (int i = 0; i < RDT_HEADER_SIZE; ++i, header >>= 8)
+        pkt->data[i] = (char)(header & 0xff);
+}
+
+void RDT_GetHeader(const packet *pkt, int *payload_size, bool *end_of_msg, int *seq_no, int *stream, int *ssn)
+{
+    ASSERT(pkt);
+
+    unsigned long header = 0;
+    for (int i = RDT_HEADER_SIZE - 1; i >= 0; --i)
+        header = header << 8 | (unsigned char)pkt->data[i];
+
+    *end_of_msg = header & 1;
+    header >>= RDT_END_OF_MSG_BITS;
+    *payload_size = (int)(header & ((1UL << RDT_PAYLOAD_SIZE_BITS) - 1));
+    header >>= RDT_PAYLOAD_SIZE_BITS;
+    *seq_no = (int)(header & RDT_MAX_SEQ_NO);
+    header >>= RDT_PacketLayout::seq_no_bits;
+    *stream = (int)(header & (RDT_MAX_STREAMS - 1));
+    header >>= RDT_PacketLayout::stream_bits;
+    *ssn = (int)(header & RDT_MAX_SSN);
+}
+
 void RDT_AddChecksum(packet *pkt)
 {
     ASSERT(pkt);
 
-    unsigned int checksum = crc32(pkt->data, RDT_HEADER_SIZE + RDT_MAX_PAYLOAD_SIZE);
+    RDT_PacketLayout::checksum_type checksum = crc32(pkt->data, RDT_HEADER_SIZE + RDT_MAX_PAYLOAD_SIZE);
     memcpy(pkt->data + RDT_HEADER_SIZE + RDT_MAX_PAYLOAD_SIZE, (char*)&checksum, RDT_CHECKSUM_SIZE);
 }
 
@@ -67,8 +173,95 @@ bool RDT_VerifyChecksum(packet *pkt)
 {
     ASSERT(pkt);
 
-    unsigned int checksum = crc32(pkt->data, RDT_HEADER_SIZE + RDT_MAX_PAYLOAD_SIZE);
-    unsigned int footer_checksum = *(unsigned int*)(pkt->data + RDT_HEADER_SIZE + RDT_MAX_PAYLOAD_SIZE);
+    RDT_PacketLayout::checksum_type checksum = crc32(pkt->data, RDT_HEADER_SIZE + RDT_MAX_PAYLOAD_SIZE);
+    RDT_PacketLayout::checksum_type footer_checksum;
+    memcpy((char*)&footer_checksum, pkt->data + RDT_HEADER_SIZE + RDT_MAX_PAYLOAD_SIZE, RDT_CHECKSUM_SIZE);
 
     return checksum == footer_checksum;
 }
+
+void RDT_AddChecksumBurst(packet **pkts, int n)
+{
+    ASSERT(pkts && n >= 0 && n <= RDT_MAX_BURST);
+
+    const char *bufs[RDT_MAX_BURST];
+    unsigned int crcs[RDT_MAX_BURST];
+    for (int i = 0; i < n; ++i)
+        bufs[i] = pkts[i]->data;
+
+    crc32_multi(bufs, n, RDT_HEADER_SIZE + RDT_MAX_PAYLOAD_SIZE, crcs);
+
+    for (int i = 0; i < n; ++i) {
+        RDT_PacketLayout::checksum_type checksum = crcs[i];
+        memcpy(pkts[i]->data + RDT_HEADER_SIZE + RDT_MAX_PAYLOAD_SIZE, (char*)&checksum, RDT_CHECKSUM_SIZE);
+    }
+}
+
+int RDT_VerifyChecksumBurst(packet **pkts, int n, bool *valid)
+{
+    ASSERT(pkts && valid && n >= 0 && n <= RDT_MAX_BURST);
+
+    const char *bufs[RDT_MAX_BURST];
+    unsigned int crcs[RDT_MAX_BURST];
+    for (int i = 0; i < n; ++i)
+        bufs[i] = pkts[i]->data;
+
+    crc32_multi(bufs, n, RDT_HEADER_SIZE + RDT_MAX_PAYLOAD_SIZE, crcs);
+
+    int valid_num = 0;
+    for (int i = 0; i < n; ++i) {
+        RDT_PacketLayout::checksum_type checksum = crcs[i];
+        RDT_PacketLayout::checksum_type footer_checksum;
+        memcpy((char*)&footer_checksum, pkts[i]->data + RDT_HEADER_SIZE + RDT_MAX_PAYLOAD_SIZE, RDT_CHECKSUM_SIZE);
+        valid[i] = checksum == footer_checksum;
+        valid_num += valid[i];
+    }
+
+    return valid_num;
+}
+
+int RDT_PutVarint(char *buf, unsigned int value)
+{
+    int size = 0;
+
+    while (value >= 0x80) {
+        buf[size++] = (char)(value | 0x80);
+        value >>= 7;
+    }
+    buf[size++] = (char)value;
+
+    return size;
+}
+
+int RDT_GetVarint(const char *buf, int size, unsigned int *value)
+{
+    *value = 0;
+
+    for (int i = 0; i < size && i < RDT_MAX_VARINT_SIZE; ++i) {
+        *value |= (unsigned int)(buf[i] & 0x7f) << (7 * i);
+        if (!(buf[i] & 0x80))
+            return i + 1;
+    }
+
+    return 0; // Truncated or too long.
+}
+
+const char *RDT_GetEnvString(const char *name, const char *default_value)
+{
+    ASSERT(name);
+
+    const char *value = getenv(name);
+    return value && *value ? value : default_value;
+}
+
+int RDT_GetEnvInt(const char *name, int default_value)
+{
+    const char *value = RDT_GetEnvString(name, NULL);
+    return value ? atoi(value) : default_value;
+}
+
+double RDT_GetEnvDouble(const char *name, double default_value)
+{
+    const char *value = RDT_GetEnvString(name, NULL);
+    return value ? atof(value) : default_value;
+}
@@ -1,13 +1,27 @@
 /*
  * FILE: rdt_protocol.h
  * DESCRIPTION: Common constants and functions used by the RDT protocol.
- * NOTE: In this implementation, the packet format is laid out as the following:
+ * NOTE: In this implementation, the packet format is laid out as the following (sizes for 128-byte packets):
  *
- *       |<-           header 4 bytes           ->|
- *       |<-  7 bits  ->|<- 1 bit ->|<- 3 bytes ->|<  120 bytes ->|<- 4 bytes ->|
- *       | payload_size |end_of_msg |   seq_no    |    payload    |   checksum  |
+ *       |<-                         header 7 bytes                         ->|
+ *       |<- 1 bit ->|<-  7 bits  ->|<- 3 bytes ->|<- 4 bits ->|<- 2 bytes ->|<  117 bytes ->|<- 4 bytes ->|
+ *       |end_of_msg | payload_size |   seq_no    |   stream   |     ssn     |    payload    |   checksum  |
  *
- *       payload_size = 0 indicates an ACK packet instead of a data packet.
+ *       The header is a little-endian bit field, so for 128-byte packets the first byte holds
+ *       payload_size << 1 | end_of_msg. payload_size = 0 indicates an ACK packet instead of a data packet.
+ *       From the sender, payload_size = 0 indicates a SKIP packet: the sender has abandoned the message the
+ *       packet `seq_no` belonged to after its deadline. The first payload byte tells whether that packet was the
+ *       end of the message, the second whether it replaces a data packet already sent (see rdt_fec.h).
+ *
+ *       seq_no orders all packets of the connection and is what gets ACKed and retransmitted. Messages are sent
+ *       on one of RDT_MAX_STREAMS independent streams; ssn numbers the data packets of each stream, so the
+ *       receiver can deliver a stream in order while a loss on another stream is still being repaired. Both
+ *       are 0 in ACK and parity packets.
+ *
+ *       The layout is computed at compile time by RDT_Layout from the packet size (RDT_PKTSIZE), the width of
+ *       seq_no (RDT_SEQ_NO_BITS), stream (RDT_STREAM_BITS) and ssn (RDT_SSN_BITS), and the width of the
+ *       checksum (RDT_CHECKSUM_TYPE). payload_size gets just enough bits for the largest payload, e.g. 11 bits for
+ *       1500-byte packets (7-byte header) and 14 bits for 9000-byte packets (8-byte header).
  */
 
 
@@ -16,18 +30,96 @@
 
 #include "rdt_struct.h"
 
-#define RDT_PAYLOAD_SIZE_BITS 7
-#define RDT_END_OF_MSG_BITS 1
-#define RDT_SEQ_NO_SIZE 3
-#define RDT_SEQ_NO_BITS (RDT_SEQ_NO_SIZE * 8)
-// #define RDT_MAX_SEQ_NO ((1 << RDT_SEQ_NO_BITS) - 1)
-#define RDT_MAX_SEQ_NO ((1 << (RDT_SEQ_NO_BITS - 4)) - 1) // Reduce memory usage.
-#define RDT_HEADER_SIZE ((RDT_PAYLOAD_SIZE_BITS + RDT_END_OF_MSG_BITS + RDT_SEQ_NO_BITS) / 8)
-#define RDT_CHECKSUM_SIZE sizeof(unsigned int)
-#define RDT_MAX_PAYLOAD_SIZE (RDT_PKTSIZE - RDT_HEADER_SIZE - RDT_CHECKSUM_SIZE)
+#ifndef RDT_SEQ_NO_BITS
+#define RDT_SEQ_NO_BITS 24
+#endif
+
+#ifndef RDT_STREAM_BITS
+#define RDT_STREAM_BITS 4
+#endif
+
+#ifndef RDT_SSN_BITS
+#define RDT_SSN_BITS 16
+#endif
+
+// The checksum is always a CRC32, stored in this type: a narrower unsigned type keeps its low bits only (e.g.
+// unsigned short for a CRC32 truncated to 16 bits), not a checksum of its own.
+#ifndef RDT_CHECKSUM_TYPE
+#define RDT_CHECKSUM_TYPE unsigned int
+#endif
+
+// Number of bits needed to represent `value`.
+constexpr int RDT_BitWidth(unsigned long value)
+{
+    return value ? 1 + RDT_BitWidth(value >> 1) : 0;
+}
+
+template <int PktSize, int SeqNoBits, int StreamBits, int SsnBits, typename Checksum>
+struct RDT_Layout {
+    typedef Checksum checksum_type;
+    static_assert(sizeof(Checksum) <= 4 && Checksum(-1) > 0, "the checksum is an unsigned CRC32 of up to 32 bits");
+
+    static constexpr int pkt_size = PktSize;
+    static constexpr int checksum_size = sizeof(Checksum);
+    static constexpr int end_of_msg_bits = 1;
+    static constexpr int seq_no_bits = SeqNoBits;
+    static constexpr int max_seq_no = (1 << SeqNoBits) - 1;
+    static constexpr int stream_bits = StreamBits;
+    static constexpr int max_streams = 1 << StreamBits;
+    static constexpr int ssn_bits = SsnBits;
+    static constexpr int max_ssn = (1 << SsnBits) - 1;
 
+    // Size payload_size for the largest payload the packet could hold with a header of the other fields only.
+    static constexpr int payload_size_bits =
+        RDT_BitWidth(PktSize - checksum_size - (end_of_msg_bits + seq_no_bits + stream_bits + ssn_bits + 7) / 8);
+    static constexpr int header_bits = end_of_msg_bits + payload_size_bits + seq_no_bits + stream_bits + ssn_bits;
+    static constexpr int header_size = (header_bits + 7) / 8;
+    static constexpr int max_payload_size = PktSize - header_size - checksum_size;
 
+    static_assert(header_bits <= 64, "header must fit in a 64-bit word");
+    static_assert(SeqNoBits < 31, "seq_no must fit in an int with room for comparisons");
+    static_assert(StreamBits <= 8, "stream must fit in a byte");
+    static_assert(SsnBits < 31, "ssn must fit in an int with room for comparisons");
+    static_assert(max_payload_size > 0, "packet too small for header and checksum");
+    static_assert(max_payload_size < (1 << payload_size_bits), "payload_size field too narrow");
+};
+
+typedef RDT_Layout<RDT_PKTSIZE, RDT_SEQ_NO_BITS, RDT_STREAM_BITS, RDT_SSN_BITS, RDT_CHECKSUM_TYPE> RDT_PacketLayout;
+
+#define RDT_PAYLOAD_SIZE_BITS RDT_PacketLayout::payload_size_bits
+#define RDT_END_OF_MSG_BITS RDT_PacketLayout::end_of_msg_bits
+#define RDT_MAX_SEQ_NO RDT_PacketLayout::max_seq_no
+#define RDT_MAX_STREAMS RDT_PacketLayout::max_streams
+#define RDT_MAX_SSN RDT_PacketLayout::max_ssn
+
+#define RDT_MAX_PRIORITY 7 // Message priorities are 0 (default) to RDT_MAX_PRIORITY, higher is sent first.
+#define RDT_HEADER_SIZE RDT_PacketLayout::header_size
+#define RDT_CHECKSUM_SIZE RDT_PacketLayout::checksum_size
+#define RDT_MAX_PAYLOAD_SIZE RDT_PacketLayout::max_payload_size
+
+
+// Write the header of a packet.
+void RDT_SetHeader(packet *pkt, int payload_size, bool end_of_msg, int seq_no, int stream, int ssn);
+// Read it back.
+void RDT_GetHeader(const packet *pkt, int *payload_size, bool *end_of_msg, int *seq_no, int *stream, int *ssn);
 void RDT_AddChecksum(packet *pkt); // Calculate checksum of a packet and put it into the footer.
 bool RDT_VerifyChecksum(packet *pkt); // Verify checksum of a packet.
 
+// Burst I/O hands over up to RDT_MAX_BURST packets at once. The checksums of a burst are computed together,
+// several packets interleaved.
+#define RDT_MAX_BURST 32
+void RDT_AddChecksumBurst(packet **pkts, int n);
+int RDT_VerifyChecksumBurst(packet **pkts, int n, bool *valid); // Set valid[i] per packet, return the number valid.
+
+// Message framing used when several messages share a packet: every message is preceded by its size as a
+// little-endian base-128 varint (one byte for sizes below 128).
+#define RDT_MAX_VARINT_SIZE 5
+int RDT_PutVarint(char *buf, unsigned int value); // Return the number of bytes written.
+int RDT_GetVarint(const char *buf, int size, unsigned int *value); // Return the number of bytes read, 0 if invalid.
+
+// Runtime tunables are read from environment variables, since the simulator command line is fixed.
+const char *RDT_GetEnvString(const char *name, const char *default_value);
+int RDT_GetEnvInt(const char *name, int default_value);
+double RDT_GetEnvDouble(const char *name, double default_value);
+
 #endif /* _RDT_PROTOCOL_H_ */
@@ -12,19 +12,62 @@
 #include "rdt_struct.h"
 #include "rdt_receiver.h"
 #include "rdt_protocol.h"
+#include "rdt_fec.h"
 
 
-int last_end_of_msg = -1; // Last position of end_of_msg.
+const int recv_window = 1024; // Number of packets the receive ring can hold (power of 2).
+int ring_floor = 0; // First sequence number still holding its slot in the ring. Everything before it is done.
 
 class ReceiveInfo {
 public:
-    bool received; // Whether the packet has been received.
+    int seq_no; // Sequence number of the packet held in this slot, -1 if none.
+    int ssn; // Its sequence number in its stream.
+    unsigned short payload_size; // Payload size (only the last packet of a message may be shorter), 0 for SKIP.
+    unsigned char stream;
     bool is_end; // Whether the packet is end of a message.
-    std::string data; // Data contained in the packet.
-    ReceiveInfo(): received(false), is_end(false) {}
+    bool released; // Whether its payload has been delivered or spilled, so the slot can be reused.
+    ReceiveInfo(): seq_no(-1), ssn(0), payload_size(0), stream(0), is_end(false), released(false) {}
 };
 
-ReceiveInfo receiver_packets[RDT_MAX_SEQ_NO]; // Status of all packets (indexed by seq_no) on the receiver side.
+// Receive ring. The payload of packet `seq_no` is written once, at offset
+// (seq_no % recv_window) * receiver_segment_size, so that the packets of a message lie back to back and can be
+// delivered without copying, as long as no other stream has sent in between.
+ReceiveInfo receiver_packets[recv_window]; // Status of the packets in the ring (indexed by seq_no % recv_window).
+char receiver_buffer[recv_window * RDT_MAX_PAYLOAD_SIZE]; // Payloads of the packets in the ring.
+
+// Streams are reassembled and delivered independently, so a loss only holds back its own stream. The message
+// being reassembled on a stream is kept as a run of consecutive packets in the ring. A run that is broken by
+// packets of other streams, would wrap around the end of the ring, or fills half of it, is moved to the spill
+// buffer of the stream. Spill buffers keep their capacity across messages, so they stop allocating once they have
+// seen the largest message.
+class ReceiveStream {
+public:
+    int next_ssn; // First ssn not received yet. Everything before it has been received.
+    int run_start; // First sequence number of the run of the message being reassembled, -1 if no run.
+    int run_end; // Last sequence number of the run.
+    bool dropping; // Whether the rest of the current message is dropped (the sender has abandoned it).
+    int seq_nos[recv_window]; // Sequence numbers of received packets (indexed by ssn % recv_window).
+    std::string spill;
+    ReceiveStream(): next_ssn(0), run_start(-1), run_end(-1), dropping(false) {}
+};
+
+ReceiveStream receiver_streams[RDT_MAX_STREAMS];
+size_t spill_high_water = 0;
+
+FecConfig receiver_fec; // Forward error correction settings (RDT_FEC), must match the sender.
+FecDecoder *fec_decoder = NULL; // NULL without FEC.
+int receiver_segment_size = RDT_MAX_PAYLOAD_SIZE; // Data bytes in every packet but the last one of a message.
+bool receiver_coalescing = false; // Whether messages are framed and packed back to back (RDT_COALESCE).
+int data_received = 0; // Statistics: number of distinct data packets received.
+int repaired = 0; // Statistics: number of data packets rebuilt by FEC.
+int abandoned = 0; // Statistics: number of messages dropped because of SKIP packets.
+
+packet ack_batch[RDT_MAX_BURST]; // ACKs waiting for the end of the current burst.
+int ack_num = 0;
+int bursts_received = 0; // Statistics: number of bursts from the lower layer.
+int burst_packets = 0; // Statistics: number of packets in them.
+int ack_bursts = 0; // Statistics: number of ACK bursts sent.
+int acks_sent = 0; // Statistics: number of ACKs in them.
 
 
 /* receiver initialization, called once at the very beginning */
@@ -32,9 +75,13 @@ void Receiver_Init()
 {
     fprintf(stdout, "At %.2fs: receiver initializing ...\n", GetSimulationTime());
 
-    // Mark all packet sequence numbers as not received.
-    for (int i = 0; i < RDT_MAX_SEQ_NO; ++i)
-        receiver_packets[i].received = false;
+    receiver_coalescing = RDT_GetEnvInt("RDT_COALESCE", 0);
+
+    receiver_fec.Load();
+    if (receiver_fec.Enabled()) {
+        fec_decoder = new FecDecoder(receiver_fec, RDT_MAX_PAYLOAD_SIZE, recv_window);
+        receiver_segment_size = RDT_MAX_PAYLOAD_SIZE - FEC_META_SIZE;
+    }
 }
 
 /* receiver finalization, called once at the very end.
@@ -44,90 +91,327 @@ void Receiver_Init()
 void Receiver_Final()
 {
     fprintf(stdout, "At %.2fs: receiver finalizing ...\n", GetSimulationTime());
-}
+    fprintf(stdout, "At %.2fs: receiver spill high-water %d bytes\n", GetSimulationTime(), (int)spill_high_water);
 
-// Parse data and metadata from a packet.
-bool Receiver_ParsePacket(packet *pkt, int *payload_size, bool *end_of_msg, int *seq_no, char *payload)
-{
-    if (!RDT_VerifyChecksum(pkt)) // Packet corrupted.
-        return false;
+    int streams_used = 0;
+    for (int i = 0; i < RDT_MAX_STREAMS; ++i)
+        streams_used += receiver_streams[i].next_ssn > 0;
+    fprintf(stdout, "At %.2fs: receiver got data on %d streams\n", GetSimulationTime(), streams_used);
+    if (bursts_received && ack_bursts)
+        fprintf(stdout, "At %.2fs: receiver got %.2f packets per burst, sent %.2f ACKs per burst\n",
+            GetSimulationTime(), (double)burst_packets / bursts_received, (double)acks_sent / ack_bursts);
+    if (abandoned)
+        fprintf(stdout, "At %.2fs: receiver dropped %d messages abandoned by the sender\n", GetSimulationTime(),
+            abandoned);
 
-    // Parse payload size;
-    *payload_size = pkt->data[0] >> 1 & ((1 << RDT_PAYLOAD_SIZE_BITS) - 1);
-    if (*payload_size <= 0 || *payload_size > (int)RDT_MAX_PAYLOAD_SIZE) // Invalid payload size.
-        return false;
-
-    // Parse end_of_msg.
-    *end_of_msg = pkt->data[0] & 1;
+    if (fec_decoder) {
+        fprintf(stdout, "At %.2fs: receiver got %d data packets and repaired %d more by FEC (repair rate %.2f%%)\n",
+            GetSimulationTime(), data_received, repaired,
+            repaired ? 100.0 * repaired / (data_received + repaired) : 0.0);
+        delete fec_decoder;
+        fec_decoder = NULL;
+    }
+}
 
-    // Parse seq_no.
-    *seq_no = *(int*)(pkt->data + 1) & ((1 << RDT_SEQ_NO_BITS) - 1);
+// Parse metadata from a packet whose checksum has been verified. The payload is left in place. FEC parity and SKIP
+// packets have a payload size of 0.
+bool Receiver_ParsePacket(packet *pkt, int *payload_size, bool *end_of_msg, int *seq_no, int *stream, int *ssn)
+{
+    RDT_GetHeader(pkt, payload_size, end_of_msg, seq_no, stream, ssn);
 
-    // Parse data (payload).
-    memcpy(payload, pkt->data + RDT_HEADER_SIZE, *payload_size);
+    if (!*payload_size) // SKIP or parity.
+        return !*end_of_msg || fec_decoder != NULL;
 
-    return true;
+    return *payload_size <= receiver_segment_size;
 }
 
 // Construct an ACK packet.
 void Receiver_ConstructAck(int seq_no, packet *pkt)
 {
-    ASSERT(seq_no >= 0 && seq_no <= RDT_MAX_SEQ_NO);
     ASSERT(pkt);
 
     // Set seq_no in header.
-    pkt->data[0] = 0;
-    memcpy(pkt->data + 1, (char*)&seq_no, RDT_SEQ_NO_SIZE);
+    RDT_SetHeader(pkt, 0, false, seq_no, 0, 0);
 
     // Pad payload with zero bytes.
     memset(pkt->data + RDT_HEADER_SIZE, 0, RDT_MAX_PAYLOAD_SIZE);
 
-    // Add checksum.
-    RDT_AddChecksum(pkt);
+    // The checksum is added when the batch is flushed.
 }
 
-/* event handler, called when a packet is passed from the lower layer at the
-   receiver */
-void Receiver_FromLowerLayer(struct packet *pkt)
+// Pass the pending ACKs to the lower layer as one burst.
+void Receiver_FlushAcks()
+{
+    if (!ack_num)
+        return;
+
+    packet *pkts[RDT_MAX_BURST];
+    for (int i = 0; i < ack_num; ++i)
+        pkts[i] = &ack_batch[i];
+
+    RDT_AddChecksumBurst(pkts, ack_num);
+    Receiver_ToLowerLayerBurst(pkts, ack_num);
+    ++ack_bursts;
+    acks_sent += ack_num;
+    ack_num = 0;
+}
+
+// Queue an ACK for `seq_no`. ACKs are sent together at the end of the burst being processed.
+void Receiver_Ack(int seq_no)
+{
+    if (ack_num == RDT_MAX_BURST)
+        Receiver_FlushAcks();
+
+    Receiver_ConstructAck(seq_no, &ack_batch[ack_num++]);
+}
+
+// Payload of a packet in the ring.
+char *Receiver_Payload(int seq_no)
+{
+    return receiver_buffer + (seq_no & (recv_window - 1)) * receiver_segment_size;
+}
+
+// Mark the packets from `first` to `last` as no longer needed, and let the ring floor move past them.
+void Receiver_Release(int first, int last)
+{
+    for (int i = first; i <= last; ++i)
+        receiver_packets[i & (recv_window - 1)].released = true;
+
+    while (receiver_packets[ring_floor & (recv_window - 1)].seq_no == ring_floor &&
+        receiver_packets[ring_floor & (recv_window - 1)].released)
+        ++ring_floor;
+}
+
+// Move the run of a stream into its spill buffer.
+void Receiver_Spill(ReceiveStream *stream)
+{
+    stream->spill.append(Receiver_Payload(stream->run_start),
+        (stream->run_end - stream->run_start + 1) * receiver_segment_size);
+    Receiver_Release(stream->run_start, stream->run_end);
+    stream->run_start = -1;
+}
+
+// Pass the contents of a complete run of packets to the upper layer. When coalescing, it holds framed messages,
+// which are split out in place.
+void Receiver_DeliverData(int stream, char *data, int size)
 {
-    int payload_size;
-    bool end_of_msg;
-    int seq_no;
-    char payload[RDT_MAX_PAYLOAD_SIZE];
-    std::string message;
     struct message msg;
 
-    if (!Receiver_ParsePacket(pkt, &payload_size, &end_of_msg, &seq_no, payload)) // Invalid packet. Do not ACK.
+    if (!receiver_coalescing) {
+        msg.size = size;
+        msg.data = data;
+        Receiver_ToUpperLayerOnStream(stream, &msg);
         return;
+    }
 
-    // Reply ACK.
-    packet ackpkt;
-    Receiver_ConstructAck(seq_no, &ackpkt);
-    Receiver_ToLowerLayer(&ackpkt);
-
-    // Record packet.
-    receiver_packets[seq_no].received = true;
-    receiver_packets[seq_no].is_end = end_of_msg;
-    receiver_packets[seq_no].data = std::string(payload, payload_size);
-
-    // Try to do message reassembly.
-    for (int i = last_end_of_msg + 1; i <= RDT_MAX_SEQ_NO; ++i) {
-        if (!receiver_packets[i].received) // No continuous parts to concatenate.
+    while (size > 0) {
+        unsigned int msg_size;
+        int prefix_size = RDT_GetVarint(data, size, &msg_size);
+        if (!prefix_size || msg_size > (unsigned int)(size - prefix_size)) { // Broken framing.
+            fprintf(stdout, "At %.2fs: receiver dropped %d bytes with broken framing\n", GetSimulationTime(), size);
+            return;
+        }
+
+        msg.size = msg_size;
+        msg.data = data + prefix_size;
+        Receiver_ToUpperLayerOnStream(stream, &msg);
+
+        data += prefix_size + msg_size;
+        size -= prefix_size + msg_size;
+    }
+}
+
+// Deliver the message of a stream, whose last packet ends its run, to the upper layer.
+void Receiver_Deliver(int stream_id)
+{
+    ReceiveStream *stream = &receiver_streams[stream_id];
+    int size = (stream->run_end - stream->run_start) * receiver_segment_size +
+        receiver_packets[stream->run_end & (recv_window - 1)].payload_size;
+
+    if (stream->spill.empty()) { // The whole message is in the ring, hand it out in place.
+        Receiver_DeliverData(stream_id, Receiver_Payload(stream->run_start), size);
+    } else {
+        stream->spill.append(Receiver_Payload(stream->run_start), size);
+        if (stream->spill.size() > spill_high_water)
+            spill_high_water = stream->spill.size();
+
+        Receiver_DeliverData(stream_id, &stream->spill[0], stream->spill.size());
+        stream->spill.clear();
+    }
+
+    Receiver_Release(stream->run_start, stream->run_end);
+    stream->run_start = -1;
+}
+
+// Extend the received prefix of a stream, delivering every message it completes.
+void Receiver_Advance(int stream_id)
+{
+    ReceiveStream *stream = &receiver_streams[stream_id];
+
+    for (;;) {
+        int seq_no = stream->seq_nos[stream->next_ssn & (recv_window - 1)];
+        const ReceiveInfo *info = &receiver_packets[seq_no & (recv_window - 1)];
+        if (seq_no < ring_floor || info->seq_no != seq_no || info->stream != stream_id ||
+            info->ssn != stream->next_ssn)
             break;
 
-        if (receiver_packets[i].is_end) {
-            message.clear();
+        if (!info->payload_size && !stream->dropping) { // SKIP. Drop what we have of the message, and the rest.
+            if (stream->run_start >= 0)
+                Receiver_Release(stream->run_start, stream->run_end);
+            stream->run_start = -1;
+            stream->spill.clear();
+            stream->dropping = true;
+            ++abandoned;
+        }
+
+        if (stream->dropping) {
+            Receiver_Release(seq_no, seq_no);
+            stream->dropping = !info->is_end;
+            ++stream->next_ssn;
+            continue;
+        }
+
+        // Keep the run consecutive in the ring, without wrapping around its end.
+        if (stream->run_start >= 0 && (seq_no != stream->run_end + 1 || !(seq_no & (recv_window - 1))))
+            Receiver_Spill(stream);
+
+        if (stream->run_start < 0)
+            stream->run_start = seq_no;
+        stream->run_end = seq_no;
+        ++stream->next_ssn;
+
+        if (info->is_end)
+            Receiver_Deliver(stream_id);
+        else if (stream->run_end - stream->run_start + 1 >= recv_window / 2) // Do not block the window.
+            Receiver_Spill(stream);
+    }
+}
+
+// Record a data packet and reply ACK. Return false if it was a duplicate or could not be kept.
+bool Receiver_Accept(int seq_no, int payload_size, bool end_of_msg, int stream_id, int ssn, const char *payload)
+{
+    if (seq_no >= ring_floor + recv_window) { // No room in the ring.
+        // Spill the runs still holding the floor back, then try again.
+        for (int i = 0; i < RDT_MAX_STREAMS; ++i)
+            if (receiver_streams[i].run_start >= 0)
+                Receiver_Spill(&receiver_streams[i]);
+
+        if (seq_no >= ring_floor + recv_window) // Do not ACK, the sender will retry.
+            return false;
+    }
+
+    if (payload_size && !end_of_msg && payload_size != receiver_segment_size) // Only the last part can be short.
+        return false;
+
+    // Recover the full stream sequence number from its low bits.
+    ReceiveStream *stream = &receiver_streams[stream_id];
+    int delta = (ssn - stream->next_ssn) & RDT_MAX_SSN;
+    ssn = stream->next_ssn + (delta <= RDT_MAX_SSN / 2 ? delta : delta - RDT_MAX_SSN - 1);
+
+    // Reply ACK.
+    Receiver_Ack(seq_no);
+
+    ReceiveInfo *info = &receiver_packets[seq_no & (recv_window - 1)];
+    if (seq_no < ring_floor || info->seq_no == seq_no || ssn < stream->next_ssn) // Duplicate.
+        return false;
+
+    // Record packet, writing its payload at its final place.
+    info->seq_no = seq_no;
+    info->ssn = ssn;
+    info->payload_size = payload_size;
+    info->stream = stream_id;
+    info->is_end = end_of_msg;
+    info->released = false;
+    memcpy(Receiver_Payload(seq_no), payload, payload_size);
+    stream->seq_nos[ssn & (recv_window - 1)] = seq_no;
+
+    Receiver_Advance(stream_id);
+    return true;
+}
+
+// Accept the data packets FEC has just rebuilt.
+void Receiver_Repair(int recovered_num)
+{
+    for (int i = 0; i < recovered_num; ++i) {
+        int seq_no, payload_size, stream, ssn;
+        bool end_of_msg;
+        const char *area = fec_decoder->Recovered(i, &seq_no);
+
+        FEC_GetMeta(area, RDT_MAX_PAYLOAD_SIZE, &payload_size, &end_of_msg, &stream, &ssn);
+        if (payload_size > receiver_segment_size || stream >= RDT_MAX_STREAMS)
+            continue; // Garbage, the block was not what we assumed.
+
+        if (!payload_size) // SKIP.
+            end_of_msg = area[0] != 0;
+
+        if (Receiver_Accept(seq_no, payload_size, end_of_msg, stream, ssn, area))
+            ++repaired;
+    }
+}
+
+// Process a packet whose checksum has been verified.
+void Receiver_Process(packet *pkt)
+{
+    int payload_size;
+    bool end_of_msg;
+    int seq_no, stream, ssn;
+
+    // Invalid packet. Do not ACK.
+    if (!Receiver_ParsePacket(pkt, &payload_size, &end_of_msg, &seq_no, &stream, &ssn))
+        return;
 
-            // Concatenate message parts.
-            for (int j = last_end_of_msg + 1; j <= i; ++j)
-                message += receiver_packets[j].data;
+    // Recover the full sequence number from its low bits, relative to the ring floor.
+    int delta = (seq_no - ring_floor) & RDT_MAX_SEQ_NO;
+    seq_no = ring_floor + (delta <= RDT_MAX_SEQ_NO / 2 ? delta : delta - RDT_MAX_SEQ_NO - 1);
 
-            // Deliver to upper layer.
-            msg.size = message.size();
-            msg.data = (char*)(long)message.c_str();
-            Receiver_ToUpperLayer(&msg);
+    const char *area = pkt->data + RDT_HEADER_SIZE;
 
-            last_end_of_msg = i;
+    if (!payload_size && end_of_msg) { // FEC parity.
+        Receiver_Repair(fec_decoder->OnParity(seq_no, area));
+        return;
+    }
+
+    if (!payload_size) { // SKIP. Part of its FEC block, unless it replaced a data packet after being encoded.
+        if (Receiver_Accept(seq_no, 0, area[0] != 0, stream, ssn, area) && fec_decoder) {
+            if (area[1])
+                fec_decoder->OnReplaced(seq_no);
+            else
+                Receiver_Repair(fec_decoder->OnData(seq_no, area));
         }
+        return;
     }
+
+    if (!Receiver_Accept(seq_no, payload_size, end_of_msg, stream, ssn, area))
+        return;
+
+    ++data_received;
+    if (fec_decoder)
+        Receiver_Repair(fec_decoder->OnData(seq_no, area));
+}
+
+/* event handler, called when a packet is passed from the lower layer at the
+   receiver */
+void Receiver_FromLowerLayer(struct packet *pkt)
+{
+    Receiver_FromLowerLayerBurst(&pkt, 1);
+}
+
+void Receiver_FromLowerLayerBurst(struct packet **pkts, int n)
+{
+    ASSERT(pkts && n >= 0);
+
+    ++bursts_received;
+    burst_packets += n;
+
+    for (int i = 0; i < n; i += RDT_MAX_BURST) {
+        int burst = n - i < RDT_MAX_BURST ? n - i : RDT_MAX_BURST;
+        bool valid[RDT_MAX_BURST];
+        RDT_VerifyChecksumBurst(pkts + i, burst, valid);
+
+        for (int j = 0; j < burst; ++j)
+            if (valid[j]) // Corrupted packets are dropped without ACK.
+                Receiver_Process(pkts[i + j]);
+    }
+
+    Receiver_FlushAcks();
 }
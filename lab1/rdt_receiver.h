@@ -21,9 +21,16 @@ double GetSimulationTime();
 /* pass a packet to the lower layer at the receiver */
 void Receiver_ToLowerLayer(struct packet *pkt);
 
+/* pass `n` packets to the lower layer at once at the receiver */
+void Receiver_ToLowerLayerBurst(struct packet **pkts, int n);
+
 /* deliver a message to the upper layer at the receiver */
 void Receiver_ToUpperLayer(struct message *msg);
 
+/* deliver a message received on stream `stream` to the upper layer at the 
+   receiver */
+void Receiver_ToUpperLayerOnStream(int stream, struct message *msg);
+
 
 /*[]------------------------------------------------------------------------[]
   |  routines to be changed/enhanced by you
@@ -43,4 +50,8 @@ void Receiver_Final();
    receiver */
 void Receiver_FromLowerLayer(struct packet *pkt);
 
+/* event handler, called when `n` packets arrive from the lower layer at the 
+   receiver at the same time */
+void Receiver_FromLowerLayerBurst(struct packet **pkts, int n);
+
 #endif  /* _RDT_RECEIVER_H_ */
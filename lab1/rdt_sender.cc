@@ -11,31 +11,193 @@
 #include "rdt_struct.h"
 #include "rdt_sender.h"
 #include "rdt_protocol.h"
+#include "rdt_congestion.h"
+#include "rdt_buffer.h"
+#include "rdt_fec.h"
+#include "rdt_async.h"
 
 
-bool sending_started = false; // Whether sender has started sending packets.
 const double timeout = 0.3; // Timeout for ACK.
 const double timer_interval = 0.1; // Time interval for ACK checker routine.
+const double timer_slack = 1e-9; // Tolerance when comparing the timer expiry with a deadline.
+double next_check = -1.0; // When the ACK checker runs next, negative when it is stopped.
+double timer_expiry = -1.0; // When the sender timer expires, negative when it is not set.
 int nothing = 0; // Times of nothing done in the ACK checker.
 const int max_nothing = 10; // Threshold for "nothing" to indicate end of sending.
+const int send_window = 256; // Maximum number of unACKed packets (power of 2), also the packet pool capacity.
 int seq_no = 0; // Next sequence number to use.
 int last_seq_no = -1; // Last sequence number seen by the ACK checker.
+int base = 0; // Oldest sequence number not ACKed yet.
+int next_send = 0; // Next sequence number to be sent for the first time.
+int inflight = 0; // Number of packets sent but not ACKed.
+const int dup_threshold = 3; // ACKs for later packets needed to consider `base` lost (fast retransmit).
+int later_acks = 0; // ACKs for packets after `base` since `base` became the oldest unACKed packet.
+int recover = 0; // Losses of packets before this sequence number belong to an already reduced window.
+int retransmissions = 0; // Statistics: number of retransmitted packets.
+int stalls = 0; // Statistics: times packetizing stopped because the window or the pool was full.
+CongestionControl *congestion = NULL; // Congestion controller selected by RDT_CC.
+FecConfig fec; // Forward error correction settings (RDT_FEC).
+FecEncoder *fec_encoder = NULL; // Parity of the block being sent, NULL without FEC.
+int segment_size = RDT_MAX_PAYLOAD_SIZE; // Data bytes per packet (less with FEC, see rdt_fec.h).
+int parity_sent = 0; // Statistics: number of FEC parity packets sent.
+int expired = 0; // Statistics: number of messages abandoned after their deadline.
+int skips_sent = 0; // Statistics: number of SKIP packets built.
 
 class PacketInfo {
 public:
-    packet *pkt; // Packet data.
     double send_time; // The time when it was sent.
-    bool acked; // Whether it has been ACKed.
-    PacketInfo(): pkt(NULL), send_time(0.0), acked(false) {}
+    int pool_index; // Packet data in the packet pool, -1 once ACKed.
+    bool retransmitted; // Whether it has been sent more than once (no valid RTT sample then).
+    bool skipped; // Whether its data has been abandoned and it was turned into a SKIP packet.
+    int priority; // Priority of its message.
+    double deadline; // When its message expires, negative for never.
+    PacketInfo(): send_time(0.0), pool_index(-1), retransmitted(false), skipped(false), priority(0), deadline(-1.0) {}
+    bool acked() const { return pool_index < 0; }
 };
 
-PacketInfo sender_packets[RDT_MAX_SEQ_NO]; // Status of all packets (indexed by seq_no) on the sender side.
+PacketInfo sender_packets[send_window]; // Status of packets in the window (indexed by seq_no % send_window).
+PacketPool *packet_pool = NULL; // Storage for packets in the window.
 
+class StagedMessage {
+public:
+    const char *data; // The caller's buffer (Sender_Send), or NULL if the data was copied into `staging`.
+    int size; // Bytes to packetize, framing prefix included.
+    int offset; // Bytes already packetized.
+    int prefix_size; // Framing prefix, only with coalescing.
+    char prefix[RDT_MAX_VARINT_SIZE];
+    int priority; // 0 to RDT_MAX_PRIORITY, higher is sent first.
+    double deadline; // When it is abandoned if not sent yet, negative for never.
+    bool skip; // Abandoned after part of it was packetized. What is left is a SKIP packet to end it.
+    int first_seq_no; // Sequence number of its first packet, once packetizing has started.
+    int handle; // Completion handle, 0 if nobody waits for it.
+    RDT_SendCallback callback;
+    void *arg;
+};
+
+class Completion {
+public:
+    int handle;
+    int first_seq_no; // First packet of the message.
+    int last_seq_no; // The message is ACKed once `base` passes this packet.
+    int size; // Bytes counted against the in-flight budget.
+    bool abandoned; // Whether some of its packets have been turned into SKIP packets.
+    RDT_SendCallback callback;
+    void *arg;
+};
+
+// Every stream has its own staging queue. Packets carry data of one stream only, and are cut from the streams
+// with data ready in round-robin order.
+class SendStream {
+public:
+    Ring<StagedMessage> staged; // Messages waiting for space in the window.
+    Ring<char> staging; // Data of staged messages from Sender_FromUpperLayer, which cannot keep its buffer.
+    int staged_bytes; // Bytes in `staged` not packetized yet.
+    double staging_since; // When the oldest staged byte was staged, negative when nothing is staged.
+    int next_ssn; // Stream sequence number of the next packet.
+    SendStream(): staged_bytes(0), staging_since(-1.0), next_ssn(0) {}
+};
+
+SendStream send_streams[RDT_MAX_STREAMS];
+int next_stream = 0; // Where the round-robin scan for the next packet starts.
+int staged_bytes = 0; // Bytes staged on all streams.
+int staged_high_water = 0; // Statistics: maximum of `staged_bytes`.
+
+// Asynchronous sends (see rdt_async.h).
+Ring<Completion> completions; // Packetized messages with a handle, in packetizing order.
+int next_handle = 1; // Handle of the next message from Sender_Send.
+int completed_handle = 0; // Every handle up to this one has completed.
+Ring<char> handle_done; // Whether handles completed_handle + 1 ... next_handle - 1 have completed.
+int inflight_bytes = 0; // Bytes of messages from Sender_Send not completed yet.
+int send_budget = 1 << 20; // RDT_SEND_BUDGET: limit of `inflight_bytes`, 0 for unlimited.
+Ring<Completion> budget_waiters; // Callbacks of Sender_OnBudget.
+
+// Coalescing: messages are framed (see RDT_PutVarint) and packed back to back, so packets carry as many messages
+// as fit. A partly filled packet is held back until enough bytes are staged or the oldest one has waited long
+// enough, like Nagle's algorithm / TCP_CORK.
+bool coalescing = false; // RDT_COALESCE=1.
+double coalesce_delay = 0.05; // RDT_COALESCE_DELAY: longest time a byte waits for a fuller packet (seconds).
+int coalesce_bytes = 0; // RDT_COALESCE_BYTES: staged bytes that are sent without waiting (default: a full packet).
+int messages = 0; // Statistics: number of messages from the upper layer.
+
+// Pacing: new packets are released in batches of `pacing_batch`, one batch every pacing_batch / rate seconds, so
+// a large message does not leave as one line-rate burst. The rate is RDT_PACING_RATE packets per second, or else
+// the window over the smoothed RTT, with some headroom so pacing never limits a window-limited sender by itself.
+bool pacing = false; // RDT_PACING=1, or RDT_PACING_RATE set.
+double pacing_rate = 0.0; // RDT_PACING_RATE: fixed rate in packets per second, 0 to follow the window.
+int pacing_batch = 2; // RDT_PACING_BATCH: packets released at a time.
+const double pacing_gain = 1.25; // Headroom over window / RTT (2x in slow start, like Linux fq pacing).
+double next_release = 0.0; // When the next batch may be released.
+int batch_released = 0; // Packets released in the current batch.
+double srtt = -1.0; // Smoothed RTT (RFC 6298), negative before the first sample.
+int pacing_waits = 0; // Statistics: times sending stopped to wait for the pacer.
+
+// Packets are passed to the lower layer in bursts at the end of each event, so the checksums of new packets are
+// computed together (see RDT_AddChecksumBurst).
+packet *tx_batch[RDT_MAX_BURST]; // Packets to pass to the lower layer.
+int tx_num = 0;
+packet *tx_unsummed[RDT_MAX_BURST]; // Those still without a checksum.
+int tx_unsummed_num = 0;
+packet parity_packets[FEC_MAX_M]; // Parity of the last block, until it is flushed.
+int tx_bursts = 0; // Statistics: number of bursts passed to the lower layer.
+int tx_packets = 0; // Statistics: number of packets in them.
+
+
+// Current pacing rate in packets per second.
+double Sender_PacingRate()
+{
+    if (pacing_rate > 0)
+        return pacing_rate;
+
+    // A controller that never says no (none) leaves the sender window as the limit.
+    double window = congestion->CanSend(send_window) ? send_window : congestion->cwnd;
+    double gain = congestion->cwnd < congestion->ssthresh ? 2.0 : pacing_gain;
+    return gain * window / (srtt > 0 ? srtt : timeout);
+}
 
 /* sender initialization, called once at the very beginning */
 void Sender_Init()
 {
     fprintf(stdout, "At %.2fs: sender initializing ...\n", GetSimulationTime());
+
+    packet_pool = new PacketPool(send_window);
+
+    coalescing = RDT_GetEnvInt("RDT_COALESCE", 0);
+    coalesce_delay = RDT_GetEnvDouble("RDT_COALESCE_DELAY", coalesce_delay);
+    send_budget = RDT_GetEnvInt("RDT_SEND_BUDGET", send_budget);
+
+    fec.Load();
+    if (fec.Enabled()) {
+        fec_encoder = new FecEncoder(fec, RDT_MAX_PAYLOAD_SIZE);
+        segment_size = RDT_MAX_PAYLOAD_SIZE - FEC_META_SIZE;
+        fprintf(stdout, "At %.2fs: sender using %s FEC with K = %d, M = %d\n", GetSimulationTime(), fec.Name(),
+            fec.k, fec.m);
+    }
+
+    congestion = RDT_CreateCongestionControl(RDT_GetEnvString("RDT_CC", "none"), send_window);
+    const char *log_path = RDT_GetEnvString("RDT_CC_LOG", NULL);
+    if (log_path)
+        congestion->SetLog(log_path);
+
+    fprintf(stdout, "At %.2fs: sender using %s congestion control\n", GetSimulationTime(), congestion->name);
+
+    pacing_rate = RDT_GetEnvDouble("RDT_PACING_RATE", 0.0);
+    pacing_batch = RDT_GetEnvInt("RDT_PACING_BATCH", pacing_batch);
+    pacing = RDT_GetEnvInt("RDT_PACING", 0) || pacing_rate > 0;
+    if (pacing_batch < 1) {
+        fprintf(stderr, "RDT_PACING_BATCH must be at least 1\n");
+        exit(-1);
+    }
+    if (pacing && pacing_rate > 0)
+        fprintf(stdout, "At %.2fs: sender pacing at %.1f packets/s in batches of %d\n", GetSimulationTime(),
+            pacing_rate, pacing_batch);
+    else if (pacing)
+        fprintf(stdout, "At %.2fs: sender pacing at window / RTT in batches of %d\n", GetSimulationTime(),
+            pacing_batch);
+
+    coalesce_bytes = RDT_GetEnvInt("RDT_COALESCE_BYTES", segment_size);
+    if (coalescing)
+        fprintf(stdout, "At %.2fs: sender coalescing messages up to %d bytes or %.3fs\n", GetSimulationTime(),
+            coalesce_bytes, coalesce_delay);
 }
 
 /* sender finalization, called once at the very end.
@@ -45,32 +207,56 @@ void Sender_Init()
 void Sender_Final()
 {
     fprintf(stdout, "At %.2fs: sender finalizing ...\n", GetSimulationTime());
+    fprintf(stdout, "At %.2fs: sender sent %d packets with %d retransmissions, final cwnd %.2f\n",
+        GetSimulationTime(), next_send, retransmissions, congestion->cwnd);
+    fprintf(stdout, "At %.2fs: sender got %d messages, %.2f per packet\n", GetSimulationTime(), messages,
+        next_send ? (double)messages / next_send : 0.0);
+    if (pacing)
+        fprintf(stdout, "At %.2fs: sender waited for the pacer %d times, final rate %.1f packets/s\n",
+            GetSimulationTime(), pacing_waits, Sender_PacingRate());
+    fprintf(stdout, "At %.2fs: sender passed %.2f packets per burst to the lower layer\n", GetSimulationTime(),
+        tx_bursts ? (double)tx_packets / tx_bursts : 0.0);
+    if (expired)
+        fprintf(stdout, "At %.2fs: sender abandoned %d expired messages before they were all sent, "
+            "sent %d SKIP packets\n", GetSimulationTime(), expired, skips_sent);
+    fprintf(stdout, "At %.2fs: sender pool high-water %d/%d packets, staging high-water %d bytes, %d stalls\n",
+        GetSimulationTime(), packet_pool->HighWater(), packet_pool->Capacity(), staged_high_water, stalls);
+
+    delete congestion;
+    congestion = NULL;
+    delete packet_pool;
+    packet_pool = NULL;
+
+    if (fec_encoder) {
+        // Overhead: parity packets, plus the payload bytes every data packet gives up for its FEC metadata.
+        fprintf(stdout, "At %.2fs: sender sent %d FEC parity packets, bandwidth overhead %.2f%%\n",
+            GetSimulationTime(), parity_sent,
+            next_send ? 100.0 * (parity_sent + next_send * (double)FEC_META_SIZE / RDT_MAX_PAYLOAD_SIZE) / next_send
+                : 0.0);
+        delete fec_encoder;
+        fec_encoder = NULL;
+    }
 }
 
-// Increment current sequence number.
-void Sender_IncrementSeq()
-{
-    seq_no = (seq_no + 1) % (RDT_MAX_SEQ_NO + 1);
-}
-
-// Construct a data packet with data and metadata.
-void Sender_ConstructPacket(int payload_size, bool end_of_msg, int seq_no, const char *payload, packet *pkt)
+// Construct a data packet whose payload is already in place, adding metadata.
+void Sender_ConstructPacket(int payload_size, bool end_of_msg, int seq_no, int stream, int ssn, packet *pkt)
 {
-    ASSERT(payload_size >= 0 && payload_size <= (int)RDT_MAX_PAYLOAD_SIZE);
-    ASSERT(seq_no >= 0 && seq_no <= RDT_MAX_SEQ_NO);
-    ASSERT(payload);
+    ASSERT(payload_size >= 0 && payload_size <= RDT_MAX_PAYLOAD_SIZE);
     ASSERT(pkt);
 
     // Set header.
-    pkt->data[0] = (char)(payload_size << RDT_END_OF_MSG_BITS | end_of_msg);
-    memcpy(pkt->data + 1, (char*)&seq_no, RDT_SEQ_NO_SIZE);
+    RDT_SetHeader(pkt, payload_size, end_of_msg, seq_no, stream, ssn);
 
-    // Fill in payload (pad with zero bytes).
-    memcpy(pkt->data + RDT_HEADER_SIZE, payload, payload_size);
+    // Pad payload with zero bytes.
     memset(pkt->data + RDT_HEADER_SIZE + payload_size, 0, RDT_MAX_PAYLOAD_SIZE - payload_size);
 
-    // Add checksum.
-    RDT_AddChecksum(pkt);
+    // Keep metadata in the payload area and add it to the block parity.
+    if (fec_encoder) {
+        FEC_PutMeta(pkt->data + RDT_HEADER_SIZE, RDT_MAX_PAYLOAD_SIZE, payload_size, end_of_msg, stream, ssn);
+        fec_encoder->Add(seq_no, pkt->data + RDT_HEADER_SIZE);
+    }
+
+    // The checksum is added when the packet is first flushed.
 }
 
 // Check whether a packet is a valid ACK packet.
@@ -78,60 +264,504 @@ bool Sender_CheckAck(packet *pkt, int *seq_no)
 {
     ASSERT(pkt);
 
-    // Packet corrupted or not an ACK packet.
-    if (!RDT_VerifyChecksum(pkt) || pkt->data[0] >> RDT_END_OF_MSG_BITS)
+    if (!RDT_VerifyChecksum(pkt)) // Packet corrupted.
         return false;
 
-    *seq_no = *(int*)(pkt->data + 1) & ((1 << RDT_SEQ_NO_BITS) - 1);
+    int payload_size, stream, ssn;
+    bool end_of_msg;
+    RDT_GetHeader(pkt, &payload_size, &end_of_msg, seq_no, &stream, &ssn);
+
+    return !payload_size && !end_of_msg; // Must be an ACK packet.
+}
+
+// Get the status of a packet in the window.
+PacketInfo *Sender_Packet(int seq_no)
+{
+    return &sender_packets[seq_no & (send_window - 1)];
+}
+
+// Pass the queued packets to the lower layer as one burst, adding the missing checksums on the way.
+void Sender_Flush()
+{
+    if (!tx_num)
+        return;
+
+    RDT_AddChecksumBurst(tx_unsummed, tx_unsummed_num);
+    Sender_ToLowerLayerBurst(tx_batch, tx_num);
+    ++tx_bursts;
+    tx_packets += tx_num;
+    tx_num = 0;
+    tx_unsummed_num = 0;
+}
+
+// Queue a packet for the lower layer. `summed` tells whether it already has its checksum.
+void Sender_Queue(packet *pkt, bool summed)
+{
+    if (tx_num == RDT_MAX_BURST)
+        Sender_Flush();
+
+    tx_batch[tx_num++] = pkt;
+    if (!summed)
+        tx_unsummed[tx_unsummed_num++] = pkt;
+}
+
+// Pass a recorded packet to the lower layer and update its send time.
+void Sender_SendPacket(int seq_no, double current_time)
+{
+    PacketInfo *info = Sender_Packet(seq_no);
+    info->send_time = current_time;
+
+    // Only a data packet sent for the first time lacks its checksum. SKIP packets get theirs when built.
+    Sender_Queue(packet_pool->Get(info->pool_index), seq_no != next_send || info->skipped);
+}
+
+// Construct a SKIP packet: the data of packet `seq_no` of the stream is abandoned, and with it the message it
+// belongs to. `end_of_msg` tells whether it was the last packet of the message, `replaced` whether it replaces a
+// data packet already added to the block parity.
+void Sender_ConstructSkip(bool end_of_msg, bool replaced, int seq_no, int stream, int ssn, packet *pkt)
+{
+    RDT_SetHeader(pkt, 0, false, seq_no, stream, ssn);
+    memset(pkt->data + RDT_HEADER_SIZE, 0, RDT_MAX_PAYLOAD_SIZE);
+    pkt->data[RDT_HEADER_SIZE] = end_of_msg;
+    pkt->data[RDT_HEADER_SIZE + 1] = replaced;
+    if (fec_encoder) // A SKIP rebuilt by FEC is recognized by its metadata.
+        FEC_PutMeta(pkt->data + RDT_HEADER_SIZE, RDT_MAX_PAYLOAD_SIZE, 0, false, stream, ssn);
+    RDT_AddChecksum(pkt);
+    ++skips_sent;
+}
+
+// Turn an unACKed packet whose message has expired into a SKIP packet, so its retransmissions stop carrying data
+// nobody wants. It still has to be ACKed.
+void Sender_Skip(int seq_no)
+{
+    PacketInfo *info = Sender_Packet(seq_no);
+    packet *pkt = packet_pool->Get(info->pool_index);
+
+    int payload_size, stream, ssn, header_seq_no;
+    bool end_of_msg;
+    RDT_GetHeader(pkt, &payload_size, &end_of_msg, &header_seq_no, &stream, &ssn);
+    Sender_ConstructSkip(end_of_msg, true, seq_no, stream, ssn, pkt);
+    info->skipped = true;
+
+    // Report the message as abandoned when it completes.
+    for (int i = 0; i < completions.Size(); ++i) {
+        Completion *completion = &completions[i];
+        if (completion->first_seq_no <= seq_no && seq_no <= completion->last_seq_no) {
+            completion->abandoned = true;
+            break;
+        }
+    }
+}
+
+// Retransmit a recorded packet.
+void Sender_Retransmit(int seq_no, double current_time)
+{
+    PacketInfo *info = Sender_Packet(seq_no);
+    if (info->deadline >= 0 && current_time >= info->deadline && !info->skipped)
+        Sender_Skip(seq_no);
+
+    info->retransmitted = true;
+    Sender_SendPacket(seq_no, current_time);
+    ++retransmissions;
+}
+
+// Report the end of a message sent by Sender_Send: ACKed, or abandoned after its deadline.
+void Sender_Finish(int handle, int size, bool abandoned, RDT_SendCallback callback, void *arg)
+{
+    inflight_bytes -= size;
+
+    handle_done[handle - completed_handle - 1] = 1;
+    while (!handle_done.Empty() && handle_done.Front()) {
+        handle_done.Pop(NULL, 1);
+        ++completed_handle;
+    }
+
+    if (callback)
+        callback(abandoned ? -handle : handle, arg);
+}
+
+// Remove `size` bytes from the messages staged on a stream into `dst`.
+void Sender_Unstage(SendStream *stream, char *dst, int size)
+{
+    stream->staged_bytes -= size;
+    staged_bytes -= size;
+
+    while (size) {
+        StagedMessage *msg = &stream->staged.Front();
+        int n = msg->size - msg->offset < size ? msg->size - msg->offset : size;
+
+        // Framing prefix first, then the data.
+        int prefix_n = msg->offset < msg->prefix_size ? msg->prefix_size - msg->offset : 0;
+        if (prefix_n > n)
+            prefix_n = n;
+        memcpy(dst, msg->prefix + msg->offset, prefix_n);
+
+        if (!msg->offset)
+            msg->first_seq_no = seq_no;
+
+        if (msg->data)
+            memcpy(dst + prefix_n, msg->data + msg->offset + prefix_n - msg->prefix_size, n - prefix_n);
+        else
+            stream->staging.Pop(dst + prefix_n, n - prefix_n);
+
+        dst += n;
+        size -= n;
+        msg->offset += n;
+
+        if (msg->offset == msg->size) { // All of it is in packets now, the last one is `seq_no`.
+            if (msg->handle) {
+                Completion completion = { msg->handle, msg->first_seq_no, seq_no, msg->size - msg->prefix_size, false,
+                    msg->callback, msg->arg };
+                completions.Push(completion);
+            }
+            stream->staged.Pop(NULL, 1);
+        }
+    }
+
+    if (!stream->staged_bytes)
+        stream->staging_since = -1.0;
+}
+
+// Whether the bytes staged on a stream may go into a packet now.
+bool Sender_StagingReady(const SendStream *stream, double current_time)
+{
+    if (!stream->staged_bytes)
+        return false;
+
+    if (!coalescing || stream->staged_bytes >= segment_size) // Full packets never wait.
+        return true;
+
+    return stream->staged_bytes >= coalesce_bytes ||
+        current_time - stream->staging_since >= coalesce_delay - timer_slack;
+}
+
+// Abandon the message at the front of a stream, which has expired.
+void Sender_Expire(SendStream *stream)
+{
+    StagedMessage *msg = &stream->staged.Front();
+    int remaining = msg->size - msg->offset;
+
+    if (!msg->data) // Drop its data left in `staging`.
+        stream->staging.Pop(NULL, msg->size - (msg->offset > msg->prefix_size ? msg->offset : msg->prefix_size));
+    stream->staged_bytes -= remaining;
+    staged_bytes -= remaining;
+    ++expired;
+
+    StagedMessage abandoned = *msg;
+    if (msg->offset) { // The receiver may have its first packets. Keep a byte's worth for the SKIP packet.
+        msg->skip = true;
+        msg->handle = 0;
+        msg->offset = msg->size - 1;
+        ++stream->staged_bytes;
+        ++staged_bytes;
+    } else {
+        stream->staged.Pop(NULL, 1);
+    }
+
+    if (!stream->staged_bytes)
+        stream->staging_since = -1.0;
+
+    // Nothing refers to the caller's buffer any more. Last, since the callback may send more.
+    if (abandoned.handle)
+        Sender_Finish(abandoned.handle, abandoned.size - abandoned.prefix_size, true, abandoned.callback,
+            abandoned.arg);
+}
+
+// Abandon the messages that reach the front of their streams after their deadline.
+void Sender_ExpireStaged(double current_time)
+{
+    for (int i = 0; i < RDT_MAX_STREAMS && staged_bytes; ++i) {
+        SendStream *stream = &send_streams[i];
+
+        while (!stream->staged.Empty()) {
+            StagedMessage *msg = &stream->staged.Front();
+            if (msg->skip || msg->deadline < 0 || current_time < msg->deadline)
+                break;
+
+            // Coalesced packets mix messages, so a message is only dropped as a whole before it is packetized.
+            if (coalescing && msg->offset)
+                break;
+
+            Sender_Expire(stream);
+        }
+    }
+}
+
+// Pick the stream the next packet is cut from, -1 if none has data ready. The stream whose next message has the
+// highest priority wins, streams of the same priority take turns.
+int Sender_NextStream(double current_time)
+{
+    if (!staged_bytes)
+        return -1;
+
+    int best = -1;
+    for (int i = 0; i < RDT_MAX_STREAMS; ++i) {
+        int stream = (next_stream + i) & (RDT_MAX_STREAMS - 1);
+        if (Sender_StagingReady(&send_streams[stream], current_time) &&
+            (best < 0 || send_streams[stream].staged.Front().priority > send_streams[best].staged.Front().priority))
+            best = stream;
+    }
+
+    if (best >= 0)
+        next_stream = best + 1;
+    return best;
+}
+
+// Cut the next packet of a stream out of its staged messages into the pool. Return false if there is no room for
+// it.
+bool Sender_Packetize(int stream_id)
+{
+    if (seq_no - base == send_window || packet_pool->Empty()) { // Backpressure: wait for ACKs.
+        ++stalls;
+        return false;
+    }
+
+    SendStream *stream = &send_streams[stream_id];
+    StagedMessage *msg = &stream->staged.Front();
+    PacketInfo *info = Sender_Packet(seq_no);
+    info->pool_index = packet_pool->Alloc();
+    info->retransmitted = false;
+    info->skipped = msg->skip;
+    info->priority = msg->priority;
+    info->deadline = coalescing ? -1.0 : msg->deadline;
+    packet *pkt = packet_pool->Get(info->pool_index);
+
+    if (msg->skip) { // End the abandoned message at the receiver.
+        Sender_ConstructSkip(true, false, seq_no, stream_id, stream->next_ssn++, pkt);
+        if (fec_encoder) // It takes its place in the block like a data packet.
+            fec_encoder->Add(seq_no, pkt->data + RDT_HEADER_SIZE);
+        --stream->staged_bytes;
+        --staged_bytes;
+        stream->staged.Pop(NULL, 1);
+        if (!stream->staged_bytes)
+            stream->staging_since = -1.0;
+        ++seq_no;
+        return true;
+    }
+
+    // Without coalescing a packet never crosses a message boundary. With it, a packet ends at a message boundary
+    // only when it takes everything staged on the stream.
+    int remaining = coalescing ? stream->staged_bytes : msg->size - msg->offset;
+    int payload_size = remaining < segment_size ? remaining : segment_size;
+    bool end_of_msg = payload_size == remaining;
+
+    Sender_Unstage(stream, pkt->data + RDT_HEADER_SIZE, payload_size);
+    Sender_ConstructPacket(payload_size, end_of_msg, seq_no, stream_id, stream->next_ssn++, pkt);
+    ++seq_no;
     return true;
 }
 
+// Make sure the sender timer expires no later than `at`.
+void Sender_ArmTimer(double at)
+{
+    if (timer_expiry >= 0 && timer_expiry <= at)
+        return;
+
+    double current_time = GetSimulationTime();
+    timer_expiry = at > current_time ? at : current_time;
+    Sender_StartTimer(timer_expiry - current_time);
+}
+
+// Send the parity packets of the block ending with packet `seq_no`.
+void Sender_SendParity(int seq_no)
+{
+    int start = seq_no - seq_no % fec.k;
+
+    Sender_Flush(); // The parity of the previous block may still be queued.
+
+    for (int row = 0; row < fec.m; ++row) {
+        packet *pkt = &parity_packets[row];
+        RDT_SetHeader(pkt, 0, true, start + row, 0, 0);
+        memcpy(pkt->data + RDT_HEADER_SIZE, fec_encoder->Parity(row), RDT_MAX_PAYLOAD_SIZE);
+        Sender_Queue(pkt, false);
+        ++parity_sent;
+    }
+    fec_encoder->Reset();
+}
+
+// Send new packets as long as the congestion window allows.
+void Sender_Transmit()
+{
+    double current_time = GetSimulationTime();
+
+    Sender_ExpireStaged(current_time);
+
+    while (congestion->CanSend(inflight)) {
+        if (pacing && current_time < next_release - timer_slack) { // Wait for the pacer.
+            if (next_send != seq_no || staged_bytes) {
+                Sender_ArmTimer(next_release);
+                ++pacing_waits;
+            }
+            break;
+        }
+
+        if (next_send == seq_no) {
+            int stream = Sender_NextStream(current_time);
+            if (stream < 0 || !Sender_Packetize(stream))
+                break;
+        }
+
+        Sender_SendPacket(next_send, current_time);
+        if (fec_encoder && fec_encoder->BlockEnd(next_send))
+            Sender_SendParity(next_send);
+
+        ++inflight;
+        ++next_send;
+
+        if (pacing && ++batch_released == pacing_batch) {
+            next_release = current_time + pacing_batch / Sender_PacingRate();
+            batch_released = 0;
+        }
+    }
+
+    // Come back to flush partly filled packets.
+    if (coalescing && staged_bytes) {
+        for (int i = 0; i < RDT_MAX_STREAMS; ++i) {
+            const SendStream *stream = &send_streams[i];
+            if (stream->staged_bytes && !Sender_StagingReady(stream, current_time))
+                Sender_ArmTimer(stream->staging_since + coalesce_delay);
+        }
+    }
+
+    Sender_Flush();
+}
+
+// Stage a message on a stream and send what the window allows. The data is copied unless `handle` is set.
+void Sender_Stage(int stream_id, int priority, double lifetime, const char *data, int size, int handle,
+    RDT_SendCallback callback, void *arg)
+{
+    SendStream *stream = &send_streams[stream_id];
+
+    // Start the ACK checker routine on first entry (or after it has stopped).
+    if (next_check < 0) {
+        next_check = GetSimulationTime() + timer_interval;
+        Sender_ArmTimer(next_check);
+    }
+
+    // Stage the message. It is split into packets when the window has room for them.
+    if (!stream->staged_bytes)
+        stream->staging_since = GetSimulationTime();
+
+    StagedMessage msg;
+    msg.data = handle ? data : NULL;
+    msg.offset = 0;
+    msg.prefix_size = coalescing ? RDT_PutVarint(msg.prefix, size) : 0; // Prefix with its size.
+    msg.size = msg.prefix_size + size;
+    msg.priority = priority;
+    msg.deadline = lifetime > 0 ? GetSimulationTime() + lifetime : -1.0;
+    msg.skip = false;
+    msg.first_seq_no = -1;
+    msg.handle = handle;
+    msg.callback = callback;
+    msg.arg = arg;
+
+    if (!handle)
+        stream->staging.Push(data, size);
+    stream->staged.Push(msg);
+    stream->staged_bytes += msg.size;
+    staged_bytes += msg.size;
+    if (staged_bytes > staged_high_water)
+        staged_high_water = staged_bytes;
+    ++messages;
+
+    Sender_Transmit();
+}
+
 /* event handler, called when a message is passed from the upper layer at the
    sender */
 void Sender_FromUpperLayer(struct message *msg)
+{
+    Sender_FromUpperLayerOnStream(msg, 0, 0, 0.0);
+}
+
+/* event handler, called when a message is passed from the upper layer at the
+   sender to be sent on a given stream */
+void Sender_FromUpperLayerOnStream(struct message *msg, int stream, int priority, double lifetime)
 {
     ASSERT(msg);
     ASSERT(msg->size >= 0);
+    ASSERT(stream >= 0 && stream < RDT_MAX_STREAMS);
+    ASSERT(priority >= 0 && priority <= RDT_MAX_PRIORITY);
 
     // Ignore empty messages.
     if (!msg->size)
         return;
 
     ASSERT(msg->data);
+    Sender_Stage(stream, priority, lifetime, msg->data, msg->size, 0, NULL, NULL);
+}
 
-    // Start the ACK checker routine on first entry.
-    if (!sending_started) {
-        sending_started = true;
-        Sender_StartTimer(timer_interval);
-    }
+int Sender_Send(const char *data, int size, RDT_SendCallback callback, void *arg)
+{
+    return Sender_SendOnStream(0, data, size, callback, arg);
+}
 
-    double current_time = GetSimulationTime();
+int Sender_SendOnStream(int stream, const char *data, int size, RDT_SendCallback callback, void *arg, int priority,
+    double lifetime)
+{
+    ASSERT(size > 0);
+    ASSERT(data);
+    ASSERT(stream >= 0 && stream < RDT_MAX_STREAMS);
+    ASSERT(priority >= 0 && priority <= RDT_MAX_PRIORITY);
+
+    if (send_budget && inflight_bytes && inflight_bytes + size > send_budget)
+        return 0;
+
+    int handle = next_handle++;
+    handle_done.Push(0);
+    inflight_bytes += size;
+    Sender_Stage(stream, priority, lifetime, data, size, handle, callback, arg);
+    return handle;
+}
+
+bool Sender_Done(int handle)
+{
+    ASSERT(handle > 0 && handle < next_handle);
+    return handle <= completed_handle || handle_done[handle - completed_handle - 1];
+}
+
+void Sender_OnBudget(RDT_SendCallback callback, void *arg)
+{
+    Completion waiter = { 0, 0, 0, 0, false, callback, arg };
+    budget_waiters.Push(waiter);
+}
+
+int Sender_InflightBytes()
+{
+    return inflight_bytes;
+}
+
+int Sender_Budget()
+{
+    return send_budget;
+}
+
+void Sender_SetBudget(int bytes)
+{
+    ASSERT(bytes >= 0);
+    send_budget = bytes;
+}
+
+// Complete the messages whose packets are all ACKed, then let waiters for budget try again.
+void Sender_Complete()
+{
+    if (completions.Empty() || completions.Front().last_seq_no >= base)
+        return;
 
-    // Split the message and send every part. Record every packet.
-    int last_payload_size = msg->size % RDT_MAX_PAYLOAD_SIZE;
-    if (!last_payload_size)
-        last_payload_size = RDT_MAX_PAYLOAD_SIZE;
-
-    int whole_packets_num = (msg->size - last_payload_size) / RDT_MAX_PAYLOAD_SIZE;
-    for (int i = 0; i < whole_packets_num; ++i) {
-        sender_packets[seq_no].pkt = (packet*)malloc(sizeof(packet));
-        ASSERT(sender_packets[seq_no].pkt);
-        sender_packets[seq_no].send_time = current_time;
-        sender_packets[seq_no].acked = false;
-        Sender_ConstructPacket(RDT_MAX_PAYLOAD_SIZE, false, seq_no, msg->data + i * RDT_MAX_PAYLOAD_SIZE,
-            sender_packets[seq_no].pkt);
-        Sender_ToLowerLayer(sender_packets[seq_no].pkt);
-        Sender_IncrementSeq();
-    }
-
-    sender_packets[seq_no].pkt = (packet*)malloc(sizeof(packet));
-    ASSERT(sender_packets[seq_no].pkt);
-    sender_packets[seq_no].send_time = current_time;
-    sender_packets[seq_no].acked = false;
-    Sender_ConstructPacket(last_payload_size, true, seq_no, msg->data + whole_packets_num * RDT_MAX_PAYLOAD_SIZE,
-        sender_packets[seq_no].pkt);
-    Sender_ToLowerLayer(sender_packets[seq_no].pkt);
-    Sender_IncrementSeq();
+    do {
+        // Pop first: the callback may send more.
+        Completion completion = completions.Front();
+        completions.Pop(NULL, 1);
+        Sender_Finish(completion.handle, completion.size, completion.abandoned, completion.callback,
+            completion.arg);
+    } while (!completions.Empty() && completions.Front().last_seq_no < base);
+
+    // Only the waiters registered so far. One that still does not fit registers again.
+    for (int n = budget_waiters.Size(); n > 0 && (!send_budget || inflight_bytes < send_budget); --n) {
+        Completion waiter = budget_waiters.Front();
+        budget_waiters.Pop(NULL, 1);
+        waiter.callback(0, waiter.arg);
+    }
 }
 
 /* event handler, called when a packet is passed from the lower layer at the
@@ -142,32 +772,94 @@ void Sender_FromLowerLayer(struct packet *pkt)
     if (!Sender_CheckAck(pkt, &seq_no)) // Not valid ACK.
         return;
 
-    // Mark the packet as ACKed. Free corresponding space.
-    sender_packets[seq_no].acked = true;
-    free(sender_packets[seq_no].pkt);
-    sender_packets[seq_no].pkt = NULL;
+    // Recover the full sequence number from its low bits. Ignore ACKs for packets not in flight or already ACKed.
+    seq_no = base + ((seq_no - base) & RDT_MAX_SEQ_NO);
+    PacketInfo *info = Sender_Packet(seq_no);
+    if (seq_no >= next_send || info->acked())
+        return;
+
+    double current_time = GetSimulationTime();
+
+    // Mark the packet as ACKed. Recycle its packet.
+    packet_pool->Free(info->pool_index);
+    info->pool_index = -1;
+    --inflight;
+
+    // RTT samples of retransmitted packets are ambiguous (Karn's algorithm).
+    double rtt = info->retransmitted ? -1.0 : current_time - info->send_time;
+    if (rtt >= 0)
+        srtt = srtt < 0 ? rtt : 0.875 * srtt + 0.125 * rtt;
+    congestion->OnAck(current_time, rtt, inflight + 1);
+
+    if (seq_no == base) { // Slide the window forward.
+        while (base != next_send && Sender_Packet(base)->acked())
+            ++base;
+        later_acks = 0;
+        Sender_Complete();
+    } else if (++later_acks == dup_threshold) { // Later packets keep arriving. Consider `base` lost.
+        Sender_Retransmit(base, current_time);
+        if (base >= recover) { // Reduce the window only once per window of data.
+            congestion->OnLoss(current_time);
+            recover = next_send;
+        }
+    }
+
+    Sender_Transmit();
 }
 
-/* event handler, called when the timer expires */
-void Sender_Timeout()
+// Retransmit timed out packets. This routine runs every `timer_interval` until packet sending is end, mimicking
+// the JavaScript function `setInterval()`.
+void Sender_CheckAcks(double current_time)
 {
-    // This function works as the ACK checker routine. It starts the timer again before returning, thus running
-    // over and over again (until packet sending is end), mimicking the JavaScript function `setInterval()`.
-
-    double current_time = GetSimulationTime();
-    bool remaining = false; // Whether there is packet sent but not ACKed.
+    bool remaining = base != seq_no || staged_bytes; // Whether there is data not sent or not ACKed.
+    bool timed_out = false; // Whether a packet from a window not reduced yet has timed out.
+    static int lost[send_window]; // Timed out packets.
+    int lost_num = 0;
+
+    for (int i = base; i < next_send; ++i) {
+        PacketInfo *info = Sender_Packet(i);
+        if (!info->acked() && current_time - info->send_time >= timeout) {
+            timed_out = timed_out || i >= recover;
+            lost[lost_num++] = i;
+        }
+    }
 
-    for (int i = 0; i < seq_no; ++i) {
-        if (!sender_packets[i].acked) { // Found an unACKed packet.
-            remaining = true;
-            if (current_time - sender_packets[i].send_time >= timeout) // Time out. Retransmit this packet.
-                Sender_ToLowerLayer(sender_packets[i].pkt);
+    // Retransmit them, higher priorities first.
+    for (int priority = RDT_MAX_PRIORITY; priority >= 0 && lost_num; --priority) {
+        int left = 0;
+        for (int i = 0; i < lost_num; ++i) {
+            if (Sender_Packet(lost[i])->priority == priority)
+                Sender_Retransmit(lost[i], current_time);
+            else
+                lost[left++] = lost[i];
         }
+        lost_num = left;
+    }
+
+    if (timed_out) {
+        congestion->OnTimeout(current_time);
+        recover = next_send;
     }
 
     nothing = remaining || last_seq_no != seq_no ? 0 : nothing + 1;
     last_seq_no = seq_no;
 
-    if (nothing < max_nothing) // Packet sending still active, continue routine after interval.
-        Sender_StartTimer(timer_interval);
+    // Continue routine after interval while packet sending is still active.
+    next_check = nothing < max_nothing ? current_time + timer_interval : -1.0;
+}
+
+/* event handler, called when the timer expires */
+void Sender_Timeout()
+{
+    // The timer is shared by the ACK checker and the coalescing flush, and always set for the earliest of them.
+    double current_time = GetSimulationTime();
+    timer_expiry = -1.0;
+
+    if (next_check >= 0 && current_time >= next_check - timer_slack)
+        Sender_CheckAcks(current_time);
+
+    Sender_Transmit();
+
+    if (next_check >= 0)
+        Sender_ArmTimer(next_check);
 }
@@ -34,6 +34,9 @@ bool Sender_isTimerSet();
 /* pass a packet to the lower layer at the sender */
 void Sender_ToLowerLayer(struct packet *pkt);
 
+/* pass `n` packets to the lower layer at once at the sender */
+void Sender_ToLowerLayerBurst(struct packet **pkts, int n);
+
 
 /*[]------------------------------------------------------------------------[]
   |  routines to be changed/enhanced by you
@@ -53,6 +56,13 @@ void Sender_Final();
    sender */
 void Sender_FromUpperLayer(struct message *msg);
 
+/* event handler, called when a message is passed from the upper layer at the 
+   sender to be sent on stream `stream` (0 to RDT_MAX_STREAMS - 1) with 
+   priority `priority` (0 to RDT_MAX_PRIORITY, higher is sent first). if 
+   `lifetime` is positive, the message is abandoned if it could not be sent 
+   within `lifetime` seconds. */
+void Sender_FromUpperLayerOnStream(struct message *msg, int stream, int priority, double lifetime);
+
 /* event handler, called when a packet is passed from the lower layer at the 
    sender */
 void Sender_FromLowerLayer(struct packet *pkt);
@@ -13,10 +13,18 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <deque>
 
 #include "rdt_struct.h"
 #include "rdt_sender.h"
 #include "rdt_receiver.h"
+#include "rdt_protocol.h"
+
+/* the software srTCM/WRED of lab2 (qos_soft.c) */
+extern "C" {
+#include "qos.h"
+#include "qos_soft.h"
+}
 
 
 /*[]------------------------------------------------------------------------[]
@@ -181,6 +189,67 @@ int tot_pkts_passed = 0;
 /* error flag set by message verification at the receiver */
 bool message_verfication_passed = true;
 
+/* number of streams messages are spread over, set by the RDT_STREAMS 
+   environment variable (default 1) */
+int stream_num = 1;
+
+/* lifetime of messages in seconds, set by the RDT_LIFETIME environment 
+   variable (default 0, no lifetime). the sender may abandon messages older 
+   than that, so the verification allows messages to be missing. */
+double msg_lifetime = 0.0;
+
+/* messages sent and not delivered yet */
+struct sent_msg {
+    double send_time;
+    int size;
+    char first;             /* the first character */
+};
+
+/* per-stream state of the workload: messages not delivered yet, and 
+   delivery statistics. stream i sends with priority i (at most 
+   RDT_MAX_PRIORITY). */
+struct stream_stats {
+    std::deque<struct sent_msg> sent;
+    int msgs_delivered;
+    int msgs_late;          /* delivered after their lifetime */
+    int msgs_missing;       /* abandoned by the sender */
+    double latency_sum;
+    double latency_max;
+} streams[RDT_MAX_STREAMS];
+
+int tot_chars_missing = 0;
+
+/* optional bottleneck on the link from the sender to the receiver: packets 
+   are served at RDT_LINK_RATE packets per second (default 0, no bottleneck) 
+   from a drop-tail queue of RDT_LINK_QUEUE packets (default 16) */
+double link_rate = 0.0;
+int link_queue = 16;
+double link_free_time = 0.0;    /* when the packets queued so far are served */
+int link_drops = 0;
+int link_pkts = 0;
+double link_delay_sum = 0.0;
+
+/* optional policer in front of the bottleneck: packets from the sender are 
+   colored by a srTCM of RDT_POLICER_CIR bytes per second (default 0, no 
+   policer), RDT_POLICER_CBS and RDT_POLICER_EBS bytes (default 4 packets 
+   each). red packets are dropped; green and yellow ones go through WRED 
+   with "wq_log2 min_th max_th maxp_inv" of RDT_POLICER_RED_GREEN and 
+   RDT_POLICER_RED_YELLOW (default those of lab2, passing all). WRED sees 
+   the bottleneck queue; without one, packets leave at once. 
+   the policer runs on microsecond ticks, with the rates given to it scaled 
+   by 1000 as it takes ticks for nanoseconds: rates of the simulation are 
+   then above the resolution of its fixed-point token rate (from 763 bytes
+   per second) */
+struct policed_pkt {
+    double leave_time;      /* when it leaves the bottleneck */
+    enum qos_color color;
+};
+double policer_cir = 0.0;
+std::deque<struct policed_pkt> policer_queue;
+int policer_pkts[QOS_COLORS];
+int policer_drops[QOS_COLORS];
+static const char *policer_colors[QOS_COLORS] = {"green", "yellow", "red"};
+
 
 /*[]------------------------------------------------------------------------[]
   |  simulation routines
@@ -195,9 +264,10 @@ static double myrandom()
 /* generate a message 
    NOTE: change this part if you want to generate different messages for 
          testing.  we will certainly use different messages in our grading! */
-static struct message *generate_msg()
+static struct message *generate_msg(int stream)
 {
-    static char cnt = 0;
+    static char cnts[RDT_MAX_STREAMS];
+    char &cnt = cnts[stream];
 
     struct message *msg = (struct message*) malloc(sizeof(struct message));
     ASSERT(msg!=NULL);
@@ -206,6 +276,9 @@ static struct message *generate_msg()
     msg->data = (char*) malloc(msg->size);
     ASSERT(msg->data!=NULL);
 
+    struct sent_msg sent = { sim_core.time(), msg->size, (char)('0' + cnt) };
+    streams[stream].sent.push_back(sent);
+
     for (int i=0; i<msg->size; i+=1) {
 	msg->data[i] = '0' + cnt;
 	cnt = (cnt+1) % 10;
@@ -273,9 +346,60 @@ bool Sender_isTimerSet()
     return (sender_timer!=NULL);
 }
 
+/* simulation time in ticks of the policer */
+static uint64_t policer_time(double t)
+{
+    return (uint64_t)(t*1e6);
+}
+
+/* meter a packet and run WRED on it, return true if it is dropped */
+static bool policer_drop()
+{
+    /* packets that have left the bottleneck by now */
+    while (!policer_queue.empty() && policer_queue.front().leave_time<=sim_core.time()) {
+	qos_dropper_dequeue(0, policer_queue.front().color, 
+			    policer_time(policer_queue.front().leave_time));
+	policer_queue.pop_front();
+    }
+
+    uint64_t time = policer_time(sim_core.time());
+    enum qos_color color = qos_meter_run(0, RDT_PKTSIZE, time);
+    policer_pkts[color] ++;
+    if (color==RED || qos_dropper_run(0, color, time)) {
+	policer_drops[color] ++;
+	return true;
+    }
+
+    struct policed_pkt queued = { sim_core.time(), color };
+    policer_queue.push_back(queued);
+    return false;
+}
+
 /* pass a packet to the lower layer at the sender */
 void Sender_ToLowerLayer(struct packet *pkt)
 {
+    if (policer_cir>0 && policer_drop()) return;
+
+    /* queue at the bottleneck, dropped if the queue is full */
+    double queue_delay = 0.0;
+    if (link_rate>0) {
+	if (link_free_time<sim_core.time()) link_free_time = sim_core.time();
+	if ((link_free_time-sim_core.time())*link_rate >= link_queue) {
+	    link_drops ++;
+	    if (policer_cir>0) {
+		/* counted in by the dropper, leaves at once */
+		qos_dropper_dequeue(0, policer_queue.back().color, policer_time(sim_core.time()));
+		policer_queue.pop_back();
+	    }
+	    return;
+	}
+	link_free_time += 1.0/link_rate;
+	if (policer_cir>0) policer_queue.back().leave_time = link_free_time;
+	queue_delay = link_free_time - sim_core.time();
+	link_pkts ++;
+	link_delay_sum += queue_delay;
+    }
+
     /* packet lost at rate "loss_rate" */
     if (myrandom()<loss_rate) return;
 
@@ -291,14 +415,21 @@ void Sender_ToLowerLayer(struct packet *pkt)
 
     /* schedule the packet arrival event at the other side */
     if (myrandom()<outoforder_rate)
-	e->sched_time = sim_core.time() + pkt_latency*2.0*myrandom();
+	e->sched_time = sim_core.time() + queue_delay + pkt_latency*2.0*myrandom();
     else
-	e->sched_time = sim_core.time() + pkt_latency;
+	e->sched_time = sim_core.time() + queue_delay + pkt_latency;
     sim_core.schedule(e);
 
     tot_pkts_passed ++;
 }
 
+/* pass `n` packets to the lower layer at once at the sender */
+void Sender_ToLowerLayerBurst(struct packet **pkts, int n)
+{
+    for (int i=0; i<n; i++)
+	Sender_ToLowerLayer(pkts[i]);
+}
+
 
 /* pass a packet to the lower layer at the receiver */
 void Receiver_ToLowerLayer(struct packet *pkt)
@@ -326,13 +457,44 @@ void Receiver_ToLowerLayer(struct packet *pkt)
     tot_pkts_passed ++;
 }
 
+/* pass `n` packets to the lower layer at once at the receiver */
+void Receiver_ToLowerLayerBurst(struct packet **pkts, int n)
+{
+    for (int i=0; i<n; i++)
+	Receiver_ToLowerLayer(pkts[i]);
+}
+
 /* deliver a message to the upper layer at the receiver 
    NOTE: change the message verification in this function if you changed 
          generate_msg() for testing. */
 void Receiver_ToUpperLayer(struct message *msg)
 {
-    static char cnt = 0;
+    Receiver_ToUpperLayerOnStream(0, msg);
+}
+
+/* deliver a message received on a given stream to the upper layer at the 
+   receiver. every stream is verified on its own. */
+void Receiver_ToUpperLayerOnStream(int stream, struct message *msg)
+{
+    struct stream_stats *st = &streams[stream];
+
+    /* messages of a stream are delivered in order. with a lifetime, skip the 
+       ones that were abandoned. */
+    while (msg_lifetime>0 && !st->sent.empty() &&
+	   (st->sent.front().size!=msg->size || st->sent.front().first!=msg->data[0])) {
+	st->msgs_missing ++;
+	tot_chars_missing += st->sent.front().size;
+	st->sent.pop_front();
+    }
+
+    if (st->sent.empty() || st->sent.front().size!=msg->size) {
+	message_verfication_passed = false;
+	return;
+    }
+    struct sent_msg sent = st->sent.front();
+    st->sent.pop_front();
 
+    char cnt = sent.first - '0';
     for (int i=0; i<msg->size; i++) {
 	/* message verification */
 	if (msg->data[i] != '0' + cnt) {
@@ -345,6 +507,13 @@ void Receiver_ToUpperLayer(struct message *msg)
     }
 
     tot_chars_delivered += msg->size;
+
+    /* delivery latency */
+    double latency = sim_core.time() - sent.send_time;
+    st->msgs_delivered ++;
+    if (msg_lifetime>0 && latency>msg_lifetime) st->msgs_late ++;
+    st->latency_sum += latency;
+    if (latency > st->latency_max) st->latency_max = latency;
 }
 
 
@@ -410,6 +579,83 @@ int main(int argc, char *argv[])
 	    loss_rate*100.0, corrupt_rate*100.0, tracing_level);
     fgetc(stdin);
 
+    if (getenv("RDT_STREAMS")!=NULL) {
+	stream_num = atoi(getenv("RDT_STREAMS"));
+	if (stream_num<1 || stream_num>RDT_MAX_STREAMS) {
+	    fprintf(stderr, "invalid RDT_STREAMS\n");
+	    exit(-1);
+	}
+	fprintf(stdout, "Messages are spread over %d streams.\n", stream_num);
+    }
+    if (getenv("RDT_LIFETIME")!=NULL) {
+	msg_lifetime = atof(getenv("RDT_LIFETIME"));
+	if (msg_lifetime<0) {
+	    fprintf(stderr, "invalid RDT_LIFETIME\n");
+	    exit(-1);
+	}
+	if (msg_lifetime>0)
+	    fprintf(stdout, "Messages expire %.3f seconds after they are sent.\n", msg_lifetime);
+    }
+
+    if (getenv("RDT_LINK_RATE")!=NULL) {
+	link_rate = atof(getenv("RDT_LINK_RATE"));
+	if (getenv("RDT_LINK_QUEUE")!=NULL)
+	    link_queue = atoi(getenv("RDT_LINK_QUEUE"));
+	if (link_rate<0 || link_queue<1) {
+	    fprintf(stderr, "invalid RDT_LINK_RATE or RDT_LINK_QUEUE\n");
+	    exit(-1);
+	}
+	if (link_rate>0)
+	    fprintf(stdout, "The sender's link is limited to %.1f packets per second with a %d-packet queue.\n",
+		    link_rate, link_queue);
+    }
+
+    if (getenv("RDT_POLICER_CIR")!=NULL) {
+	policer_cir = atof(getenv("RDT_POLICER_CIR"));
+	if (policer_cir<0) {
+	    fprintf(stderr, "invalid RDT_POLICER_CIR\n");
+	    exit(-1);
+	}
+    }
+    if (policer_cir>0) {
+	struct qos_params params;
+	if (qos_meter_init()!=0 || qos_dropper_init()!=0) {
+	    fprintf(stderr, "cannot initialize the policer\n");
+	    exit(-1);
+	}
+	qos_params_get(&params);
+	params.srtcm[0].cir = (uint64_t)(policer_cir*1000);
+	params.srtcm[0].cbs = RDT_GetEnvInt("RDT_POLICER_CBS", 4*RDT_PKTSIZE);
+	params.srtcm[0].ebs = RDT_GetEnvInt("RDT_POLICER_EBS", 4*RDT_PKTSIZE);
+	for (int c=GREEN; c<=YELLOW; c++) {
+	    char name[32];
+	    unsigned wq_log2, min_th, max_th, maxp_inv;
+	    snprintf(name, sizeof(name), "RDT_POLICER_RED_%s", c==GREEN ? "GREEN" : "YELLOW");
+	    if (getenv(name)==NULL) continue;
+	    if (sscanf(getenv(name), "%u %u %u %u", &wq_log2, &min_th, &max_th, &maxp_inv)!=4 ||
+		max_th>UINT16_MAX || maxp_inv>UINT16_MAX) {
+		fprintf(stderr, "invalid %s\n", name);
+		exit(-1);
+	    }
+	    params.red[c].wq_log2 = wq_log2;
+	    params.red[c].min_th = min_th;
+	    params.red[c].max_th = max_th;
+	    params.red[c].maxp_inv = maxp_inv;
+	}
+	if (qos_params_update(&params)!=0 || qos_soft_flows_create(1)!=0) {
+	    fprintf(stderr, "invalid RDT_POLICER_CIR, RDT_POLICER_CBS, RDT_POLICER_EBS or RDT_POLICER_RED_*\n");
+	    exit(-1);
+	}
+	qos_dropper_set_drained(1);
+
+	fprintf(stdout, "The sender's link is policed at %.1f bytes per second, CBS %d and EBS %d bytes.\n",
+		policer_cir, (int)params.srtcm[0].cbs, (int)params.srtcm[0].ebs);
+	for (int c=GREEN; c<=YELLOW; c++)
+	    fprintf(stdout, "\tWRED of %s packets: wq_log2 %d, thresholds %d-%d packets, 1/%d drop probability\n",
+		    policer_colors[c], params.red[c].wq_log2, params.red[c].min_th, params.red[c].max_th, 
+		    params.red[c].maxp_inv);
+    }
+
     /* initialize the random number generator */
     srand(getpid()+getppid());
 
@@ -449,8 +695,10 @@ int main(int argc, char *argv[])
 
 		EventSenderFromUpperLayer *real_e = (EventSenderFromUpperLayer*) e;
 
-		struct message *msg = generate_msg();
-		Sender_FromUpperLayer(msg);
+		int stream = stream_num>1 ? rand() % stream_num : 0;
+		struct message *msg = generate_msg(stream);
+		Sender_FromUpperLayerOnStream(msg, stream, 
+			stream<RDT_MAX_PRIORITY ? stream : RDT_MAX_PRIORITY, msg_lifetime);
 		free_msg(msg);
 
 		/* schedule the recurring event */
@@ -498,11 +746,26 @@ int main(int argc, char *argv[])
 		    fprintf(stdout, "Time %.2fs (Receiver): the lower layer informs the rdt layer that a packet is received from the link.\n", sim_core.time());
 		}
 
-		EventReceiverFromLowerLayer *real_e = (EventReceiverFromLowerLayer*) e;
+		/* packets arriving at the same time are handed over as one 
+		   burst, like a NIC ring drained by a poll */
+		EventReceiverFromLowerLayer *burst[RDT_MAX_BURST];
+		struct packet *pkts[RDT_MAX_BURST];
+		int n = 0;
+		burst[n] = (EventReceiverFromLowerLayer*) e;
+		pkts[n] = &burst[n]->pkt;
+		n ++;
+		while (n<RDT_MAX_BURST && sim_core.head!=NULL && 
+		       sim_core.head->sched_time==sim_core.time() && 
+		       sim_core.head->event_type==EVENT_RECEIVER_FROMLOWERLAYER) {
+		    burst[n] = (EventReceiverFromLowerLayer*) sim_core.next_event();
+		    pkts[n] = &burst[n]->pkt;
+		    n ++;
+		}
 		
-		Receiver_FromLowerLayer(&real_e->pkt);
+		Receiver_FromLowerLayerBurst(pkts, n);
 
-		delete real_e;
+		for (int i=0; i<n; i++)
+		    delete burst[i];
 	    }
 	    break;
 
@@ -520,11 +783,56 @@ int main(int argc, char *argv[])
     fprintf(stdout, "## Simulation completed at time %.2fs with\n" 
 	    "\t%d characters sent\n" 
 	    "\t%d characters delivered\n"
-	    "\t%d packets passed between the sender and the receiver\n", 
-	    sim_core.time(), tot_chars_sent, tot_chars_delivered, tot_pkts_passed);
+	    "\t%d packets passed between the sender and the receiver\n"
+	    "\t%.2f characters delivered per second with %d-byte packets\n", 
+	    sim_core.time(), tot_chars_sent, tot_chars_delivered, tot_pkts_passed,
+	    tot_chars_delivered/sim_core.time(), RDT_PKTSIZE);
+
+    if (link_rate>0)
+	fprintf(stdout, "\t%d packets dropped at the bottleneck, %.3fs average queueing delay\n",
+		link_drops, link_pkts ? link_delay_sum/link_pkts : 0.0);
+    if (policer_cir>0)
+	for (int c=0; c<QOS_COLORS; c++)
+	    fprintf(stdout, "\t%d %s packets at the policer, %d dropped\n",
+		    policer_pkts[c], policer_colors[c], policer_drops[c]);
+
+    int tot_msgs_delivered = 0, tot_msgs_late = 0, tot_msgs_missing = 0;
+    double tot_latency = 0.0, max_latency = 0.0;
+    for (int i=0; i<stream_num; i++) {
+	struct stream_stats *st = &streams[i];
+
+	/* messages abandoned at the end of the session */
+	if (msg_lifetime>0) {
+	    for (size_t j=0; j<st->sent.size(); j++)
+		tot_chars_missing += st->sent[j].size;
+	    st->msgs_missing += st->sent.size();
+	}
+
+	if (stream_num>1)
+	    fprintf(stdout, "\tstream %d (priority %d): %d messages delivered, latency %.3fs average, %.3fs max\n",
+		    i, i<RDT_MAX_PRIORITY ? i : RDT_MAX_PRIORITY, st->msgs_delivered, 
+		    st->msgs_delivered ? st->latency_sum/st->msgs_delivered : 0.0, st->latency_max);
+	if (stream_num>1 && msg_lifetime>0)
+	    fprintf(stdout, "\tstream %d: %d deadline misses (%d late, %d abandoned)\n",
+		    i, st->msgs_late + st->msgs_missing, st->msgs_late, st->msgs_missing);
+	tot_msgs_delivered += st->msgs_delivered;
+	tot_msgs_late += st->msgs_late;
+	tot_msgs_missing += st->msgs_missing;
+	tot_latency += st->latency_sum;
+	if (st->latency_max > max_latency) max_latency = st->latency_max;
+    }
+    fprintf(stdout, "\t%.3fs average and %.3fs max message delivery latency\n",
+	    tot_msgs_delivered ? tot_latency/tot_msgs_delivered : 0.0, max_latency);
+    if (msg_lifetime>0)
+	fprintf(stdout, "\t%d deadline misses: %d messages delivered late, %d abandoned (%d characters)\n",
+		tot_msgs_late + tot_msgs_missing, tot_msgs_late, tot_msgs_missing, tot_chars_missing);
 
     if (message_verfication_passed && (tot_chars_sent==tot_chars_delivered))
 	fprintf(stdout, "## Congratulations! This session is error-free, loss-free, and in order.\n");
+    else if (message_verfication_passed && msg_lifetime>0 && 
+	     (tot_chars_sent==tot_chars_delivered+tot_chars_missing))
+	fprintf(stdout, "## Congratulations! This session is error-free and in order, "
+		"with only messages past their deadline missing.\n");
     else
 	fprintf(stdout, "## Something is wrong! This session is NOT error-free, loss-free, and in order.\n");
 
@@ -23,8 +23,10 @@ struct message {
 };
 
 /* a packet is a data unit passed between rdt layer and the lower layer, each 
-   packet has a fixed size */
+   packet has a fixed size (override with -DRDT_PKTSIZE=<bytes> at compile time) */
+#ifndef RDT_PKTSIZE
 #define RDT_PKTSIZE 128
+#endif
 
 struct packet {
     char data[RDT_PKTSIZE];
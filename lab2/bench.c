@@ -0,0 +1,283 @@
+#include "rte_common.h"
+#include "rte_cycles.h"
+#include "rte_lcore.h"
+
+#include "bench.h"
+#include "flow_table.h"
+#include "qos.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define BENCH_SWEEP_TIME    1000000 // Time stamp of all packets of a sweep run: one time period.
+
+enum bench_mix {
+    BENCH_MIX_64 = 0,
+    BENCH_MIX_1500,
+    BENCH_MIX_UNIFORM, // 128 to 1151 bytes, as the generated traffic of main.c.
+    BENCH_MIX_IMIX, // 64, 576 and 1500 bytes, 7:4:1.
+    BENCH_MIXES
+};
+
+static const char *bench_mix_names[BENCH_MIXES] = {"64", "1500", "uniform", "imix"};
+static const uint32_t bench_bursts[] = {1, 8, 32, 64}; // 1 runs the per-packet API.
+static const double bench_red_fractions[] = {0.0, 0.25, 0.5, 0.75};
+
+const struct qos_flow_key *bench_keys[BENCH_PKTS];
+uint32_t bench_flow_ids[BENCH_PKTS];
+uint32_t bench_pkt_lens[BENCH_PKTS];
+enum qos_color bench_colors[BENCH_PKTS];
+uint8_t bench_drops[BENCH_PKTS];
+uint32_t bench_lat[BENCH_PKTS]; // Latency of every packet (ns): the time to process its burst.
+
+
+/**
+ * Per-packet path vs bursts
+ */
+
+// Cycles per packet to classify, meter and drop BENCH_PKTS packets, `burst` at a time (0 for the per-packet path).
+static double
+bench_compare_run(uint32_t burst)
+{
+    struct flow_table *table = RTE_PER_LCORE(flow_table);
+    uint32_t i;
+    uint64_t time;
+
+    uint64_t start = rte_rdtsc();
+
+    for (i = 0; i < BENCH_PKTS; i += burst ? burst : 1) {
+        time = 1000000 * (uint64_t)(1 + i / BENCH_PERIOD_PKTS);
+
+        if (!burst) {
+            bench_flow_ids[i] = flow_table_lookup(table, bench_keys[i]);
+            bench_colors[i] = qos_meter_run(bench_flow_ids[i], bench_pkt_lens[i], time);
+            bench_drops[i] = qos_dropper_run(bench_flow_ids[i], bench_colors[i], time);
+            continue;
+        }
+
+        uint32_t n = RTE_MIN(burst, BENCH_PKTS - i);
+        flow_table_lookup_burst(table, &bench_keys[i], n, &bench_flow_ids[i]);
+        qos_meter_run_burst(&bench_flow_ids[i], &bench_pkt_lens[i], n, time, &bench_colors[i]);
+        qos_dropper_run_burst(&bench_flow_ids[i], &bench_colors[i], n, time, &bench_drops[i]);
+    }
+
+    return (double)(rte_rdtsc() - start) / BENCH_PKTS;
+}
+
+void
+bench_compare(const struct qos_flow_key *keys, uint32_t nb_flows)
+{
+    uint32_t i;
+
+    for (i = 0; i < BENCH_PKTS; i++) {
+        bench_keys[i] = &keys[(uint32_t)rand() % nb_flows];
+        bench_pkt_lens[i] = (uint32_t)(128 + rand() % 1024);
+    }
+
+    printf("cycles/packet with %u flows: per-packet %.1f, burst 32 %.1f, burst 64 %.1f\n", nb_flows,
+        bench_compare_run(0), bench_compare_run(32), bench_compare_run(64));
+}
+
+
+/**
+ * Sweep
+ *
+ * A fraction of the packets goes to "hog" flows (the first APP_PROFILES ones, one per profile) whose allowance is
+ * used up before the run, so they are all red. The others are spread evenly over all flows. All packets share one
+ * time period, so the measured red fraction is at least the target one, more when the other flows exceed their
+ * allowance too (few flows, large packets)
+ */
+
+static uint32_t
+bench_pkt_len(enum bench_mix mix)
+{
+    static const uint32_t imix[12] = {64, 64, 64, 64, 64, 64, 64, 576, 576, 576, 576, 1500};
+
+    switch (mix) {
+    case BENCH_MIX_64:
+        return 64;
+    case BENCH_MIX_1500:
+        return 1500;
+    case BENCH_MIX_IMIX:
+        return imix[rand() % 12];
+    default:
+        return (uint32_t)(128 + rand() % 1024);
+    }
+}
+
+// Fill the packet arrays: `red` of the packets go to the hogs.
+static void
+bench_traffic(const struct qos_flow_key *keys, uint32_t nb_flows, enum bench_mix mix, double red)
+{
+    uint32_t i;
+
+    for (i = 0; i < BENCH_PKTS; i++) {
+        if (rand() < red * RAND_MAX)
+            bench_keys[i] = &keys[(uint32_t)rand() % APP_PROFILES];
+        else
+            bench_keys[i] = &keys[(uint32_t)rand() % nb_flows];
+        bench_pkt_lens[i] = bench_pkt_len(mix);
+    }
+}
+
+// Reset all flows of a table to their initial state, then use up the allowance of the hogs.
+static void
+bench_reset(struct flow_table *table, const uint32_t *hog_ids)
+{
+    uint32_t i;
+
+    for (i = 0; i <= table->capacity; i++)
+        qos_flow_init(&table->flows[i], table->flows[i].profile);
+
+    for (i = 0; i < APP_PROFILES; i++)
+        while (qos_meter_run(hog_ids[i], 1500, BENCH_SWEEP_TIME) != RED)
+            ;
+}
+
+// Cycles of two back-to-back rte_rdtsc_precise(), taken off every latency sample.
+static uint64_t
+bench_timer_overhead(void)
+{
+    uint64_t best = UINT64_MAX;
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+        uint64_t start = rte_rdtsc_precise();
+        best = RTE_MIN(best, rte_rdtsc_precise() - start);
+    }
+
+    return best;
+}
+
+// Run the packets through the library `burst` at a time. Return the cycles of the whole run. If `lat` is not NULL,
+// time every burst too and write the latency of every packet.
+static uint64_t
+bench_pass(struct flow_table *table, uint32_t burst, uint64_t overhead, uint32_t *lat)
+{
+    double ns_per_cycle = 1e9 / (double)rte_get_tsc_hz();
+    uint64_t burst_start = 0;
+    uint32_t i, j, n;
+
+    uint64_t start = rte_rdtsc_precise();
+
+    for (i = 0; i < BENCH_PKTS; i += n) {
+        n = RTE_MIN(burst, BENCH_PKTS - i);
+
+        if (lat != NULL)
+            burst_start = rte_rdtsc_precise();
+
+        if (burst == 1) {
+            bench_flow_ids[i] = flow_table_lookup(table, bench_keys[i]);
+            bench_colors[i] = qos_meter_run(bench_flow_ids[i], bench_pkt_lens[i], BENCH_SWEEP_TIME);
+            bench_drops[i] = qos_dropper_run(bench_flow_ids[i], bench_colors[i], BENCH_SWEEP_TIME);
+        } else {
+            flow_table_lookup_burst(table, &bench_keys[i], n, &bench_flow_ids[i]);
+            qos_meter_run_burst(&bench_flow_ids[i], &bench_pkt_lens[i], n, BENCH_SWEEP_TIME, &bench_colors[i]);
+            qos_dropper_run_burst(&bench_flow_ids[i], &bench_colors[i], n, BENCH_SWEEP_TIME, &bench_drops[i]);
+        }
+
+        if (lat != NULL) {
+            uint64_t cycles = rte_rdtsc_precise() - burst_start;
+            uint32_t ns = (uint32_t)((cycles > overhead ? cycles - overhead : 0) * ns_per_cycle);
+            for (j = 0; j < n; j++)
+                lat[i + j] = ns;
+        }
+    }
+
+    return rte_rdtsc_precise() - start;
+}
+
+static int
+bench_cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+// One CSV line: throughput from an untimed pass, latency from a timed one over the same packets and state.
+static void
+bench_sweep_run(FILE *out, struct flow_table *table, const uint32_t *hog_ids, uint32_t burst, enum bench_mix mix,
+    double red, uint64_t overhead)
+{
+    uint64_t hist[BENCH_HIST_BUCKETS];
+    uint64_t reds = 0, drops = 0;
+    uint32_t i;
+
+    bench_reset(table, hog_ids);
+    uint64_t cycles = bench_pass(table, burst, overhead, NULL);
+
+    bench_reset(table, hog_ids);
+    bench_pass(table, burst, overhead, bench_lat);
+
+    memset(hist, 0, sizeof(hist));
+    for (i = 0; i < BENCH_PKTS; i++) {
+        reds += bench_colors[i] == RED;
+        drops += bench_drops[i];
+
+        uint32_t bucket = 0;
+        while (bucket < BENCH_HIST_BUCKETS - 1 && bench_lat[i] >= (32u << bucket))
+            bucket++;
+        hist[bucket]++;
+    }
+    qsort(bench_lat, BENCH_PKTS, sizeof(bench_lat[0]), bench_cmp_u32);
+
+    fprintf(out, "%u,%u,%s,%.2f,%.4f,%.4f,%.2f,%.1f,%u,%u,%u,%u,%u", table->count, burst, bench_mix_names[mix], red,
+        (double)reds / BENCH_PKTS, (double)drops / BENCH_PKTS,
+        BENCH_PKTS / ((double)cycles / rte_get_tsc_hz()) / 1e6, (double)cycles / BENCH_PKTS,
+        bench_lat[0], bench_lat[BENCH_PKTS / 2], bench_lat[BENCH_PKTS / 100 * 99],
+        bench_lat[BENCH_PKTS / 1000 * 999], bench_lat[BENCH_PKTS - 1]);
+    for (i = 0; i < BENCH_HIST_BUCKETS; i++)
+        fprintf(out, ",%" PRIu64, hist[i]);
+    fprintf(out, "\n");
+    fflush(out);
+}
+
+void
+bench_sweep(const struct qos_flow_key *keys, uint32_t max_flows, FILE *out)
+{
+    struct flow_table *saved = RTE_PER_LCORE(flow_table);
+    uint64_t overhead = bench_timer_overhead();
+    uint32_t nb_flows = RTE_MIN((uint32_t)APP_PROFILES, max_flows);
+    uint32_t hog_ids[APP_PROFILES];
+    uint32_t i;
+
+    if (max_flows < APP_PROFILES)
+        rte_panic("The sweep needs at least %u flows\n", APP_PROFILES);
+
+    fprintf(out, "flows,burst,sizes,red_target,red,dropped,mpps,cycles_per_pkt,"
+        "lat_min_ns,lat_p50_ns,lat_p99_ns,lat_p999_ns,lat_max_ns");
+    for (i = 0; i < BENCH_HIST_BUCKETS - 1; i++)
+        fprintf(out, ",hist_lt_%uns", 32u << i);
+    fprintf(out, ",hist_ge_%uns\n", 32u << (BENCH_HIST_BUCKETS - 2));
+
+    srand(1); // The same traffic at every run, to compare builds.
+
+    for (;;) {
+        struct flow_table *table = flow_table_create("bench_flows", nb_flows, (int)rte_socket_id());
+        for (i = 0; i < nb_flows; i++)
+            flow_table_add(table, &keys[i], i % APP_PROFILES);
+        for (i = 0; i < APP_PROFILES; i++)
+            hog_ids[i] = flow_table_lookup(table, &keys[i]);
+        RTE_PER_LCORE(flow_table) = table;
+
+        uint32_t mix, r, b;
+        for (mix = 0; mix < BENCH_MIXES; mix++) {
+            for (r = 0; r < RTE_DIM(bench_red_fractions); r++) {
+                bench_traffic(keys, nb_flows, (enum bench_mix)mix, bench_red_fractions[r]);
+                for (b = 0; b < RTE_DIM(bench_bursts); b++)
+                    bench_sweep_run(out, table, hog_ids, bench_bursts[b], (enum bench_mix)mix,
+                        bench_red_fractions[r], overhead);
+            }
+        }
+
+        flow_table_free(table);
+        if (nb_flows == max_flows)
+            break;
+        nb_flows = nb_flows > max_flows / 16 ? max_flows : nb_flows * 16;
+    }
+
+    RTE_PER_LCORE(flow_table) = saved;
+}
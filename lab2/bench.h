@@ -0,0 +1,26 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "flow_table.h"
+
+/**
+ * Benchmarks of the classifier, meter and dropper on the master lcore. Packets are arrays of (key, length), so
+ * only the QoS library is measured
+ */
+
+#define BENCH_PKTS          (1 << 16) // Packets per benchmark run.
+#define BENCH_PERIOD_PKTS   1000 // Packets per time period in bench_compare runs.
+#define BENCH_HIST_BUCKETS  16 // Latency histogram buckets: below 32 ns, 64 ns, ..., 2^19 ns, and above.
+
+/* Print cycles/packet of the per-packet path and of bursts of 32 and 64, for nb_flows flows of `keys` in the
+   table of the calling lcore */
+void bench_compare(const struct qos_flow_key *keys, uint32_t nb_flows);
+
+/* Sweep flow count (4, 64, 1024, ... up to max_flows, taken from `keys`), burst size, packet size mix and red
+   fraction. Write one CSV line per run to `out`: Mpps, cycles/packet, latency percentiles and histogram */
+void bench_sweep(const struct qos_flow_key *keys, uint32_t max_flows, FILE *out);
+
+#endif
@@ -0,0 +1,174 @@
+#include "rte_common.h"
+#include "rte_cycles.h"
+
+#include "config.h"
+#include "qos.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define CONFIG_LINE_MAX     256
+
+static const char *color_names[QOS_COLORS] = {"green", "yellow", "red"};
+
+const char *config_path = NULL; // File reloaded on SIGHUP, NULL if none.
+volatile sig_atomic_t config_pending = 0; // Set by SIGHUP.
+
+
+// Parse an unsigned integer up to `max`, the whole token. Return -1 if it is not one.
+static int
+config_uint(const char *token, uint64_t max, uint64_t *value)
+{
+    char *end;
+
+    if (token == NULL || *token == '-')
+        return -1;
+
+    errno = 0;
+    *value = strtoull(token, &end, 0);
+    if (errno != 0 || end == token || *end != '\0' || *value > max)
+        return -1;
+
+    return 0;
+}
+
+// Apply one line to `params`. Return -1 if it is malformed.
+static int
+config_line(char *line, struct qos_params *params)
+{
+    char *saveptr;
+    char *tokens[6];
+    uint64_t values[5];
+    int n = 0, i;
+
+    char *comment = strchr(line, '#');
+    if (comment != NULL)
+        *comment = '\0';
+
+    char *token = strtok_r(line, " \t\r\n", &saveptr);
+    while (token != NULL && n < (int)RTE_DIM(tokens)) {
+        tokens[n++] = token;
+        token = strtok_r(NULL, " \t\r\n", &saveptr);
+    }
+    if (n == 0) // Blank.
+        return 0;
+    if (token != NULL) // Too many fields.
+        return -1;
+
+    if (strcmp(tokens[0], "srtcm") == 0) {
+        if (n != 5 || config_uint(tokens[1], APP_PROFILES - 1, &values[0]) != 0)
+            return -1;
+        for (i = 2; i < 5; i++)
+            if (config_uint(tokens[i], UINT64_MAX, &values[i - 1]) != 0)
+                return -1;
+
+        params->srtcm[values[0]].cir = values[1];
+        params->srtcm[values[0]].cbs = values[2];
+        params->srtcm[values[0]].ebs = values[3];
+        return 0;
+    }
+
+    if (strcmp(tokens[0], "red") == 0) {
+        int color;
+        if (n != 6)
+            return -1;
+        for (color = 0; color < QOS_COLORS && strcmp(tokens[1], color_names[color]) != 0; color++)
+            ;
+        if (color == QOS_COLORS)
+            return -1;
+        for (i = 2; i < 6; i++)
+            if (config_uint(tokens[i], UINT16_MAX, &values[i - 2]) != 0)
+                return -1;
+
+        params->red[color].wq_log2 = (uint16_t)values[0];
+        params->red[color].min_th = (uint16_t)values[1];
+        params->red[color].max_th = (uint16_t)values[2];
+        params->red[color].maxp_inv = (uint16_t)values[3];
+        return 0;
+    }
+
+    return -1;
+}
+
+int
+config_load(const char *path, struct qos_params *params)
+{
+    char line[CONFIG_LINE_MAX];
+    struct qos_params loaded = *params;
+    int line_no = 0;
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_no++;
+        if (config_line(line, &loaded) != 0) {
+            fprintf(stderr, "%s:%d: invalid setting\n", path, line_no);
+            fclose(file);
+            return -1;
+        }
+    }
+
+    fclose(file);
+    *params = loaded; // All or nothing.
+
+    return 0;
+}
+
+int
+config_reload(const char *path)
+{
+    struct qos_params params;
+    uint64_t start = rte_rdtsc();
+
+    qos_params_get(&params);
+    if (config_load(path, &params) != 0)
+        return -1;
+
+    uint64_t loaded = rte_rdtsc();
+    if (qos_params_update(&params) != 0) {
+        fprintf(stderr, "%s: parameters rejected by the meter or dropper, keeping the current ones\n", path);
+        return -1;
+    }
+
+    // Switching includes the grace period: the time for every worker to finish the burst it was in.
+    uint64_t done = rte_rdtsc();
+    double us_per_cycle = 1e6 / rte_get_tsc_hz();
+    printf("%s: parameters loaded in %.1f us, switched in %.1f us\n", path, (loaded - start) * us_per_cycle,
+        (done - loaded) * us_per_cycle);
+
+    return 0;
+}
+
+// Defer the reload to config_poll(), outside of the signal handler.
+static void
+config_signal_handler(int signum)
+{
+    if (signum == SIGHUP)
+        config_pending = 1;
+}
+
+void
+config_watch(const char *path)
+{
+    config_path = path;
+    signal(SIGHUP, config_signal_handler);
+}
+
+void
+config_poll(void)
+{
+    if (!config_pending)
+        return;
+
+    config_pending = 0;
+    config_reload(config_path);
+}
@@ -0,0 +1,30 @@
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+#include "qos.h"
+
+/**
+ * Meter and dropper parameters from a file (-c), reloaded on SIGHUP while traffic runs. One setting per line,
+ * anything after # is a comment:
+ *
+ *     srtcm <profile> <cir bytes/s> <cbs bytes> <ebs bytes>
+ *     red <green|yellow|red> <wq_log2> <min_th> <max_th> <maxp_inv>
+ *
+ * Settings not given keep their current value. See qos.conf for the defaults
+ */
+
+/* Read a file into `params`, which holds the current parameters. Return 0, or -1 after printing the line at fault */
+int config_load(const char *path, struct qos_params *params);
+
+/* Load a file and switch to its parameters, printing how long parsing and switching took. Return 0 or -1, in
+   which case the current parameters are kept */
+int config_reload(const char *path);
+
+/* Reload `path` on SIGHUP from now on */
+void config_watch(const char *path);
+
+/* Reload if a SIGHUP was received since the last call. Cheap enough to call for every burst, from the lcore that
+   called config_watch (not a registered reader, see qos_params_update) */
+void config_poll(void);
+
+#endif
@@ -0,0 +1,167 @@
+#include "rte_common.h"
+#include "rte_cycles.h"
+#include "rte_malloc.h"
+#include "rte_mbuf.h"
+#include "rte_sched.h"
+
+#include "egress.h"
+#include "qos.h"
+#include "worker.h"
+
+#include <string.h>
+
+
+#define EGRESS_TC_PERIOD    10 // Traffic class credit period (ms).
+
+
+struct egress *
+egress_create(const char *name, uint32_t rate, int socket_id)
+{
+    struct egress *egress = rte_zmalloc_socket(name, sizeof(*egress), RTE_CACHE_LINE_SIZE, socket_id);
+    if (egress == NULL)
+        rte_panic("Cannot allocate egress stage\n");
+
+    // No shaping below the port: pipes and classes may use the whole rate, classes share it by priority.
+    struct rte_sched_pipe_params pipe_profile = {
+        .tb_rate = rate,
+        .tb_size = 1000000,
+        .tc_rate = {rate, rate, rate, rate},
+        .tc_period = EGRESS_TC_PERIOD,
+        .wrr_weights = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1},
+    };
+
+    struct rte_sched_port_params port_params = {
+        .name = name,
+        .socket = socket_id,
+        .rate = rate,
+        .mtu = 1522,
+        .frame_overhead = RTE_SCHED_FRAME_OVERHEAD_DEFAULT,
+        .n_subports_per_port = 1,
+        .n_pipes_per_subport = EGRESS_PIPES,
+        .qsize = {EGRESS_QSIZE, EGRESS_QSIZE, EGRESS_QSIZE, EGRESS_QSIZE},
+        .pipe_profiles = &pipe_profile,
+        .n_pipe_profiles = 1,
+    };
+
+#ifdef RTE_SCHED_RED
+    // The thresholds of qos_dropper_init(), scaled to the queue size: green and yellow fill the queue, red is
+    // dropped.
+    int tc;
+    for (tc = 0; tc < RTE_SCHED_TRAFFIC_CLASSES_PER_PIPE; tc++) {
+        struct rte_red_params *red = port_params.red_params[tc];
+        red[e_RTE_METER_GREEN] = (struct rte_red_params){EGRESS_QSIZE - 2, EGRESS_QSIZE - 1, 10, 9};
+        red[e_RTE_METER_YELLOW] = (struct rte_red_params){EGRESS_QSIZE - 2, EGRESS_QSIZE - 1, 10, 9};
+        red[e_RTE_METER_RED] = (struct rte_red_params){0, 1, 10, 9};
+    }
+#endif
+
+    struct rte_sched_subport_params subport_params = {
+        .tb_rate = rate,
+        .tb_size = 1000000,
+        .tc_rate = {rate, rate, rate, rate},
+        .tc_period = EGRESS_TC_PERIOD,
+    };
+
+    egress->port = rte_sched_port_config(&port_params);
+    if (egress->port == NULL)
+        rte_panic("Cannot config scheduler port\n");
+    if (rte_sched_subport_config(egress->port, 0, &subport_params) != 0)
+        rte_panic("Cannot config scheduler subport\n");
+
+    uint32_t pipe;
+    for (pipe = 0; pipe < EGRESS_PIPES; pipe++)
+        if (rte_sched_pipe_config(egress->port, 0, pipe, 0) != 0)
+            rte_panic("Cannot config scheduler pipe %u\n", pipe);
+
+    egress->n_pipes = EGRESS_PIPES;
+
+    return egress;
+}
+
+void
+egress_free(struct egress *egress)
+{
+    if (egress == NULL)
+        return;
+
+    rte_sched_port_free(egress->port);
+    rte_free(egress);
+}
+
+uint32_t
+egress_enqueue(struct egress *egress, struct rte_mbuf **pkts, const uint32_t *flow_ids,
+    const enum qos_color *colors, uint32_t n)
+{
+    uint64_t now = rte_rdtsc();
+    uint32_t i;
+
+    if (egress->start == 0)
+        egress->start = now;
+
+    // Color -> traffic class, queue 0 of the class. The time stamp is no longer needed once metered: reuse
+    // udata64 for the enqueue time.
+    for (i = 0; i < n; i++) {
+        rte_sched_port_pkt_write(pkts[i], 0, flow_ids[i] % egress->n_pipes, colors[i], 0,
+            (enum rte_meter_color)colors[i]);
+        pkts[i]->udata64 = now;
+    }
+
+    int enqueued = rte_sched_port_enqueue(egress->port, pkts, n);
+    egress->queued += enqueued;
+
+    return (uint32_t)enqueued;
+}
+
+uint32_t
+egress_dequeue(struct egress *egress, uint32_t n)
+{
+    struct rte_mbuf *pkts[APP_BURST_MAX];
+    uint32_t i, sent;
+
+    n = RTE_MIN(n, APP_BURST_MAX);
+    sent = (uint32_t)rte_sched_port_dequeue(egress->port, pkts, n);
+    if (sent == 0)
+        return 0;
+
+    uint64_t now = rte_rdtsc();
+    egress->end = now;
+    egress->queued -= sent;
+
+    for (i = 0; i < sent; i++) {
+        uint32_t subport, pipe, tc, queue;
+        rte_sched_port_pkt_read_tree_path(pkts[i], &subport, &pipe, &tc, &queue);
+
+        uint64_t delay = now - pkts[i]->udata64;
+        egress->tc_pkts[tc]++;
+        egress->tc_bytes[tc] += rte_pktmbuf_pkt_len(pkts[i]);
+        egress->tc_delay[tc] += delay;
+        egress->tc_delay_max[tc] = RTE_MAX(egress->tc_delay_max[tc], delay);
+    }
+
+    pkt_free_bulk(pkts, sent);
+
+    return sent;
+}
+
+void
+egress_print_stats(const struct egress *egress, const char *label)
+{
+    static const char *tc_names[RTE_SCHED_TRAFFIC_CLASSES_PER_PIPE] = {"green", "yellow", "red", "unused"};
+    double hz = (double)rte_get_tsc_hz();
+    double seconds = egress->end > egress->start ? (egress->end - egress->start) / hz : 0.0;
+
+    struct rte_sched_subport_stats stats;
+    uint32_t tc_ov;
+    memset(&stats, 0, sizeof(stats));
+    rte_sched_subport_read_stats(egress->port, 0, &stats, &tc_ov);
+
+    int tc;
+    for (tc = 0; tc < RTE_SCHED_TRAFFIC_CLASSES_PER_PIPE - 1; tc++) {
+        uint64_t pkts = egress->tc_pkts[tc];
+        printf("%s egress TC%d (%s): %" PRIu64 " pkts, %.1f Mbps, delay avg %.1f us max %.1f us, "
+            "%u dropped\n", label, tc, tc_names[tc], pkts,
+            seconds > 0 ? egress->tc_bytes[tc] * 8 / seconds / 1e6 : 0.0,
+            pkts ? egress->tc_delay[tc] / (double)pkts / hz * 1e6 : 0.0,
+            egress->tc_delay_max[tc] / hz * 1e6, stats.n_pkts_tc_dropped[tc]);
+    }
+}
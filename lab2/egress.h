@@ -0,0 +1,54 @@
+#ifndef __EGRESS_H__
+#define __EGRESS_H__
+
+#include <stdint.h>
+
+#include "rte_common.h"
+#include "rte_sched.h"
+
+#include "qos.h"
+
+/**
+ * Egress scheduler stage (rte_sched): one port, one subport, `n_pipes` pipes. A flow goes to pipe
+ * flow_id % n_pipes, and its meter color selects the traffic class (green TC0, yellow TC1, red TC2, served in
+ * strict priority). The scheduler paces dequeues to the port rate
+ *
+ * With RTE_SCHED_RED, the scheduler runs WRED by color on its own queues, with the thresholds of the dropper
+ * scaled to the queue size. Otherwise the dropper decides before enqueue and full queues tail-drop
+ */
+
+#define EGRESS_QSIZE        64 // Packets per scheduler queue.
+#define EGRESS_PIPES        16 // Pipes per port.
+
+struct rte_mbuf;
+
+struct egress {
+    struct rte_sched_port *port;
+    uint32_t n_pipes;
+    uint64_t queued; // Packets in the scheduler.
+    uint64_t start; // TSC of the first enqueue.
+    uint64_t end; // TSC of the last dequeue.
+    uint64_t tc_pkts[RTE_SCHED_TRAFFIC_CLASSES_PER_PIPE]; // Statistics per traffic class: packets sent,
+    uint64_t tc_bytes[RTE_SCHED_TRAFFIC_CLASSES_PER_PIPE]; // bytes sent,
+    uint64_t tc_delay[RTE_SCHED_TRAFFIC_CLASSES_PER_PIPE]; // sum and
+    uint64_t tc_delay_max[RTE_SCHED_TRAFFIC_CLASSES_PER_PIPE]; // maximum of queueing delay (TSC cycles).
+};
+
+/* Create a scheduler for a port of `rate` bytes per second, panic on failure */
+struct egress *egress_create(const char *name, uint32_t rate, int socket_id);
+
+/* Free a scheduler and the packets left in it */
+void egress_free(struct egress *egress);
+
+/* Enqueue a burst of metered pkts of flows flow_ids[i] with colors[i]. The scheduler frees the pkts it drops.
+   Return the number of pkts enqueued */
+uint32_t egress_enqueue(struct egress *egress, struct rte_mbuf **pkts, const uint32_t *flow_ids,
+    const enum qos_color *colors, uint32_t n);
+
+/* Dequeue up to n pkts the port rate allows, account and free them. Return the number of pkts sent */
+uint32_t egress_dequeue(struct egress *egress, uint32_t n);
+
+/* Print per-class throughput, queueing delay and drops */
+void egress_print_stats(const struct egress *egress, const char *label);
+
+#endif
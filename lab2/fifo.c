@@ -0,0 +1,244 @@
+#include "rte_common.h"
+#include "rte_cycles.h"
+#include "rte_malloc.h"
+#include "rte_mbuf.h"
+#include "rte_ring.h"
+
+#include "fifo.h"
+#include "qos.h"
+#include "worker.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+
+#define FIFO_CREDITS_MAX    (APP_BURST_MAX * 1522) // Credits kept while idle (bytes).
+
+static const char *color_names[QOS_COLORS] = {"green", "yellow", "red"};
+
+
+// Queue of a flow.
+static inline struct rte_ring *
+fifo_ring(const struct fifo *fifo, uint32_t flow_id)
+{
+    return (struct rte_ring *)(fifo->rings + (size_t)flow_id * fifo->ring_size);
+}
+
+uint32_t
+fifo_depth(void)
+{
+    struct qos_params params;
+    uint32_t max_th = 0;
+    int i;
+
+    // RED drops every packet of a color once its average reaches max_th, so no more need to fit.
+    qos_params_get(&params);
+    for (i = 0; i < QOS_COLORS; i++)
+        max_th = RTE_MAX(max_th, (uint32_t)params.red[i].max_th);
+
+    return rte_align32pow2(max_th + 1);
+}
+
+// Memory of one flow queue of `depth` packets.
+static size_t
+fifo_ring_memsize(uint32_t depth)
+{
+    ssize_t ring_size = rte_ring_get_memsize(depth);
+    if (ring_size < 0)
+        rte_panic("Invalid FIFO depth %u\n", depth);
+
+    return (size_t)ring_size;
+}
+
+size_t
+fifo_memsize(uint32_t nb_flows)
+{
+    return nb_flows * fifo_ring_memsize(fifo_depth());
+}
+
+struct fifo *
+fifo_create(const char *name, uint64_t rate, uint32_t nb_flows, int socket_id)
+{
+    uint32_t depth = fifo_depth();
+    size_t ring_size = fifo_ring_memsize(depth);
+    struct rte_malloc_socket_stats stats;
+
+    // All queues are one block: check it fits before allocating anything.
+    if (rte_malloc_get_socket_stats(socket_id, &stats) == 0 && stats.greatest_free_size < nb_flows * ring_size)
+        rte_panic("Flow queues need %zu MB on socket %d (%u flows of %u packets, %zu bytes each), %zu MB free: "
+            "lower -f or max_th (-c), or add hugepages\n", (nb_flows * ring_size) >> 20, socket_id, nb_flows,
+            depth, ring_size, stats.greatest_free_size >> 20);
+
+    struct fifo *fifo = rte_zmalloc_socket(name, sizeof(*fifo), RTE_CACHE_LINE_SIZE, socket_id);
+    if (fifo == NULL)
+        rte_panic("Cannot allocate FIFO stage\n");
+    fifo->ring_size = ring_size;
+
+    // One allocation for all queues: no memzone per flow.
+    fifo->rings = rte_malloc_socket(name, nb_flows * fifo->ring_size, RTE_CACHE_LINE_SIZE, socket_id);
+    if (fifo->rings == NULL)
+        rte_panic("Cannot allocate %u flow queues\n", nb_flows);
+
+    uint32_t i;
+    for (i = 0; i < nb_flows; i++)
+        if (rte_ring_init(fifo_ring(fifo, i), name, depth, RING_F_SP_ENQ | RING_F_SC_DEQ) != 0)
+            rte_panic("Cannot init flow queue %u\n", i);
+
+    // A flow is in the active list at most once, so it never fills.
+    fifo->active = rte_ring_create(name, rte_align32pow2(nb_flows + 1), socket_id, RING_F_SP_ENQ | RING_F_SC_DEQ);
+    if (fifo->active == NULL)
+        rte_panic("Cannot create active flow list\n");
+
+    fifo->nb_flows = nb_flows;
+    fifo->rate = rate;
+    fifo->credits = FIFO_CREDITS_MAX;
+
+    return fifo;
+}
+
+void
+fifo_free(struct fifo *fifo)
+{
+    if (fifo == NULL)
+        return;
+
+    uint32_t i;
+    void *m;
+    for (i = 0; i < fifo->nb_flows; i++)
+        while (rte_ring_sc_dequeue(fifo_ring(fifo, i), &m) == 0)
+            rte_pktmbuf_free((struct rte_mbuf *)m);
+
+    rte_ring_free(fifo->active);
+    rte_free(fifo->rings);
+    rte_free(fifo);
+}
+
+uint32_t
+fifo_enqueue(struct fifo *fifo, struct rte_mbuf **pkts, const uint32_t *flow_ids,
+    const enum qos_color *colors, uint32_t n, uint64_t time)
+{
+    struct rte_mbuf *dropped[APP_BURST_MAX];
+    uint64_t now = rte_rdtsc();
+    uint32_t i, nb_dropped = 0;
+
+    if (fifo->start == 0) {
+        fifo->start = now;
+        fifo->last = now;
+    }
+    fifo->time = time;
+
+    // The time stamp is no longer needed once metered: reuse udata64 for the enqueue time, and keep the color
+    // next to the flow id.
+    for (i = 0; i < n; i++) {
+        struct rte_ring *ring = fifo_ring(fifo, flow_ids[i]);
+        int was_empty = rte_ring_empty(ring);
+
+        pkts[i]->udata64 = now;
+        pkts[i]->hash.sched.hi = colors[i];
+
+        if (rte_ring_sp_enqueue(ring, pkts[i]) != 0) {
+            qos_dropper_dequeue(flow_ids[i], colors[i], time); // Counted in by the dropper.
+            fifo->tail_drops[colors[i]]++;
+            dropped[nb_dropped++] = pkts[i];
+            continue;
+        }
+        if (was_empty)
+            rte_ring_sp_enqueue(fifo->active, (void *)(uintptr_t)flow_ids[i]);
+    }
+
+    pkt_free_bulk(dropped, nb_dropped);
+    fifo->queued += n - nb_dropped;
+
+    return n - nb_dropped;
+}
+
+uint32_t
+fifo_dequeue(struct fifo *fifo, uint32_t n)
+{
+    struct rte_mbuf *pkts[APP_BURST_MAX];
+    uint32_t sent = 0;
+
+    if (fifo->queued == 0)
+        return 0;
+
+    // Credits for the time elapsed, up to a burst. Idle time over a second adds no more than a second does.
+    uint64_t now = rte_rdtsc();
+    uint64_t hz = rte_get_tsc_hz();
+    uint64_t elapsed = RTE_MIN(now - fifo->last, hz);
+    fifo->credits = RTE_MIN(fifo->credits + (int64_t)(elapsed * fifo->rate / hz), (int64_t)FIFO_CREDITS_MAX);
+    fifo->last = now;
+
+    n = RTE_MIN(n, APP_BURST_MAX);
+    while (sent < n && fifo->credits > 0) {
+        void *obj;
+        if (rte_ring_sc_dequeue(fifo->active, &obj) != 0)
+            break;
+
+        uint32_t flow_id = (uint32_t)(uintptr_t)obj;
+        struct rte_ring *ring = fifo_ring(fifo, flow_id);
+        rte_ring_sc_dequeue(ring, &obj);
+
+        struct rte_mbuf *m = (struct rte_mbuf *)obj;
+        enum qos_color color = (enum qos_color)m->hash.sched.hi;
+        uint32_t pkt_len = rte_pktmbuf_pkt_len(m);
+        uint64_t sojourn = now - m->udata64;
+
+        qos_dropper_dequeue(flow_id, color, fifo->time);
+        fifo->credits -= pkt_len;
+        fifo->pkts[color]++;
+        fifo->bytes[color] += pkt_len;
+        fifo->sojourn[color] += sojourn;
+        fifo->sojourn_max[color] = RTE_MAX(fifo->sojourn_max[color], sojourn);
+        fifo->sojourn_hist[color][RTE_MIN(sojourn ? 63 - __builtin_clzll(sojourn) : 0, FIFO_HIST_BUCKETS - 1)]++;
+
+        // Next turn at the end of the list.
+        if (!rte_ring_empty(ring))
+            rte_ring_sp_enqueue(fifo->active, (void *)(uintptr_t)flow_id);
+
+        pkts[sent++] = m;
+    }
+
+    if (sent == 0)
+        return 0;
+
+    fifo->end = now;
+    fifo->queued -= sent;
+    pkt_free_bulk(pkts, sent);
+
+    return sent;
+}
+
+// Upper bound (cycles) of the sojourn time of a fraction q of the packets of a color.
+static uint64_t
+fifo_percentile(const struct fifo *fifo, int color, double q)
+{
+    uint64_t rank = (uint64_t)(q * fifo->pkts[color]), seen = 0;
+    int b;
+
+    for (b = 0; b < FIFO_HIST_BUCKETS - 1; b++) {
+        seen += fifo->sojourn_hist[color][b];
+        if (seen > rank)
+            break;
+    }
+
+    return RTE_MIN((2ULL << b) - 1, fifo->sojourn_max[color]);
+}
+
+void
+fifo_print_stats(const struct fifo *fifo, const char *label)
+{
+    double hz = (double)rte_get_tsc_hz();
+    double seconds = fifo->end > fifo->start ? (fifo->end - fifo->start) / hz : 0.0;
+
+    int c;
+    for (c = 0; c < QOS_COLORS; c++) {
+        uint64_t pkts = fifo->pkts[c];
+        printf("%s FIFO %s: %" PRIu64 " pkts, %.1f Mbps, sojourn avg %.1f us p50 < %.1f us p99 < %.1f us "
+            "max %.1f us, %" PRIu64 " tail-dropped\n", label, color_names[c], pkts,
+            seconds > 0 ? fifo->bytes[c] * 8 / seconds / 1e6 : 0.0,
+            pkts ? fifo->sojourn[c] / (double)pkts / hz * 1e6 : 0.0,
+            pkts ? fifo_percentile(fifo, c, 0.5) / hz * 1e6 : 0.0,
+            pkts ? fifo_percentile(fifo, c, 0.99) / hz * 1e6 : 0.0,
+            fifo->sojourn_max[c] / hz * 1e6, fifo->tail_drops[c]);
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef __FIFO_H__
+#define __FIFO_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rte_common.h"
+
+#include "qos.h"
+
+/**
+ * Per-flow FIFO stage: packets the dropper passes wait in a queue of their flow (an rte_ring), and a dequeue stage
+ * serves the flows with packets queued in round robin, one packet per turn, at a service rate. The dropper sees
+ * real occupancy: a flow's queue counts its packets of all colors until they leave (qos_dropper_set_drained), and
+ * RED sees it empty only when its last packet has left. Queues full despite RED tail-drop
+ *
+ * Sojourn time, from enqueue to dequeue, is measured per color
+ */
+
+#define FIFO_MBUFS          32768 // Mbufs to add to the pool per stage, for the packets queued.
+#define FIFO_HIST_BUCKETS   40 // Sojourn time histogram: bucket i counts times of 2^i to 2^(i+1) - 1 cycles.
+
+struct rte_mbuf;
+struct rte_ring;
+
+struct fifo {
+    uint8_t *rings; // Queue of every flow, ring_size bytes apart.
+    size_t ring_size;
+    struct rte_ring *active; // Flows with packets queued, in round-robin order.
+    uint32_t nb_flows;
+    uint64_t rate; // Service rate (bytes per second).
+    int64_t credits; // Bytes that may be sent now, negative after a packet larger than the credits.
+    uint64_t last; // TSC credits were last added.
+    uint64_t time; // Datapath time of the last enqueue, given to RED at dequeue.
+    uint64_t queued; // Packets in the queues.
+    uint64_t start; // TSC of the first enqueue.
+    uint64_t end; // TSC of the last dequeue.
+    uint64_t pkts[QOS_COLORS]; // Statistics per color: packets sent,
+    uint64_t bytes[QOS_COLORS]; // bytes sent,
+    uint64_t tail_drops[QOS_COLORS]; // packets dropped as their queue was full,
+    uint64_t sojourn[QOS_COLORS]; // sum,
+    uint64_t sojourn_max[QOS_COLORS]; // maximum and
+    uint64_t sojourn_hist[QOS_COLORS][FIFO_HIST_BUCKETS]; // histogram of sojourn time (TSC cycles).
+};
+
+/* Packets per flow queue (one less usable): the highest max_th of the current parameters + 1, rounded up to a
+   power of 2. Queues keep their depth when the parameters change later */
+uint32_t fifo_depth(void);
+
+/* Memory the queues of nb_flows flows take, at fifo_depth() */
+size_t fifo_memsize(uint32_t nb_flows);
+
+/* Create queues for nb_flows flows served at `rate` bytes per second, panic on failure, before allocating them if
+   the socket lacks the memory. Call qos_dropper_set_drained(1) on the lcore using it */
+struct fifo *fifo_create(const char *name, uint64_t rate, uint32_t nb_flows, int socket_id);
+
+/* Free the queues and the packets left in them */
+void fifo_free(struct fifo *fifo);
+
+/* Enqueue a burst of pkts the dropper passed, of flows flow_ids[i] with colors[i], at datapath time `time`.
+   Pkts whose queue is full are freed. Return the number of pkts enqueued */
+uint32_t fifo_enqueue(struct fifo *fifo, struct rte_mbuf **pkts, const uint32_t *flow_ids,
+    const enum qos_color *colors, uint32_t n, uint64_t time);
+
+/* Dequeue up to n pkts the service rate allows, account and free them. Return the number of pkts sent */
+uint32_t fifo_dequeue(struct fifo *fifo, uint32_t n);
+
+/* Print per-color throughput, sojourn time and tail drops */
+void fifo_print_stats(const struct fifo *fifo, const char *label);
+
+#endif
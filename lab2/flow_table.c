@@ -0,0 +1,114 @@
+#include "rte_common.h"
+#include "rte_hash.h"
+#include "rte_hash_crc.h"
+#include "rte_malloc.h"
+#include "rte_prefetch.h"
+
+#include "flow_table.h"
+#include "qos.h"
+
+#include <assert.h>
+
+
+RTE_DEFINE_PER_LCORE(struct flow_table *, flow_table);
+
+struct flow_table *
+flow_table_create(const char *name, uint32_t capacity, int socket_id)
+{
+    RTE_BUILD_BUG_ON(sizeof(struct qos_flow) != 2 * RTE_CACHE_LINE_SIZE);
+    RTE_BUILD_BUG_ON(sizeof(struct qos_counters) != RTE_CACHE_LINE_SIZE);
+
+    struct flow_table *table = rte_zmalloc_socket(name, sizeof(*table), RTE_CACHE_LINE_SIZE, socket_id);
+    if (table == NULL)
+        rte_panic("Cannot allocate flow table\n");
+
+    // rte_hash wants at least one full bucket. Flow ids are its key positions, below `entries`.
+    struct rte_hash_parameters params = {
+        .name = name,
+        .entries = RTE_MAX(capacity, RTE_HASH_BUCKET_ENTRIES),
+        .key_len = sizeof(struct qos_flow_key),
+        .hash_func = rte_hash_crc,
+        .hash_func_init_val = 0,
+        .socket_id = socket_id,
+    };
+
+    table->hash = rte_hash_create(&params);
+    if (table->hash == NULL)
+        rte_panic("Cannot create flow hash for %u flows\n", capacity);
+
+    // One more flow for the packets of flows that do not fit.
+    table->capacity = params.entries;
+    table->flows = rte_zmalloc_socket(name, (table->capacity + 1) * sizeof(struct qos_flow), RTE_CACHE_LINE_SIZE,
+        socket_id);
+    if (table->flows == NULL)
+        rte_panic("Cannot allocate state for %u flows\n", capacity);
+
+    table->counters = rte_zmalloc_socket(name, (table->capacity + 1) * sizeof(struct qos_counters),
+        RTE_CACHE_LINE_SIZE, socket_id);
+    if (table->counters == NULL)
+        rte_panic("Cannot allocate counters for %u flows\n", capacity);
+
+    qos_flow_init(&table->flows[table->capacity], APP_PROFILES - 1);
+    table->epoch = 1;
+
+    return table;
+}
+
+void
+flow_table_free(struct flow_table *table)
+{
+    if (table == NULL)
+        return;
+
+    rte_hash_free(table->hash);
+    rte_free(table->flows);
+    rte_free(table->counters);
+    rte_free(table);
+}
+
+uint32_t
+flow_table_add(struct flow_table *table, const struct qos_flow_key *key, uint32_t profile)
+{
+    int32_t pos = rte_hash_lookup(table->hash, key);
+    if (pos >= 0) // Known flow, keep its state.
+        return (uint32_t)pos;
+
+    pos = rte_hash_add_key(table->hash, key);
+    if (pos < 0) { // Table full (-ENOSPC).
+        ++table->overflows;
+        return table->capacity;
+    }
+
+    qos_flow_init(&table->flows[pos], profile);
+    ++table->count;
+
+    return (uint32_t)pos;
+}
+
+uint32_t
+flow_table_lookup(struct flow_table *table, const struct qos_flow_key *key)
+{
+    int32_t pos = rte_hash_lookup(table->hash, key);
+    if (likely(pos >= 0))
+        return (uint32_t)pos;
+
+    // New flow. Spread new flows over the profiles in turn.
+    return flow_table_add(table, key, table->count % APP_PROFILES);
+}
+
+void
+flow_table_lookup_burst(struct flow_table *table, const struct qos_flow_key **keys, uint32_t n,
+    uint32_t *flow_ids)
+{
+    int32_t positions[APP_BURST_MAX];
+    uint32_t i;
+
+    assert(n <= APP_BURST_MAX);
+
+    // Bulk lookup pipelines the bucket accesses of all keys.
+    rte_hash_lookup_bulk(table->hash, (const void **)keys, n, positions);
+
+    for (i = 0; i < n; ++i)
+        flow_ids[i] = likely(positions[i] >= 0) ? (uint32_t)positions[i] :
+            flow_table_add(table, keys[i], table->count % APP_PROFILES);
+}
@@ -0,0 +1,84 @@
+#ifndef __FLOW_TABLE_H__
+#define __FLOW_TABLE_H__
+
+#include <stdint.h>
+
+#include "rte_common.h"
+#include "rte_meter.h"
+#include "rte_per_lcore.h"
+#include "rte_red.h"
+
+/**
+ * Flow table: classifies packets by 5-tuple through an rte_hash, and holds all QoS state of a flow in one record
+ */
+
+/* 5-tuple, padded to 16 bytes so the hash reads whole words */
+struct qos_flow_key {
+    uint32_t src_ip;
+    uint32_t dst_ip;
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint8_t proto;
+    uint8_t pad[3]; // Must be zero.
+};
+
+/* All QoS state of a flow: meter in the first cache line, RED and queues in the second. Queues are cleared at
+   every time change, unless the table is drained. Instead of walking all flows then, each flow remembers the epoch
+   (time period) its queues were last cleared in, and clears them on first use in a new one */
+struct qos_flow {
+    struct rte_meter_srtcm srtcm; // srTCM data.
+    uint32_t profile; // Meter parameters (see qos_meter_init).
+    uint32_t version; // Version of the parameters the meter data was configured with.
+    struct rte_red red[e_RTE_METER_COLORS] __rte_cache_aligned; // RED data per color.
+    uint32_t queue_size[e_RTE_METER_COLORS]; // Queue per color (drained: their sum), valid in `epoch` only.
+    uint32_t epoch; // Epoch the queues were last cleared in.
+} __rte_cache_aligned;
+
+/* Counter classes: packets by color as metered, and the dropped ones among them */
+enum qos_class {
+    QOS_CLASS_GREEN = 0,
+    QOS_CLASS_YELLOW,
+    QOS_CLASS_RED,
+    QOS_CLASS_DROPPED,
+    QOS_CLASSES
+};
+
+/* 64-bit packet and byte counters per class, one cache line */
+struct qos_counters {
+    uint64_t pkts[QOS_CLASSES];
+    uint64_t bytes[QOS_CLASSES];
+} __rte_cache_aligned;
+
+struct flow_table {
+    struct rte_hash *hash; // 5-tuple -> flow id.
+    struct qos_flow *flows; // Indexed by flow id. The last one is shared by flows that did not fit.
+    uint32_t capacity; // Maximum number of flows.
+    uint32_t count; // Flows added so far.
+    uint32_t overflows; // Packets classified to the shared flow.
+    uint32_t epoch; // Current epoch, incremented at every time change.
+    uint64_t last_time; // Used to detect time change.
+    int drained; // Queues are drained by qos_dropper_dequeue(), not cleared at time changes.
+    struct qos_counters *counters; // Per flow, indexed by flow id. Written by the owning lcore only.
+    struct qos_counters total; // Sum over all flows.
+};
+
+/* Table used by qos_meter_run/qos_dropper_run on the calling lcore */
+RTE_DECLARE_PER_LCORE(struct flow_table *, flow_table);
+
+/* Create a table for `capacity` flows on `socket_id`, panic on failure */
+struct flow_table *flow_table_create(const char *name, uint32_t capacity, int socket_id);
+
+/* Free a table */
+void flow_table_free(struct flow_table *table);
+
+/* Add a flow with meter profile `profile`, return its flow id (the shared one if the table is full) */
+uint32_t flow_table_add(struct flow_table *table, const struct qos_flow_key *key, uint32_t profile);
+
+/* Return the flow id of a key, adding it if unknown */
+uint32_t flow_table_lookup(struct flow_table *table, const struct qos_flow_key *key);
+
+/* The same for a burst of at most APP_BURST_MAX keys, writing flow_ids[i] */
+void flow_table_lookup_burst(struct flow_table *table, const struct qos_flow_key **keys, uint32_t n,
+    uint32_t *flow_ids);
+
+#endif
@@ -0,0 +1,245 @@
+#include "rte_atomic.h"
+#include "rte_common.h"
+#include "rte_cycles.h"
+#include "rte_ether.h"
+#include "rte_lcore.h"
+#include "rte_malloc.h"
+#include "rte_mbuf.h"
+#include "rte_ring.h"
+
+#include "config.h"
+#include "gen.h"
+#include "telemetry.h"
+#include "worker.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define GEN_TRACE_SIZES_MAX 65536 // Distinct lines of a trace file.
+
+static const uint16_t imix[12] = {64, 64, 64, 64, 64, 64, 64, 576, 576, 576, 576, 1500};
+
+
+// xorshift64*: 64 random bits.
+static inline uint64_t
+gen_rand(struct gen *gen)
+{
+    uint64_t x = gen->rand;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    gen->rand = x;
+
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+// Fill the size table from a file of "size [count]" lines: every entry stands for 1/GEN_SIZES of the packets.
+static void
+gen_sizes_trace(struct gen *gen, const char *path)
+{
+    static uint32_t sizes[GEN_TRACE_SIZES_MAX];
+    static uint64_t counts[GEN_TRACE_SIZES_MAX];
+    char line[128];
+    uint32_t n = 0, line_no = 0;
+    uint64_t total = 0;
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        rte_panic("%s: %s\n", path, strerror(errno));
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        unsigned size;
+        unsigned long long count = 1;
+
+        line_no++;
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+            continue;
+        if (sscanf(line, "%u %llu", &size, &count) < 1 || n == GEN_TRACE_SIZES_MAX)
+            rte_panic("%s:%u: invalid packet size\n", path, line_no);
+
+        sizes[n] = RTE_MIN(RTE_MAX(size, 64u), (unsigned)ETHER_MAX_LEN);
+        counts[n++] = count;
+        total += count;
+    }
+    fclose(file);
+
+    if (total == 0)
+        rte_panic("%s: no packet sizes\n", path);
+
+    uint64_t seen = 0;
+    uint32_t i = 0, k;
+    for (k = 0; k < GEN_SIZES; k++) {
+        double target = (k + 0.5) / GEN_SIZES * total;
+        while (seen + counts[i] <= target) // The last line always covers it.
+            seen += counts[i++];
+        gen->sizes[k] = (uint16_t)sizes[i];
+    }
+}
+
+struct gen *
+gen_create(const struct qos_flow_key *keys, uint32_t nb_flows, double zipf_s, const char *mix, double gbps,
+    uint64_t on_us, uint64_t off_us)
+{
+    struct gen *gen = rte_zmalloc("gen", sizeof(*gen), RTE_CACHE_LINE_SIZE);
+    if (gen == NULL)
+        rte_panic("Cannot allocate generator\n");
+
+    gen->keys = keys;
+    gen->nb_flows = nb_flows;
+    gen->gbps = gbps;
+    gen->on_ns = on_us * 1000;
+    gen->off_ns = off_us * 1000;
+    gen->rand = 0x9e3779b97f4a7c15ULL;
+
+    if (zipf_s > 0) {
+        gen->zipf_cdf = rte_malloc("gen_zipf", nb_flows * sizeof(double), 0);
+        if (gen->zipf_cdf == NULL)
+            rte_panic("Cannot allocate Zipf table\n");
+
+        double sum = 0;
+        uint32_t i;
+        for (i = 0; i < nb_flows; i++) {
+            sum += 1.0 / pow(i + 1, zipf_s);
+            gen->zipf_cdf[i] = sum;
+        }
+        for (i = 0; i < nb_flows; i++)
+            gen->zipf_cdf[i] /= sum;
+        gen->zipf_cdf[nb_flows - 1] = 1.0;
+    }
+
+    uint32_t k;
+    if (strcmp(mix, "64") == 0 || strcmp(mix, "1500") == 0) {
+        for (k = 0; k < GEN_SIZES; k++)
+            gen->sizes[k] = (uint16_t)atoi(mix);
+    } else if (strcmp(mix, "uniform") == 0) {
+        for (k = 0; k < GEN_SIZES; k++)
+            gen->sizes[k] = (uint16_t)(128 + k % 1024);
+    } else if (strcmp(mix, "imix") == 0) {
+        for (k = 0; k < GEN_SIZES; k++)
+            gen->sizes[k] = imix[k * RTE_DIM(imix) / GEN_SIZES];
+    } else {
+        gen_sizes_trace(gen, mix);
+    }
+
+    return gen;
+}
+
+void
+gen_free(struct gen *gen)
+{
+    if (gen == NULL)
+        return;
+
+    rte_free(gen->zipf_cdf);
+    rte_free(gen);
+}
+
+// Flow of the next packet.
+static inline uint32_t
+gen_flow(struct gen *gen)
+{
+    uint64_t r = gen_rand(gen);
+
+    if (gen->zipf_cdf == NULL)
+        return (uint32_t)(((r >> 32) * gen->nb_flows) >> 32);
+
+    // First flow whose cumulative popularity is above u.
+    double u = (r >> 11) * 0x1.0p-53;
+    uint32_t lo = 0, hi = gen->nb_flows - 1;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (gen->zipf_cdf[mid] > u)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return lo;
+}
+
+int
+gen_main(void *arg)
+{
+    struct gen *gen = (struct gen *)arg;
+    struct rte_mbuf *pkts[APP_BURST_MAX];
+    struct rte_mbuf *shard[RTE_MAX_LCORE][APP_BURST_MAX];
+    uint32_t shard_n[RTE_MAX_LCORE] = {0};
+    double ns_per_cycle = 1e9 / rte_get_tsc_hz();
+    double ns = 0; // Generated time.
+    double on_start = 0; // Start of the current on time.
+    uint64_t sent, bytes = 0;
+    uint32_t burst, w;
+
+    gen->start = rte_rdtsc();
+
+    for (sent = 0; sent < gen->nb_pkts; sent += burst) {
+        if (gen->poll) {
+            telemetry_poll();
+            config_poll();
+        }
+
+        // A burst leaves once its generated time has come.
+        if (gen->gbps > 0)
+            while ((rte_rdtsc() - gen->start) * ns_per_cycle < ns)
+                rte_pause();
+
+        // The last burst is short if nb_pkts is not a multiple of the burst size.
+        burst = (uint32_t)RTE_MIN((uint64_t)APP_BURST_MAX, gen->nb_pkts - sent);
+        while (rte_pktmbuf_alloc_bulk(gen->pool, pkts, burst) != 0)
+            ; // Workers still hold them all.
+
+        uint32_t i;
+        for (i = 0; i < burst; i++) {
+            const struct qos_flow_key *key = &gen->keys[gen_flow(gen)];
+            uint32_t pkt_len = gen->sizes[gen_rand(gen) % GEN_SIZES];
+
+            pkt_build(pkts[i], key, pkt_len);
+            pkts[i]->udata64 = ((uint64_t)ns / GEN_PERIOD_NS + 1) * GEN_PERIOD_NS;
+            bytes += pkt_len;
+
+            ns += gen->gbps > 0 ? pkt_len * 8 / gen->gbps : (double)GEN_PERIOD_NS / APP_PERIOD_PKTS;
+            if (gen->on_ns > 0 && ns - on_start >= gen->on_ns) {
+                ns = on_start + gen->on_ns + gen->off_ns;
+                on_start = ns;
+            }
+
+            w = worker_of(flow_hash(key), gen->nb_workers);
+            shard[w][shard_n[w]++] = pkts[i];
+        }
+
+        // Lossless hand-off: wait for room rather than drop, so the run measures the workers.
+        for (w = 0; w < gen->nb_workers; w++) {
+            uint32_t done = 0;
+            while (done < shard_n[w])
+                done += rte_ring_sp_enqueue_burst(gen->workers[w].ring, (void **)&shard[w][done],
+                    shard_n[w] - done, NULL);
+            shard_n[w] = 0;
+        }
+    }
+
+    gen->end = rte_rdtsc();
+    gen->pkts = sent;
+    gen->bytes = bytes;
+    gen->time_ns = (uint64_t)ns;
+    rte_smp_wmb();
+    gen->done = 1;
+
+    return 0;
+}
+
+void
+gen_print_stats(const struct gen *gen)
+{
+    double seconds = (double)(gen->end - gen->start) / rte_get_tsc_hz();
+
+    printf("generator: %" PRIu64 " packets, %" PRIu64 " bytes, %.2f Gbps offered over %.3f s generated, "
+        "%.2f Gbps actual\n", gen->pkts, gen->bytes,
+        gen->time_ns ? gen->bytes * 8.0 / gen->time_ns : 0.0, gen->time_ns / 1e9,
+        seconds > 0 ? gen->bytes * 8 / seconds / 1e9 : 0.0);
+}
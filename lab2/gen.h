@@ -0,0 +1,69 @@
+#ifndef __GEN_H__
+#define __GEN_H__
+
+#include <stdint.h>
+
+#include "flow_table.h"
+#include "worker.h"
+
+/**
+ * Traffic generator of multi-core runs, on an lcore of its own when one is left after the workers. It builds
+ * packets and passes each to the worker owning its flow, as the RX stage would:
+ *
+ * - flows: uniform, or Zipf of exponent s (flow 0 the most popular)
+ * - sizes: 64, 1500, uniform (128-1151 B), IMIX (7:4:1 of 64/576/1500 B), or the mix of a trace (a file of
+ *   "size [count]" lines, e.g. from tshark -T fields -e frame.len)
+ * - load: as fast as the workers take packets, or a target in Gbps the generator paces itself to
+ * - on/off: sends for on_us, then stays silent for off_us
+ *
+ * Packets are stamped with a generated time: every packet takes its transmission time at the target load (1 us
+ * without one, i.e. APP_PERIOD_PKTS per period), off times are skipped, and stamps are rounded up to periods
+ */
+
+#define GEN_PERIOD_NS       1000000 // Time period of the stamps.
+#define GEN_SIZES           4096 // Entries of the size table, each as likely.
+
+struct rte_mempool;
+
+struct gen {
+    const struct qos_flow_key *keys; // Flows.
+    uint32_t nb_flows;
+    double *zipf_cdf; // Cumulative popularity of flows 0 to i, NULL for uniform.
+    uint16_t sizes[GEN_SIZES]; // Packet sizes, drawn uniformly.
+    double gbps; // Target offered load, 0 for none.
+    uint64_t on_ns; // On time, 0 to always send.
+    uint64_t off_ns; // Off time.
+    uint64_t rand; // State of the xorshift64* generator.
+    int poll; // Poll telemetry and parameter reloads, when running on the master lcore.
+
+    // Set per run.
+    struct rte_mempool *pool;
+    struct worker *workers;
+    uint32_t nb_workers;
+    uint64_t nb_pkts; // Packets to send.
+
+    // Statistics of the last run.
+    uint64_t pkts;
+    uint64_t bytes;
+    uint64_t time_ns; // Generated time covered.
+    uint64_t start; // TSC at the first packet.
+    uint64_t end; // TSC after the last packet.
+    volatile int done; // Set once the last packet is enqueued, to clear before a run.
+};
+
+/* Create a generator for nb_flows flows of `keys`: Zipf exponent zipf_s (0 for uniform), size mix `mix` (64, 1500,
+   uniform, imix, or a trace file), target load in Gbps (0 for none), on/off times in us (on 0 for always on).
+   Panic on failure */
+struct gen *gen_create(const struct qos_flow_key *keys, uint32_t nb_flows, double zipf_s, const char *mix,
+    double gbps, uint64_t on_us, uint64_t off_us);
+
+/* Free a generator */
+void gen_free(struct gen *gen);
+
+/* Main loop of the generator, `arg` is its struct gen: send nb_pkts packets to the workers, then set done */
+int gen_main(void *arg);
+
+/* Print what the last run offered, in packets, generated and actual Gbps */
+void gen_print_stats(const struct gen *gen);
+
+#endif
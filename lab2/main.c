@@ -1,10 +1,297 @@
+#include <inttypes.h>
+#include <signal.h>
+#include <string.h>
 #include <time.h>
 #include <stdlib.h>
+#include <unistd.h>
 
+#include "rte_atomic.h"
 #include "rte_common.h"
+#include "rte_cycles.h"
+#include "rte_ethdev.h"
+#include "rte_launch.h"
+#include "rte_lcore.h"
+#include "rte_malloc.h"
 #include "rte_mbuf.h"
+#include "rte_ring.h"
 
+#include "bench.h"
+#include "config.h"
+#include "egress.h"
+#include "fifo.h"
+#include "flow_table.h"
+#include "gen.h"
+#include "port.h"
 #include "qos.h"
+#include "telemetry.h"
+#include "worker.h"
+
+#define APP_MBUFS 8191 // Size of the mbuf pool of multi-core runs.
+#define APP_MBUF_CACHE 256
+
+uint32_t app_flows = APP_PROFILES; // Number of flows (-f), flow i uses profile i % APP_PROFILES.
+struct qos_flow_key *flow_keys; // 5-tuple of every flow.
+uint32_t app_workers = 0; // Worker lcores (-w), 0 to run everything on the master lcore.
+int app_scaling = 0; // Run with 1 to app_workers workers (-s).
+int app_numa = 0; // Run again with flow state on another socket than the workers, and compare (-N).
+uint64_t app_pkts = 10000000; // Packets per multi-core run (-n).
+uint32_t app_egress_rate = 0; // Egress port rate of every worker in bytes per second (-e Mbps), 0 for none.
+uint64_t app_fifo_rate = 0; // Flow queue service rate of every worker in bytes per second (-q Mbps), 0 for none.
+int app_port = 0; // Run over ethdev ports (-p).
+uint32_t app_telemetry_ms = 1000; // Period of telemetry publication in ms (-t), 0 for none.
+const char *app_bench_csv = NULL; // Run the benchmark sweep and write CSV there (-b file, - for stdout).
+const char *app_config = NULL; // Meter and dropper parameters, reloaded on SIGHUP (-c file).
+double app_zipf = 0; // Zipf exponent of flow popularity in multi-core runs (-z), 0 for uniform.
+const char *app_mix = "uniform"; // Packet size mix of multi-core runs (-m 64|1500|uniform|imix|file).
+double app_gbps = 0; // Offered load of multi-core runs in Gbps (-g), 0 for as fast as the workers go.
+uint64_t app_on_us = 0, app_off_us = 0; // On/off times of multi-core runs in us (-o on,off), on 0 for always on.
+
+/** 5-tuple of flow i */
+static void
+flow_key_init(struct qos_flow_key *key, uint32_t i)
+{
+    memset(key, 0, sizeof(*key));
+    key->src_ip = 0x0a000000 | i; // 10.x.x.x
+    key->dst_ip = 0xc0a80001; // 192.168.0.1
+    key->src_port = (uint16_t)(1024 + i % 50000);
+    key->dst_port = 80;
+    key->proto = 17; // UDP
+}
+
+/** a socket other than socket_id with memory (see --socket-mem), panic if none */
+static int
+remote_socket(int socket_id)
+{
+    struct rte_malloc_socket_stats stats;
+    int s;
+
+    for (s = 0; s < RTE_MAX_NUMA_NODES; s++)
+        if (s != socket_id && rte_malloc_get_socket_stats(s, &stats) == 0 && stats.heap_totalsz_bytes > 0)
+            return s;
+
+    rte_panic("No memory on a socket other than %d, see --socket-mem\n", socket_id);
+}
+
+/** run app_pkts packets of `gen` through nb_workers worker lcores, and return Mpps. The generator gets the next
+    lcore if there is one left, the master lcore otherwise. Flow state (tables, queues) of a worker is on its
+    socket, or on another one if `remote` */
+static double
+run_workers(struct rte_mempool *pool, struct gen *gen, uint32_t nb_workers, int remote)
+{
+    struct worker *workers = rte_zmalloc("workers", nb_workers * sizeof(struct worker), RTE_CACHE_LINE_SIZE);
+    if (workers == NULL)
+        rte_panic("Cannot allocate workers\n");
+
+    // Shards get a fair share of the flows, with room for imbalance. Flows beyond that share one flow.
+    uint32_t capacity = app_flows / nb_workers + app_flows / nb_workers / 4 + 64;
+    unsigned lcore_id;
+    uint32_t w = 0;
+
+    RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+        if (w == nb_workers)
+            break;
+
+        char name[RTE_RING_NAMESIZE];
+        int socket_id = (int)rte_lcore_to_socket_id(lcore_id);
+        int state_socket = remote ? remote_socket(socket_id) : socket_id;
+        workers[w].lcore_id = lcore_id;
+        snprintf(name, sizeof(name), "worker_ring_%u", w);
+        workers[w].ring = rte_ring_create(name, APP_RING_SIZE, socket_id, RING_F_SP_ENQ | RING_F_SC_DEQ);
+        if (workers[w].ring == NULL)
+            rte_panic("Cannot create ring for worker %u\n", w);
+        snprintf(name, sizeof(name), "worker_flows_%u", w);
+        workers[w].table = flow_table_create(name, capacity, state_socket);
+        telemetry_register(lcore_id, workers[w].table);
+        if (app_egress_rate > 0) {
+            snprintf(name, sizeof(name), "worker_egress_%u", w);
+            workers[w].egress = egress_create(name, app_egress_rate, state_socket);
+        }
+        if (app_fifo_rate > 0) {
+            snprintf(name, sizeof(name), "worker_fifo_%u", w);
+            workers[w].fifo = fifo_create(name, app_fifo_rate, capacity + 1, state_socket);
+        }
+        w++;
+    }
+    if (w < nb_workers)
+        rte_panic("%u workers need %u lcores besides the master one\n", nb_workers, nb_workers);
+
+    unsigned gen_lcore = rte_get_next_lcore(workers[nb_workers - 1].lcore_id, 1, 0);
+    gen->pool = pool;
+    gen->workers = workers;
+    gen->nb_workers = nb_workers;
+    gen->nb_pkts = app_pkts;
+    gen->poll = gen_lcore >= RTE_MAX_LCORE;
+    gen->done = 0;
+
+    app_quit = 0;
+    rte_smp_wmb();
+    for (w = 0; w < nb_workers; w++)
+        rte_eal_remote_launch(worker_main, &workers[w], workers[w].lcore_id);
+
+    // RX stage: the generator passes packets to the worker owning their flow. The master lcore polls meanwhile.
+    uint64_t start = rte_rdtsc();
+
+    if (gen->poll) {
+        gen_main(gen);
+    } else {
+        rte_eal_remote_launch(gen_main, gen, gen_lcore);
+        while (!gen->done) {
+            telemetry_poll();
+            config_poll();
+            rte_pause();
+        }
+    }
+
+    rte_smp_wmb();
+    app_quit = 1;
+    rte_eal_mp_wait_lcore();
+
+    double seconds = (double)(rte_rdtsc() - start) / rte_get_tsc_hz();
+    uint64_t pkts_done = 0;
+
+    telemetry_publish();
+    telemetry_print();
+    gen_print_stats(gen);
+
+    for (w = 0; w < nb_workers; w++) {
+        char label[32];
+        snprintf(label, sizeof(label), "worker %u", w);
+        if (workers[w].egress != NULL) {
+            int tc;
+            for (tc = 0; tc < RTE_SCHED_TRAFFIC_CLASSES_PER_PIPE; tc++)
+                workers[w].bytes += workers[w].egress->tc_bytes[tc];
+        }
+        if (workers[w].fifo != NULL) {
+            int c;
+            for (c = 0; c < QOS_COLORS; c++)
+                workers[w].bytes += workers[w].fifo->bytes[c];
+        }
+        printf("%s (lcore %u): %" PRIu64 " packets, %" PRIu64 " dropped, %" PRIu64 " bytes passed, "
+            "%u flows\n", label, workers[w].lcore_id, workers[w].pkts, workers[w].drops, workers[w].bytes,
+            workers[w].table->count);
+        if (workers[w].egress != NULL)
+            egress_print_stats(workers[w].egress, label);
+        if (workers[w].fifo != NULL)
+            fifo_print_stats(workers[w].fifo, label);
+        pkts_done += workers[w].pkts;
+        telemetry_register(workers[w].lcore_id, NULL);
+        rte_ring_free(workers[w].ring);
+        flow_table_free(workers[w].table);
+        egress_free(workers[w].egress);
+        fifo_free(workers[w].fifo);
+    }
+    rte_free(workers);
+
+    return pkts_done / seconds / 1e6;
+}
+
+/** receive from the first port and send to the last one, then print what went through */
+static void
+run_port(struct rte_mempool *pool)
+{
+    uint16_t nb_ports = rte_eth_dev_count();
+    if (nb_ports == 0)
+        rte_panic("No ports, add one with --vdev (e.g. net_pcap0,rx_pcap=in.pcap,tx_pcap=out.pcap)\n");
+
+    uint16_t rx_port = 0, tx_port = (uint16_t)(nb_ports - 1);
+    port_init(rx_port, pool);
+    if (tx_port != rx_port)
+        port_init(tx_port, pool);
+
+    struct port_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    port_run(rx_port, tx_port, app_pkts, &stats);
+
+    int i;
+    for (i = 0; i < APP_PROFILES; i++) {
+        printf("profile: %d, send: %" PRIu64 ", pass: %" PRIu64 "\n", i, stats.send[i], stats.pass[i]);
+    }
+    printf("port %u -> %u: %" PRIu64 " received, %" PRIu64 " dropped, %" PRIu64 " sent, %" PRIu64 " TX failed\n",
+        rx_port, tx_port, stats.rx_pkts, stats.drops, stats.tx_pkts, stats.tx_fails);
+    telemetry_publish();
+    telemetry_print();
+
+    rte_eth_dev_stop(rx_port);
+    rte_eth_dev_close(rx_port);
+    if (tx_port != rx_port) {
+        rte_eth_dev_stop(tx_port);
+        rte_eth_dev_close(tx_port);
+    }
+}
+
+/** stop the current run on Ctrl-C */
+static void
+signal_handler(int signum)
+{
+    if (signum == SIGINT || signum == SIGTERM)
+        app_quit = 1;
+}
+
+/** parse application arguments (after the EAL ones) */
+static void
+parse_args(int argc, char **argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:w:sNn:e:q:z:m:g:o:pb:t:c:")) != -1) {
+        switch (opt) {
+        case 'f': // Number of flows.
+            app_flows = (uint32_t)atoi(optarg);
+            if (app_flows == 0)
+                rte_panic("Invalid number of flows\n");
+            break;
+        case 'w': // Number of worker lcores.
+            app_workers = (uint32_t)atoi(optarg);
+            break;
+        case 's': // Scaling benchmark.
+            app_scaling = 1;
+            break;
+        case 'N': // Local vs remote flow state.
+            app_numa = 1;
+            break;
+        case 'n': // Packets per multi-core run.
+            app_pkts = strtoull(optarg, NULL, 0);
+            break;
+        case 'e': // Egress port rate in Mbps.
+            app_egress_rate = (uint32_t)(atof(optarg) * 1e6 / 8);
+            break;
+        case 'q': // Flow queue service rate in Mbps.
+            app_fifo_rate = (uint64_t)(atof(optarg) * 1e6 / 8);
+            break;
+        case 'z': // Zipf exponent.
+            app_zipf = atof(optarg);
+            break;
+        case 'm': // Packet size mix.
+            app_mix = optarg;
+            break;
+        case 'g': // Offered load in Gbps.
+            app_gbps = atof(optarg);
+            break;
+        case 'o': // On/off times in us.
+            if (sscanf(optarg, "%" SCNu64 ",%" SCNu64, &app_on_us, &app_off_us) != 2)
+                rte_panic("Invalid on/off times, expected on_us,off_us\n");
+            break;
+        case 'p': // Port mode.
+            app_port = 1;
+            break;
+        case 'b': // Benchmark sweep.
+            app_bench_csv = optarg;
+            break;
+        case 't': // Telemetry period in ms.
+            app_telemetry_ms = (uint32_t)atoi(optarg);
+            break;
+        case 'c': // Parameter file.
+            app_config = optarg;
+            break;
+        default:
+            rte_panic("Usage: %s [EAL options] -- [-f flows] [-w workers [-s] [-N] [-n packets] [-e Mbps | -q Mbps] "
+                "[-z s] [-m 64|1500|uniform|imix|file] [-g Gbps] [-o on_us,off_us]] "
+                "[-p [-n packets]] [-b file.csv] [-t ms] [-c file]\n"
+                "-q: a flow queue takes 8 bytes of hugepages per packet of max_th + 1, rounded up to a power of 2\n",
+                argv[0]);
+        }
+    }
+}
 
 int
 main(int argc, char **argv)
@@ -15,44 +302,166 @@ main(int argc, char **argv)
     ret = rte_eal_init(argc, argv);
     if (ret < 0)
         rte_panic("Cannot init EAL\n");
+    parse_args(argc - ret, argv + ret);
 
     qos_meter_init();
     qos_dropper_init();
+    telemetry_init(app_telemetry_ms);
+
+    /** parameters from a file, reloaded on SIGHUP */
+    if (app_config != NULL) {
+        if (config_reload(app_config) != 0)
+            rte_panic("Cannot load %s\n", app_config);
+        config_watch(app_config);
+    }
+
+    /** classify flows in a table, with flow i using profile i % APP_PROFILES */
+    struct flow_table *table = flow_table_create("flows", app_flows, rte_socket_id());
+    RTE_PER_LCORE(flow_table) = table;
+    telemetry_register(rte_lcore_id(), table);
+
+    /** port mode: flows are learned from the packets received */
+    if (app_port) {
+        struct rte_mempool *pool = rte_pktmbuf_pool_create("mbufs", APP_MBUFS, APP_MBUF_CACHE, 0,
+            RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
+        if (pool == NULL)
+            rte_panic("Cannot create mbuf pool\n");
+
+        signal(SIGINT, signal_handler);
+        signal(SIGTERM, signal_handler);
+        run_port(pool);
+
+        printf("flows: %u in table, %u packets of flows that did not fit\n", table->count, table->overflows);
+        flow_table_free(table);
+        return 0;
+    }
+
+    flow_keys = rte_malloc("flow_keys", app_flows * sizeof(struct qos_flow_key), 0);
+    if (flow_keys == NULL)
+        rte_panic("Cannot allocate flow keys\n");
+    for (i = 0; i < (int)app_flows; i++) {
+        flow_key_init(&flow_keys[i], (uint32_t)i);
+        flow_table_add(table, &flow_keys[i], (uint32_t)i % APP_PROFILES);
+    }
+
+    /** benchmark sweep */
+    if (app_bench_csv != NULL) {
+        FILE *out = strcmp(app_bench_csv, "-") == 0 ? stdout : fopen(app_bench_csv, "w");
+        if (out == NULL)
+            rte_panic("Cannot open %s\n", app_bench_csv);
+
+        bench_sweep(flow_keys, app_flows, out);
+
+        if (out != stdout)
+            fclose(out);
+        flow_table_free(table);
+        rte_free(flow_keys);
+        return 0;
+    }
 
     srand(time(NULL));
+
+    /** multi-core mode */
+    if (app_workers > 0) {
+        if (app_workers >= rte_lcore_count())
+            rte_panic("%u workers need %u lcores (-l/-c)\n", app_workers, app_workers + 1);
+        if (app_egress_rate > 0 && app_fifo_rate > 0)
+            rte_panic("Choose the egress scheduler (-e) or flow queues (-q)\n");
+
+        // Schedulers hold up to one full queue per class and pipe each, flow queues up to FIFO_MBUFS each.
+        uint32_t nb_mbufs = APP_MBUFS;
+        if (app_egress_rate > 0)
+            nb_mbufs += app_workers * EGRESS_PIPES * RTE_SCHED_TRAFFIC_CLASSES_PER_PIPE * EGRESS_QSIZE;
+        if (app_fifo_rate > 0)
+            nb_mbufs += app_workers * FIFO_MBUFS;
+
+        struct rte_mempool *pool = rte_pktmbuf_pool_create("mbufs", nb_mbufs, APP_MBUF_CACHE, 0,
+            RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
+        if (pool == NULL)
+            rte_panic("Cannot create mbuf pool\n");
+
+        struct gen *gen = gen_create(flow_keys, app_flows, app_zipf, app_mix, app_gbps, app_on_us, app_off_us);
+
+        uint32_t w;
+        for (w = app_scaling ? 1 : app_workers; w <= app_workers; w++) {
+            double mpps = run_workers(pool, gen, w, 0);
+            if (!app_numa) {
+                printf("%u workers, %u flows: %.2f Mpps\n", w, app_flows, mpps);
+                continue;
+            }
+
+            double remote_mpps = run_workers(pool, gen, w, 1);
+            printf("%u workers, %u flows: %.2f Mpps with flow state local, %.2f Mpps remote (%+.1f%%)\n", w,
+                app_flows, mpps, remote_mpps, (remote_mpps / mpps - 1) * 100);
+        }
+
+        gen_free(gen);
+        flow_table_free(table);
+        rte_free(flow_keys);
+        return 0;
+    }
+
     uint64_t time = 0;
-    int cnt_send[APP_FLOWS_MAX];
-    int cnt_pass[APP_FLOWS_MAX];
-    for (i = 0; i < APP_FLOWS_MAX; i++) {
+    uint64_t cnt_send[APP_PROFILES];
+    uint64_t cnt_pass[APP_PROFILES];
+    for (i = 0; i < APP_PROFILES; i++) {
         cnt_send[i] = cnt_pass[i] = 0;
     }
 
+    const struct qos_flow_key *keys[APP_BURST_MAX];
+    uint32_t flow_ids[APP_BURST_MAX];
+    uint32_t pkt_lens[APP_BURST_MAX];
+    enum qos_color colors[APP_BURST_MAX];
+    uint8_t drops[APP_BURST_MAX];
+
     for (i = 0; i < 10; i++) {
         /** 1000 packets per period averagely */
         int burst = 500 + rand() % 1000;
 
-        for (j = 0; j < burst; j++) {
-            uint32_t flow_id = (uint32_t)(rand() % APP_FLOWS_MAX);
-            
-            /** 640 bytes per packet averagely */
-            uint32_t pkt_len = (uint32_t)(128 + rand() % 1024);
-        
+        while (burst > 0) {
+            int n = RTE_MIN(burst, APP_BURST_MAX);
+            burst -= n;
+
+            for (j = 0; j < n; j++) {
+                keys[j] = &flow_keys[(uint32_t)rand() % app_flows];
+
+                /** 640 bytes per packet averagely */
+                pkt_lens[j] = (uint32_t)(128 + rand() % 1024);
+            }
+
+            config_poll();
+
+            /** classify */
+            flow_table_lookup_burst(table, keys, n, flow_ids);
+
             /** get color */
-            enum qos_color color = qos_meter_run(flow_id, pkt_len, time);
-            
+            qos_meter_run_burst(flow_ids, pkt_lens, n, time, colors);
+
             /** make decision: weather drop */
-            int pass = qos_dropper_run(flow_id, color, time);
+            qos_dropper_run_burst(flow_ids, colors, n, time, drops);
 
-            cnt_send[flow_id] += pkt_len;
-            cnt_pass[flow_id] += pass ? 0 : pkt_len;
+            telemetry_count_burst(table, flow_ids, pkt_lens, colors, drops, (uint32_t)n);
 
+            for (j = 0; j < n; j++) {
+                uint32_t profile = table->flows[flow_ids[j]].profile;
+                cnt_send[profile] += pkt_lens[j];
+                cnt_pass[profile] += drops[j] ? 0 : pkt_lens[j];
+            }
         }
         time += 1000000;
     }
 
-    for (i = 0; i < APP_FLOWS_MAX; i++) {
-        printf("fid: %d, send: %d, pass: %d\n", i, cnt_send[i], cnt_pass[i]);
+    for (i = 0; i < APP_PROFILES; i++) {
+        printf("profile: %d, send: %" PRIu64 ", pass: %" PRIu64 "\n", i, cnt_send[i], cnt_pass[i]);
     }
+    printf("flows: %u in table, %u packets of flows that did not fit\n", table->count, table->overflows);
+
+    telemetry_print();
+
+    bench_compare(flow_keys, app_flows);
+
+    flow_table_free(table);
+    rte_free(flow_keys);
 
     return 0;
-}
\ No newline at end of file
+}
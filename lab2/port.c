@@ -0,0 +1,111 @@
+#include "rte_common.h"
+#include "rte_cycles.h"
+#include "rte_ethdev.h"
+#include "rte_mbuf.h"
+
+#include "config.h"
+#include "flow_table.h"
+#include "port.h"
+#include "qos.h"
+#include "telemetry.h"
+#include "worker.h"
+
+
+static const struct rte_eth_conf port_conf = {
+    .rxmode = {
+        .max_rx_pkt_len = ETHER_MAX_LEN,
+    },
+};
+
+
+void
+port_init(uint16_t port_id, struct rte_mempool *pool)
+{
+    int socket_id = rte_eth_dev_socket_id(port_id);
+    if (socket_id < 0)
+        socket_id = 0; // Virtual devices have no socket.
+
+    if (rte_eth_dev_configure(port_id, 1, 1, &port_conf) < 0)
+        rte_panic("Cannot configure port %u\n", port_id);
+    if (rte_eth_rx_queue_setup(port_id, 0, PORT_RX_DESC, (unsigned)socket_id, NULL, pool) < 0)
+        rte_panic("Cannot set up RX queue of port %u\n", port_id);
+    if (rte_eth_tx_queue_setup(port_id, 0, PORT_TX_DESC, (unsigned)socket_id, NULL) < 0)
+        rte_panic("Cannot set up TX queue of port %u\n", port_id);
+    if (rte_eth_dev_start(port_id) < 0)
+        rte_panic("Cannot start port %u\n", port_id);
+
+    rte_eth_promiscuous_enable(port_id);
+}
+
+void
+port_run(uint16_t rx_port, uint16_t tx_port, uint64_t max_pkts, struct port_stats *stats)
+{
+    struct flow_table *table = RTE_PER_LCORE(flow_table);
+    struct rte_mbuf *pkts[APP_BURST_MAX];
+    struct rte_mbuf *dropped[APP_BURST_MAX];
+    struct qos_flow_key keys[APP_BURST_MAX];
+    const struct qos_flow_key *key_ptrs[APP_BURST_MAX];
+    uint32_t flow_ids[APP_BURST_MAX];
+    uint32_t pkt_lens[APP_BURST_MAX];
+    enum qos_color colors[APP_BURST_MAX];
+    uint8_t drops[APP_BURST_MAX];
+    uint32_t i;
+
+    uint64_t cycles_per_ms = rte_get_tsc_hz() / 1000;
+    uint64_t last_rx = 0;
+
+    for (i = 0; i < APP_BURST_MAX; ++i)
+        key_ptrs[i] = &keys[i];
+
+    while (!app_quit && stats->rx_pkts < max_pkts) {
+        telemetry_poll();
+        config_poll();
+
+        uint32_t n = rte_eth_rx_burst(rx_port, 0, pkts, APP_BURST_MAX);
+        uint64_t now = rte_rdtsc();
+        if (n == 0) {
+            if (last_rx != 0 && now - last_rx > PORT_IDLE_MS * cycles_per_ms)
+                break;
+            continue;
+        }
+        last_rx = now;
+
+        // Time periods are the 1 ms (1000000 ns) ones of generated traffic, taken from the TSC.
+        uint64_t time = now / cycles_per_ms * 1000000;
+
+        // Classify. Headers are read in place, the flow id goes to the mbuf.
+        for (i = 0; i < n; ++i)
+            pkt_parse(pkts[i], &keys[i]);
+        flow_table_lookup_burst(table, key_ptrs, n, flow_ids);
+        for (i = 0; i < n; ++i) {
+            pkts[i]->hash.usr = flow_ids[i];
+            pkt_lens[i] = rte_pktmbuf_pkt_len(pkts[i]);
+        }
+
+        qos_meter_run_mbufs(pkts, n, time, colors);
+        stats->drops += qos_dropper_run_burst(flow_ids, colors, n, time, drops);
+        stats->rx_pkts += n;
+        telemetry_count_burst(table, flow_ids, pkt_lens, colors, drops, n);
+
+        // Keep passed packets in order at the front of the burst, and free the dropped ones at once.
+        uint32_t kept = 0, nb_dropped = 0;
+        for (i = 0; i < n; ++i) {
+            uint32_t profile = table->flows[flow_ids[i]].profile;
+            stats->send[profile] += pkt_lens[i];
+            if (drops[i]) {
+                dropped[nb_dropped++] = pkts[i];
+                continue;
+            }
+            stats->pass[profile] += pkt_lens[i];
+            pkts[kept++] = pkts[i];
+        }
+        pkt_free_bulk(dropped, nb_dropped);
+
+        uint32_t sent = rte_eth_tx_burst(tx_port, 0, pkts, (uint16_t)kept);
+        stats->tx_pkts += sent;
+        if (sent < kept) {
+            stats->tx_fails += kept - sent;
+            pkt_free_bulk(pkts + sent, kept - sent);
+        }
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef __PORT_H__
+#define __PORT_H__
+
+#include <stdint.h>
+
+#include "qos.h"
+
+/**
+ * Port mode: the datapath over ethdev ports instead of generated packets. Bursts received on one port are
+ * classified, metered and dropped in place, and the packets kept are sent on another (or the same) port. Any
+ * ethdev works, e.g. net_pcap to replay a capture, so no NIC is needed
+ */
+
+#define PORT_RX_DESC        1024
+#define PORT_TX_DESC        1024
+#define PORT_IDLE_MS        1000 // Stop once nothing is received for this long, e.g. at the end of a capture.
+
+struct rte_mempool;
+
+struct port_stats {
+    uint64_t rx_pkts; // Packets received,
+    uint64_t drops; // dropped by the dropper,
+    uint64_t tx_pkts; // sent and
+    uint64_t tx_fails; // not accepted by the TX queue (freed).
+    uint64_t send[APP_PROFILES]; // Bytes received per profile,
+    uint64_t pass[APP_PROFILES]; // and kept by the dropper.
+};
+
+/* Configure a port with one RX queue filled from `pool` and one TX queue, and start it. Panic on failure */
+void port_init(uint16_t port_id, struct rte_mempool *pool);
+
+/* Run bursts from rx_port through the flow table of the calling lcore and the meter and dropper, to tx_port, until
+   max_pkts are received, app_quit is set or the input stays idle for PORT_IDLE_MS */
+void port_run(uint16_t rx_port, uint16_t tx_port, uint64_t max_pkts, struct port_stats *stats);
+
+#endif
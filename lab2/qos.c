@@ -1,39 +1,180 @@
+#include "rte_atomic.h"
 #include "rte_common.h"
+#include "rte_lcore.h"
+#include "rte_malloc.h"
 #include "rte_mbuf.h"
 #include "rte_meter.h"
+#include "rte_prefetch.h"
 #include "rte_red.h"
 
+#include "flow_table.h"
 #include "qos.h"
 
 #include <assert.h>
 #include <string.h>
 
 
-struct rte_meter_srtcm_params srtcm_params[APP_FLOWS_MAX]; // srTCM parameters per flow.
-struct rte_meter_srtcm srtcm_data[APP_FLOWS_MAX]; // srTCM data per flow.
-struct rte_red_config red_params[e_RTE_METER_COLORS]; // RED parameters per color.
-struct rte_red red_data[APP_FLOWS_MAX][e_RTE_METER_COLORS]; // RED data per flow per color.
-unsigned queue_size[APP_FLOWS_MAX][e_RTE_METER_COLORS] = {}; // Queue per flow per color.
-uint64_t last_time = 0; // Used to detect time change and clear queues.
+/* Parameters in the form of rte_meter and rte_red */
+struct qos_config {
+    struct rte_meter_srtcm_params srtcm_params[APP_PROFILES]; // srTCM parameters per profile.
+    struct rte_red_config red_params[e_RTE_METER_COLORS]; // RED parameters per color.
+    struct qos_params params; // As given.
+    uint32_t version; // Incremented at every update.
+} __rte_cache_aligned;
 
-#define SRTCM_CONFIG(flow_id, cir_, cbs_, ebs_) do { \
-    srtcm_params[(flow_id)].cir = (cir_); \
-    srtcm_params[(flow_id)].cbs = (cbs_); \
-    srtcm_params[(flow_id)].ebs = (ebs_); \
-    if (rte_meter_srtcm_config(&srtcm_data[(flow_id)], &srtcm_params[(flow_id)]) != 0) \
-        rte_panic("Cannot init srTCM data\n"); \
+/* Parameters of the lcores of one socket, allocated on it */
+struct qos_replica {
+    struct qos_config configs[2]; // Double buffer: the active parameters, and the next or previous ones.
+    struct qos_config *volatile active; // Active parameters.
+} __rte_cache_aligned;
+
+/* Quiescent state of an lcore */
+struct qos_reader {
+    volatile uint64_t token; // Last token seen between bursts, 0 if not registered.
+} __rte_cache_aligned;
+
+struct qos_replica *qos_replicas[RTE_MAX_NUMA_NODES]; // Per socket with lcores, NULL for the others.
+struct qos_reader qos_readers[RTE_MAX_LCORE];
+volatile uint64_t qos_token = 1; // Incremented after every switch of parameters.
+
+#define QOS_PREFETCH_OFFSET 4 // How many packets ahead per-flow state is prefetched in burst mode.
+
+#define SRTCM_CONFIG(profile, cir_, cbs_, ebs_) do { \
+    params.srtcm[(profile)].cir = (cir_); \
+    params.srtcm[(profile)].cbs = (cbs_); \
+    params.srtcm[(profile)].ebs = (ebs_); \
 } while (0)
 
-#define RED_CONFIG(color, wq_log2, min_th, max_th, maxp_inv) do { \
-    if (rte_red_config_init(&red_params[(color)], (wq_log2), (min_th), (max_th), (maxp_inv)) != 0) \
-        rte_panic("Cannot init RED config\n"); \
-    int i; \
-    for (i = 0; i < APP_FLOWS_MAX; ++i) \
-        if (rte_red_rt_data_init(&red_data[i][(color)]) != 0) \
-            rte_panic("Cannot init RED data\n"); \
+#define RED_CONFIG(color, wq_log2_, min_th_, max_th_, maxp_inv_) do { \
+    params.red[(color)].wq_log2 = (wq_log2_); \
+    params.red[(color)].min_th = (min_th_); \
+    params.red[(color)].max_th = (max_th_); \
+    params.red[(color)].maxp_inv = (maxp_inv_); \
 } while (0)
 
 
+/**
+ * Parameters
+ */
+
+// Active parameters on the socket of the calling lcore.
+static inline struct qos_config *
+qos_config_get(void)
+{
+    return qos_replicas[rte_socket_id()]->active;
+}
+
+// Create the replicas of the parameters, on every socket with lcores.
+static void
+qos_replicas_create(void)
+{
+    unsigned lcore_id;
+
+    RTE_LCORE_FOREACH(lcore_id) {
+        unsigned socket_id = rte_lcore_to_socket_id(lcore_id);
+        if (qos_replicas[socket_id] != NULL)
+            continue;
+
+        struct qos_replica *replica = rte_zmalloc_socket("qos_params", sizeof(*replica), RTE_CACHE_LINE_SIZE,
+            (int)socket_id);
+        if (replica == NULL)
+            rte_panic("Cannot allocate parameters on socket %u\n", socket_id);
+        replica->active = &replica->configs[0];
+        qos_replicas[socket_id] = replica;
+    }
+}
+
+// Meter parameters in the form of rte_meter. Return -1 if invalid.
+static int
+qos_config_srtcm(struct qos_config *config, const struct qos_params *params)
+{
+    struct rte_meter_srtcm check;
+    int i;
+
+    for (i = 0; i < APP_PROFILES; ++i) {
+        config->srtcm_params[i].cir = params->srtcm[i].cir;
+        config->srtcm_params[i].cbs = params->srtcm[i].cbs;
+        config->srtcm_params[i].ebs = params->srtcm[i].ebs;
+        if (rte_meter_srtcm_config(&check, &config->srtcm_params[i]) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+// Dropper parameters in the form of rte_red. Return -1 if invalid.
+static int
+qos_config_red(struct qos_config *config, const struct qos_params *params)
+{
+    int i;
+
+    for (i = 0; i < e_RTE_METER_COLORS; ++i)
+        if (rte_red_config_init(&config->red_params[i], params->red[i].wq_log2, params->red[i].min_th,
+                params->red[i].max_th, params->red[i].maxp_inv) != 0)
+            return -1;
+
+    return 0;
+}
+
+
+/**
+ * Flow state
+ */
+void
+qos_flow_init(struct qos_flow *flow, uint32_t profile)
+{
+    assert(profile < APP_PROFILES);
+
+    struct qos_config *config = qos_config_get();
+
+    memset(flow, 0, sizeof(*flow));
+    flow->profile = profile;
+    flow->version = config->version;
+
+    if (rte_meter_srtcm_config(&flow->srtcm, &config->srtcm_params[profile]) != 0)
+        rte_panic("Cannot init srTCM data\n");
+
+    int i;
+    for (i = 0; i < e_RTE_METER_COLORS; ++i)
+        if (rte_red_rt_data_init(&flow->red[i]) != 0)
+            rte_panic("Cannot init RED data\n");
+}
+
+// Flow `flow_id` of a table.
+static inline struct qos_flow *
+qos_flow_get(struct flow_table *table, uint32_t flow_id)
+{
+    assert(flow_id <= table->capacity);
+
+    return &table->flows[flow_id];
+}
+
+// Meter data of a flow for the parameters `config`: buckets get the new sizes and rate, tokens are kept up to
+// the new sizes.
+static void
+qos_flow_reconfig(struct qos_flow *flow, struct qos_config *config)
+{
+    struct rte_meter_srtcm old = flow->srtcm;
+
+    // The parameters were checked by qos_params_update().
+    rte_meter_srtcm_config(&flow->srtcm, &config->srtcm_params[flow->profile]);
+    flow->srtcm.time = old.time;
+    flow->srtcm.tc = RTE_MIN(old.tc, flow->srtcm.cbs);
+    flow->srtcm.te = RTE_MIN(old.te, flow->srtcm.ebs);
+    flow->version = config->version;
+}
+
+// Meter a packet of a flow.
+static inline enum qos_color
+qos_flow_meter(struct qos_flow *flow, struct qos_config *config, uint32_t pkt_len, uint64_t time)
+{
+    if (unlikely(flow->version != config->version))
+        qos_flow_reconfig(flow, config);
+
+    return (enum qos_color)rte_meter_srtcm_color_blind_check(&flow->srtcm, time, pkt_len);
+}
+
+
 /**
  * srTCM
  */
@@ -41,18 +182,32 @@ int
 qos_meter_init(void)
 {
     /* to do */
+    qos_replicas_create();
+    struct qos_params params = qos_config_get()->params;
 
     /* Limit allowance of flow 0 to 160000 bytes in every time period (1000000 ns).
      * So bandwidth is limited to 1.28 Gbps.
      * Disperse allowance evenly to two token buckets. (Half green, half yellow, exceed allowance -> red)
      * Refill every token bucket after a time period.
-     * Allowances for 4 flows are in proportion of 8:4:2:1.
+     * Allowances for 4 profiles are in proportion of 8:4:2:1.
      */
     SRTCM_CONFIG(0, 160000000000, 80000, 80000);
     SRTCM_CONFIG(1, 80000000000, 40000, 40000);
     SRTCM_CONFIG(2, 40000000000, 20000, 20000);
     SRTCM_CONFIG(3, 20000000000, 10000, 10000);
 
+    unsigned socket_id;
+    for (socket_id = 0; socket_id < RTE_MAX_NUMA_NODES; socket_id++) {
+        if (qos_replicas[socket_id] == NULL)
+            continue;
+
+        struct qos_config *config = qos_replicas[socket_id]->active;
+        if (qos_config_srtcm(config, &params) != 0)
+            rte_panic("Cannot init srTCM config\n");
+        config->params = params;
+        config->version = 1;
+    }
+
     return 0;
 }
 
@@ -60,9 +215,55 @@ enum qos_color
 qos_meter_run(uint32_t flow_id, uint32_t pkt_len, uint64_t time)
 {
     /* to do */
-    assert(flow_id < APP_FLOWS_MAX);
+    struct qos_flow *flow = qos_flow_get(RTE_PER_LCORE(flow_table), flow_id);
 
-    return rte_meter_srtcm_color_blind_check(&srtcm_data[flow_id], time, pkt_len);
+    return qos_flow_meter(flow, qos_config_get(), pkt_len, time);
+}
+
+void
+qos_meter_run_burst(const uint32_t *flow_ids, const uint32_t *pkt_lens, uint32_t n, uint64_t time,
+    enum qos_color *colors)
+{
+    struct flow_table *table = RTE_PER_LCORE(flow_table);
+    struct qos_config *config = qos_config_get();
+    uint32_t i;
+
+    // Warm up the first few flows, then keep QOS_PREFETCH_OFFSET packets ahead.
+    for (i = 0; i < n && i < QOS_PREFETCH_OFFSET; ++i)
+        rte_prefetch0(&table->flows[flow_ids[i]].srtcm);
+
+    for (i = 0; i < n; ++i) {
+        if (i + QOS_PREFETCH_OFFSET < n)
+            rte_prefetch0(&table->flows[flow_ids[i + QOS_PREFETCH_OFFSET]].srtcm);
+
+        struct qos_flow *flow = qos_flow_get(table, flow_ids[i]);
+        colors[i] = qos_flow_meter(flow, config, pkt_lens[i], time);
+    }
+}
+
+void
+qos_meter_run_mbufs(struct rte_mbuf **pkts, uint32_t n, uint64_t time, enum qos_color *colors)
+{
+    struct flow_table *table = RTE_PER_LCORE(flow_table);
+    struct qos_config *config = qos_config_get();
+    uint32_t i;
+
+    // Two stages: the mbuf header is prefetched 2 * QOS_PREFETCH_OFFSET packets ahead, so its flow id can be
+    // read to prefetch the flow state QOS_PREFETCH_OFFSET packets ahead.
+    for (i = 0; i < n && i < 2 * QOS_PREFETCH_OFFSET; ++i)
+        rte_prefetch0(pkts[i]);
+    for (i = 0; i < n && i < QOS_PREFETCH_OFFSET; ++i)
+        rte_prefetch0(&table->flows[pkts[i]->hash.usr].srtcm);
+
+    for (i = 0; i < n; ++i) {
+        if (i + 2 * QOS_PREFETCH_OFFSET < n)
+            rte_prefetch0(pkts[i + 2 * QOS_PREFETCH_OFFSET]);
+        if (i + QOS_PREFETCH_OFFSET < n)
+            rte_prefetch0(&table->flows[pkts[i + QOS_PREFETCH_OFFSET]->hash.usr].srtcm);
+
+        struct qos_flow *flow = qos_flow_get(table, pkts[i]->hash.usr);
+        colors[i] = qos_flow_meter(flow, config, rte_pktmbuf_pkt_len(pkts[i]), time);
+    }
 }
 
 
@@ -74,6 +275,8 @@ int
 qos_dropper_init(void)
 {
     /* to do */
+    qos_replicas_create();
+    struct qos_params params = qos_config_get()->params;
 
     /* Enqueue as many green/yellow packets as possible.
      * Drop all red packets.
@@ -82,32 +285,220 @@ qos_dropper_init(void)
     RED_CONFIG(YELLOW, 9, 1022, 1023, 10);
     RED_CONFIG(RED, 9, 0, 1, 10);
 
+    unsigned socket_id;
+    for (socket_id = 0; socket_id < RTE_MAX_NUMA_NODES; socket_id++) {
+        if (qos_replicas[socket_id] == NULL)
+            continue;
+
+        struct qos_config *config = qos_replicas[socket_id]->active;
+        if (qos_config_red(config, &params) != 0)
+            rte_panic("Cannot init RED config\n");
+        config->params = params;
+    }
+
     return 0;
 }
 
+static void
+qos_dropper_check_time(struct flow_table *table, uint64_t time)
+{
+    if (time != table->last_time) // Time change detected. Clear all queues (lazily).
+        ++table->epoch;
+
+    table->last_time = time;
+}
+
+static inline uint32_t
+qos_flow_occupancy(const struct qos_flow *flow)
+{
+    return flow->queue_size[e_RTE_METER_GREEN] + flow->queue_size[e_RTE_METER_YELLOW] +
+        flow->queue_size[e_RTE_METER_RED];
+}
+
+static inline int
+qos_dropper_decide(struct flow_table *table, struct qos_config *config, uint32_t flow_id,
+    enum qos_color color, uint64_t time)
+{
+    struct qos_flow *flow = qos_flow_get(table, flow_id);
+
+    // First use in this epoch: clear the queues. Time does not change within an epoch, so this notifies the
+    // algorithm with the same time as clearing them at the time change would.
+    if (unlikely(flow->epoch != table->epoch) && !table->drained) {
+        int i;
+        for (i = 0; i < e_RTE_METER_COLORS; ++i) {
+            flow->queue_size[i] = 0;
+            rte_red_mark_queue_empty(&flow->red[i], time);
+        }
+        flow->epoch = table->epoch;
+    }
+
+    // Make decision. A drained flow has one FIFO for all colors, so each color's RED sees the whole occupancy against
+    // its own thresholds, as WRED in rte_sched does.
+    uint32_t queue = table->drained ? qos_flow_occupancy(flow) : flow->queue_size[color];
+    int result = !!rte_red_enqueue(&config->red_params[color], &flow->red[color], queue, time);
+
+    // Enqueue if not dropped.
+    if (!result)
+        ++flow->queue_size[color];
+
+    return result;
+}
+
 int
 qos_dropper_run(uint32_t flow_id, enum qos_color color, uint64_t time)
 {
     /* to do */
+    struct flow_table *table = RTE_PER_LCORE(flow_table);
 
-    assert(flow_id < APP_FLOWS_MAX);
+    qos_dropper_check_time(table, time);
+
+    return qos_dropper_decide(table, qos_config_get(), flow_id, color, time);
+}
 
-    if (time != last_time) { // Time change detected. Clear all queues.
-        memset(queue_size, 0, sizeof(queue_size));
-        int i, j;
-        for (i = 0; i < APP_FLOWS_MAX; ++i)
-            for (j = 0; j < e_RTE_METER_COLORS; ++j)
-                rte_red_mark_queue_empty(&red_data[i][j], time); // Notify the algorithm about queue clear.
+uint32_t
+qos_dropper_run_burst(const uint32_t *flow_ids, const enum qos_color *colors, uint32_t n, uint64_t time,
+    uint8_t *drops)
+{
+    struct flow_table *table = RTE_PER_LCORE(flow_table);
+    struct qos_config *config = qos_config_get();
+    uint32_t i, dropped = 0;
+
+    // The whole burst shares one time stamp, so the period check is done once.
+    qos_dropper_check_time(table, time);
+
+    // RED data and queues of a flow share one cache line.
+    for (i = 0; i < n && i < QOS_PREFETCH_OFFSET; ++i)
+        rte_prefetch0(table->flows[flow_ids[i]].red);
+
+    for (i = 0; i < n; ++i) {
+        if (i + QOS_PREFETCH_OFFSET < n)
+            rte_prefetch0(table->flows[flow_ids[i + QOS_PREFETCH_OFFSET]].red);
+
+        drops[i] = qos_dropper_decide(table, config, flow_ids[i], colors[i], time);
+        dropped += drops[i];
     }
 
-    last_time = time;
+    return dropped;
+}
 
-    // Make decision.
-    int result = !!rte_red_enqueue(&red_params[color], &red_data[flow_id][color], queue_size[flow_id][color], time);
+void
+qos_dropper_set_drained(int drained)
+{
+    RTE_PER_LCORE(flow_table)->drained = drained;
+}
 
-    // Enqueue if not dropped.
-    if (!result)
-        ++queue_size[flow_id][color];
+void
+qos_dropper_dequeue(uint32_t flow_id, enum qos_color color, uint64_t time)
+{
+    struct qos_flow *flow = qos_flow_get(RTE_PER_LCORE(flow_table), flow_id);
+    int i;
 
-    return result;
+    assert(flow->queue_size[color] > 0);
+
+    --flow->queue_size[color];
+
+    // The FIFO is empty only when no color is left in it.
+    if (qos_flow_occupancy(flow) == 0)
+        for (i = 0; i < e_RTE_METER_COLORS; ++i)
+            rte_red_mark_queue_empty(&flow->red[i], time);
+}
+
+double
+qos_flow_red_avg(const struct qos_flow *flow, enum qos_color color, uint16_t wq_log2)
+{
+    // The average is scaled by 2^(RTE_RED_SCALING + wq_log2), as the thresholds.
+    return (double)flow->red[color].avg / (double)(1ULL << (RTE_RED_SCALING + wq_log2));
+}
+
+
+/**
+ * Runtime parameters
+ */
+
+void
+qos_params_get(struct qos_params *params)
+{
+    *params = qos_config_get()->params;
+}
+
+// Wait until every registered lcore but the calling one has been quiescent since now.
+static void
+qos_synchronize(void)
+{
+    uint64_t token = ++qos_token;
+    unsigned lcore_id;
+
+    rte_smp_mb(); // The switch is visible before any lcore can report the new token.
+
+    for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+        if (lcore_id == rte_lcore_id())
+            continue;
+
+        uint64_t seen;
+        while ((seen = qos_readers[lcore_id].token) != 0 && seen < token)
+            rte_pause();
+    }
+}
+
+int
+qos_params_update(const struct qos_params *params)
+{
+    struct qos_config *current = qos_config_get();
+    struct qos_config *next[RTE_MAX_NUMA_NODES];
+    unsigned socket_id;
+    int i;
+
+    // Average queue sizes are scaled by 2^wq_log2: a new weight would misread them.
+    for (i = 0; i < e_RTE_METER_COLORS; ++i)
+        if (params->red[i].wq_log2 != current->params.red[i].wq_log2)
+            return -1;
+
+    // No lcore uses the next copies since the previous update returned: fill them in place. Replicas are alike,
+    // so invalid parameters fail on the first one, before any is published.
+    for (socket_id = 0; socket_id < RTE_MAX_NUMA_NODES; socket_id++) {
+        struct qos_replica *replica = qos_replicas[socket_id];
+        if (replica == NULL)
+            continue;
+
+        next[socket_id] = replica->active == &replica->configs[0] ? &replica->configs[1] : &replica->configs[0];
+        if (qos_config_srtcm(next[socket_id], params) != 0 || qos_config_red(next[socket_id], params) != 0)
+            return -1;
+        next[socket_id]->params = *params;
+        next[socket_id]->version = current->version + 1;
+    }
+
+    rte_smp_wmb(); // Filled before published.
+    for (socket_id = 0; socket_id < RTE_MAX_NUMA_NODES; socket_id++)
+        if (qos_replicas[socket_id] != NULL)
+            qos_replicas[socket_id]->active = next[socket_id];
+
+    qos_synchronize();
+
+    return 0;
+}
+
+void
+qos_reader_register(unsigned lcore_id)
+{
+    qos_readers[lcore_id].token = qos_token;
+    rte_smp_mb();
+}
+
+void
+qos_reader_unregister(unsigned lcore_id)
+{
+    rte_smp_mb(); // Done with the parameters.
+    qos_readers[lcore_id].token = 0;
+}
+
+void
+qos_quiescent(unsigned lcore_id)
+{
+    uint64_t token = qos_token;
+
+    // Only a switch makes the report needed, and worth a barrier.
+    if (qos_readers[lcore_id].token != token) {
+        rte_smp_mb(); // Done with the parameters read before.
+        qos_readers[lcore_id].token = token;
+    }
 }
@@ -1,7 +1,21 @@
 #ifndef __QOS_H__
 #define __QOS_H__
 
-#define APP_FLOWS_MAX       4
+#include <stdint.h>
+
+#define APP_PROFILES        4
+#define APP_BURST_MAX       64
+
+struct rte_mbuf;
+struct qos_flow;
+
+/**
+ * Flows are identified by their flow id in the flow table of the calling lcore (see flow_table.h), and metered
+ * with one of APP_PROFILES parameter sets
+ */
+
+/* Init the state of a new flow with meter profile `profile` */
+void qos_flow_init(struct qos_flow *flow, uint32_t profile);
 
 /**
  * Single-Rate Three Color Meter, blind mode
@@ -19,6 +33,13 @@ int qos_meter_init(void);
 /* Meter pkt, return color*/
 enum qos_color qos_meter_run(uint32_t flow_id, uint32_t pkt_len, uint64_t time);
 
+/* Meter a burst of n pkts of flows flow_ids[i] and lengths pkt_lens[i], all at the same time, writing colors[i] */
+void qos_meter_run_burst(const uint32_t *flow_ids, const uint32_t *pkt_lens, uint32_t n, uint64_t time,
+    enum qos_color *colors);
+
+/* The same for mbufs, whose flow id is in hash.usr */
+void qos_meter_run_mbufs(struct rte_mbuf **pkts, uint32_t n, uint64_t time, enum qos_color *colors);
+
 
 
 /**
@@ -32,5 +53,64 @@ int qos_dropper_init(void);
 /* Make drop decision, 1-drop, 0-pass */
 int qos_dropper_run(uint32_t flow_id, enum qos_color color, uint64_t time);
 
+/* Make drop decisions for a burst of n pkts, all at the same time, writing drops[i] (1-drop, 0-pass).
+   Return the number of dropped pkts */
+uint32_t qos_dropper_run_burst(const uint32_t *flow_ids, const enum qos_color *colors, uint32_t n, uint64_t time,
+    uint8_t *drops);
+
+/* Keep the queues of the flows of the calling lcore until qos_dropper_dequeue() drains them (1), instead of
+   clearing them at every time change (0, the default). Drained, a flow has one queue for all colors: RED of each
+   color sees its whole occupancy against that color's thresholds */
+void qos_dropper_set_drained(int drained);
+
+/* A pkt of color `color` that the dropper passed left the queue of a flow at `time`. RED sees the queue empty once
+   the last pkt of any color has left */
+void qos_dropper_dequeue(uint32_t flow_id, enum qos_color color, uint64_t time);
+
+/* RED average queue size (packets) of a flow for a color of weight wq_log2, e.g. from qos_params_get() (it never
+   changes at runtime). Reads the flow only, so any thread may call it */
+double qos_flow_red_avg(const struct qos_flow *flow, enum qos_color color, uint16_t wq_log2);
+
+
+/**
+ * Parameters, changed at runtime without stopping traffic
+ *
+ * qos_params_update() fills a second copy of the parameters, switches datapath lcores to it, and waits until no
+ * lcore uses the old copy (quiescent-state based reclamation): lcores running the meter or dropper register, and
+ * report a quiescent state between bursts. Flows adopt the new meter parameters on their next packet, with
+ * their tokens kept up to the new bucket sizes
+ */
+
+#define QOS_COLORS          3
+
+/* Meter parameters of every profile and dropper parameters of every color */
+struct qos_params {
+    struct {
+        uint64_t cir; // Committed information rate (bytes per second).
+        uint64_t cbs; // Committed burst size (bytes).
+        uint64_t ebs; // Excess burst size (bytes).
+    } srtcm[APP_PROFILES];
+    struct {
+        uint16_t wq_log2; // Weight of the queue size in its average is 2^-wq_log2.
+        uint16_t min_th; // Thresholds of the average queue size (packets).
+        uint16_t max_th;
+        uint16_t maxp_inv; // 1 / drop probability at max_th.
+    } red[QOS_COLORS];
+};
+
+/* Copy the current parameters */
+void qos_params_get(struct qos_params *params);
+
+/* Switch to new parameters, return once no lcore uses the old ones. Call from one lcore at a time, which must
+   not be a registered one. Return -1 if they are invalid or change a RED wq_log2 (the current ones are kept) */
+int qos_params_update(const struct qos_params *params);
+
+/* Start/stop using the meter and dropper on an lcore */
+void qos_reader_register(unsigned lcore_id);
+void qos_reader_unregister(unsigned lcore_id);
+
+/* Report that an lcore holds no reference to the parameters, e.g. between bursts */
+void qos_quiescent(unsigned lcore_id);
+
 
 #endif
\ No newline at end of file
@@ -0,0 +1,670 @@
+#include "qos.h"
+#include "qos_soft.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+
+#define QOS_SOFT_COLORS     3
+#define QOS_SOFT_RED_S      1000 // Idle time (ns) per step of the decay of the RED average of an empty queue.
+
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+/* All QoS state of a flow. The meter part comes first and is read by the AVX2 kernel with gathers */
+struct qos_flow {
+    uint64_t time; // Last meter update (ns).
+    uint32_t tc; // Committed bucket (bytes).
+    uint32_t te; // Excess bucket (bytes).
+    uint32_t frac; // Fraction of a byte not yet in the buckets (QOS_SOFT_RATE_SHIFT bits).
+    uint32_t profile; // Meter parameters (see qos_meter_init).
+    uint64_t q_time; // Time the queues were last all empty (ns).
+    uint32_t red_avg[QOS_SOFT_COLORS]; // RED average queue size per color (QOS_SOFT_RED_SHIFT bits).
+    uint32_t red_count[QOS_SOFT_COLORS]; // Packets enqueued since the last drop, per color.
+    uint32_t queue_size[QOS_SOFT_COLORS]; // Queue per color, valid in `epoch` only.
+    uint32_t epoch; // Epoch the queues were last cleared in.
+};
+
+_Static_assert(sizeof(struct qos_flow) % 8 == 0, "flows are gathered in 64-bit words");
+
+/* Meter parameters of a profile, in the units of the token buckets */
+struct qos_soft_profile {
+    uint32_t rate; // Bytes per ns (QOS_SOFT_RATE_SHIFT bits).
+    uint32_t cbs;
+    uint32_t ebs;
+    uint64_t fill_ns; // Time to fill both buckets from empty.
+};
+
+/* RED parameters of a color, thresholds scaled as the average */
+struct qos_soft_red {
+    uint32_t wq_log2;
+    uint32_t min_th;
+    uint32_t max_th;
+    uint32_t maxp_inv;
+};
+
+struct qos_soft_table {
+    struct qos_flow *flows;
+    uint32_t nb_flows;
+    uint32_t epoch; // Current epoch, incremented at every time change.
+    uint64_t last_time; // Used to detect time change.
+    int drained; // Queues are drained by qos_dropper_dequeue(), not cleared at time changes.
+    uint32_t rand; // State of the random generator of RED.
+};
+
+struct qos_params qos_soft_params; // As given.
+struct qos_soft_profile qos_soft_profiles[APP_PROFILES];
+struct qos_soft_red qos_soft_red_params[QOS_SOFT_COLORS];
+
+static __thread struct qos_soft_table qos_soft_table;
+
+#define SRTCM_CONFIG(profile, cir_, cbs_, ebs_) do { \
+    params.srtcm[(profile)].cir = (cir_); \
+    params.srtcm[(profile)].cbs = (cbs_); \
+    params.srtcm[(profile)].ebs = (ebs_); \
+} while (0)
+
+#define RED_CONFIG(color, wq_log2_, min_th_, max_th_, maxp_inv_) do { \
+    params.red[(color)].wq_log2 = (wq_log2_); \
+    params.red[(color)].min_th = (min_th_); \
+    params.red[(color)].max_th = (max_th_); \
+    params.red[(color)].maxp_inv = (maxp_inv_); \
+} while (0)
+
+
+/**
+ * Flow state
+ */
+void
+qos_flow_init(struct qos_flow *flow, uint32_t profile)
+{
+    assert(profile < APP_PROFILES);
+
+    memset(flow, 0, sizeof(*flow));
+    flow->profile = profile;
+    flow->tc = qos_soft_profiles[profile].cbs;
+    flow->te = qos_soft_profiles[profile].ebs;
+}
+
+int
+qos_soft_flows_create(uint32_t nb_flows)
+{
+    struct qos_soft_table *table = &qos_soft_table;
+    int drained = table->drained;
+
+    qos_soft_flows_free();
+    table->drained = drained;
+
+    table->flows = calloc(nb_flows, sizeof(struct qos_flow));
+    if (table->flows == NULL)
+        return -1;
+
+    uint32_t i;
+    for (i = 0; i < nb_flows; ++i)
+        qos_flow_init(&table->flows[i], i % APP_PROFILES);
+
+    table->nb_flows = nb_flows;
+    table->epoch = 1;
+    table->last_time = 0;
+    table->rand = 0x2545f491;
+
+    return 0;
+}
+
+void
+qos_soft_flows_free(void)
+{
+    free(qos_soft_table.flows);
+    memset(&qos_soft_table, 0, sizeof(qos_soft_table));
+}
+
+uint32_t
+qos_soft_flow_profile(uint32_t flow_id)
+{
+    assert(flow_id < qos_soft_table.nb_flows);
+
+    return qos_soft_table.flows[flow_id].profile;
+}
+
+int
+qos_soft_simd(void)
+{
+#ifdef __AVX2__
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+// Flow `flow_id` of the calling thread.
+static inline struct qos_flow *
+qos_soft_flow_get(uint32_t flow_id)
+{
+    assert(flow_id < qos_soft_table.nb_flows);
+
+    return &qos_soft_table.flows[flow_id];
+}
+
+
+/**
+ * srTCM
+ */
+
+// Meter parameters of every profile in the units of the buckets. Return -1 if out of range.
+static int
+qos_soft_profiles_config(struct qos_soft_profile *profiles, const struct qos_params *params)
+{
+    int i;
+    for (i = 0; i < APP_PROFILES; ++i) {
+        uint64_t cir = params->srtcm[i].cir, cbs = params->srtcm[i].cbs, ebs = params->srtcm[i].ebs;
+        struct qos_soft_profile *profile = &profiles[i];
+
+        // Rounded, and high enough for that to be within 1%. Buckets are 32-bit, and a full committed bucket
+        // plus the tokens of up to fill_ns (cbs + ebs) must not wrap.
+        uint64_t rate = ((cir << QOS_SOFT_RATE_SHIFT) + 500000000) / 1000000000;
+        if (rate < QOS_SOFT_RATE_MIN || rate > UINT32_MAX || cbs > INT32_MAX || ebs > INT32_MAX - cbs ||
+                cbs + ebs == 0)
+            return -1;
+
+        profile->rate = (uint32_t)rate;
+        profile->cbs = (uint32_t)cbs;
+        profile->ebs = (uint32_t)ebs;
+        profile->fill_ns = (((cbs + ebs) << QOS_SOFT_RATE_SHIFT) + rate - 1) / rate;
+    }
+
+    return 0;
+}
+
+int
+qos_meter_init(void)
+{
+    struct qos_params params = qos_soft_params;
+
+    /* The parameters of qos.c: allowances of 160000, 80000, 40000 and 20000 bytes per time period (1000000 ns),
+     * half green, half yellow, refilled after a period.
+     */
+    SRTCM_CONFIG(0, 160000000000, 80000, 80000);
+    SRTCM_CONFIG(1, 80000000000, 40000, 40000);
+    SRTCM_CONFIG(2, 40000000000, 20000, 20000);
+    SRTCM_CONFIG(3, 20000000000, 10000, 10000);
+
+    if (qos_soft_profiles_config(qos_soft_profiles, &params) != 0)
+        return -1;
+    qos_soft_params = params;
+
+    return 0;
+}
+
+// Refill the buckets of a flow up to `time`, then color a packet. Tokens are added in fixed point, the fraction
+// of a byte left is kept for the next time, also once the buckets are full: it is exact modulo 2^64.
+static inline enum qos_color
+qos_soft_meter(struct qos_flow *flow, uint32_t pkt_len, uint64_t time)
+{
+    const struct qos_soft_profile *profile = &qos_soft_profiles[flow->profile];
+    uint64_t dt = time - flow->time;
+    uint64_t acc = dt * profile->rate + flow->frac;
+    uint32_t tc, te;
+
+    flow->time = time;
+    flow->frac = (uint32_t)acc & ((1u << QOS_SOFT_RATE_SHIFT) - 1);
+
+    if (dt >= profile->fill_ns) {
+        tc = profile->cbs;
+        te = profile->ebs;
+    } else {
+        uint32_t over;
+
+        tc = flow->tc + (uint32_t)(acc >> QOS_SOFT_RATE_SHIFT);
+        over = tc > profile->cbs ? tc - profile->cbs : 0;
+        tc -= over;
+        te = flow->te + over;
+        te = te < profile->ebs ? te : profile->ebs;
+    }
+
+    enum qos_color color;
+    if (tc >= pkt_len) {
+        tc -= pkt_len;
+        color = GREEN;
+    } else if (te >= pkt_len) {
+        te -= pkt_len;
+        color = YELLOW;
+    } else {
+        color = RED;
+    }
+
+    flow->tc = tc;
+    flow->te = te;
+
+    return color;
+}
+
+enum qos_color
+qos_meter_run(uint32_t flow_id, uint32_t pkt_len, uint64_t time)
+{
+    return qos_soft_meter(qos_soft_flow_get(flow_id), pkt_len, time);
+}
+
+#ifdef __AVX2__
+
+#define QOS_SOFT_LANES      8
+#define QOS_SOFT_PREFETCH   16 // How many packets ahead the state of their flow is prefetched.
+
+// Whether two of 8 flow ids are the same. Comparing with the ids rotated by 1 to 4 lanes covers all pairs.
+static inline int
+qos_soft_conflicts(__m256i ids)
+{
+    __m256i c = _mm256_cmpeq_epi32(ids,
+        _mm256_permutevar8x32_epi32(ids, _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0)));
+    c = _mm256_or_si256(c, _mm256_cmpeq_epi32(ids,
+        _mm256_permutevar8x32_epi32(ids, _mm256_setr_epi32(2, 3, 4, 5, 6, 7, 0, 1))));
+    c = _mm256_or_si256(c, _mm256_cmpeq_epi32(ids,
+        _mm256_permutevar8x32_epi32(ids, _mm256_setr_epi32(3, 4, 5, 6, 7, 0, 1, 2))));
+    c = _mm256_or_si256(c, _mm256_cmpeq_epi32(ids,
+        _mm256_permutevar8x32_epi32(ids, _mm256_setr_epi32(4, 5, 6, 7, 0, 1, 2, 3))));
+
+    return !_mm256_testz_si256(c, c);
+}
+
+// Low 32 bits of two vectors of 4 64-bit lanes, as one vector of 8 32-bit lanes.
+static inline __m256i
+qos_soft_pack_lo32(__m256i lo, __m256i hi)
+{
+    const __m256i even = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+
+    return _mm256_permute2x128_si256(_mm256_permutevar8x32_epi32(lo, even), _mm256_permutevar8x32_epi32(hi, even),
+        0x20);
+}
+
+// Unsigned a < b on 64-bit lanes.
+static inline __m256i
+qos_soft_lt_epu64(__m256i a, __m256i b)
+{
+    const __m256i sign = _mm256_set1_epi64x((long long)0x8000000000000000ULL);
+
+    return _mm256_cmpgt_epi64(_mm256_xor_si256(b, sign), _mm256_xor_si256(a, sign));
+}
+
+// dt * rate + frac on 4 64-bit lanes, from 4 32-bit lanes of rate and frac. Exact for any dt below fill_ns, and
+// modulo 2^64 above.
+static inline __m256i
+qos_soft_acc_x4(__m256i dt, __m128i rate, __m128i frac)
+{
+    __m256i rate64 = _mm256_cvtepu32_epi64(rate);
+    __m256i product = _mm256_add_epi64(_mm256_mul_epu32(dt, rate64),
+        _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(dt, 32), rate64), 32));
+
+    return _mm256_add_epi64(product, _mm256_cvtepu32_epi64(frac));
+}
+
+// qos_soft_meter() on 8 packets of different flows at once: gather their state, refill and color in 32-bit lanes
+// (64-bit for time and the token product), then write the state back.
+static inline void
+qos_soft_meter_x8(struct qos_flow *flows, __m256i ids, const uint32_t *pkt_lens, uint64_t time,
+    enum qos_color *colors)
+{
+    const __m256i frac_mask = _mm256_set1_epi32((1 << QOS_SOFT_RATE_SHIFT) - 1);
+    uint32_t out_tc[QOS_SOFT_LANES], out_te[QOS_SOFT_LANES], out_frac[QOS_SOFT_LANES], out_ids[QOS_SOFT_LANES];
+    int32_t out_colors[QOS_SOFT_LANES];
+    int i;
+
+    // Flow state, indexed in 32-bit words (64-bit for time).
+    __m256i idx = _mm256_mullo_epi32(ids, _mm256_set1_epi32(sizeof(struct qos_flow) / 4));
+    __m256i idx64 = _mm256_mullo_epi32(ids, _mm256_set1_epi32(sizeof(struct qos_flow) / 8));
+    __m256i profile = _mm256_i32gather_epi32((const int *)&flows->profile, idx, 4);
+    __m256i tc = _mm256_i32gather_epi32((const int *)&flows->tc, idx, 4);
+    __m256i te = _mm256_i32gather_epi32((const int *)&flows->te, idx, 4);
+    __m256i frac = _mm256_i32gather_epi32((const int *)&flows->frac, idx, 4);
+    __m256i last_lo = _mm256_i32gather_epi64((const long long *)&flows->time, _mm256_castsi256_si128(idx64), 8);
+    __m256i last_hi = _mm256_i32gather_epi64((const long long *)&flows->time, _mm256_extracti128_si256(idx64, 1),
+        8);
+
+    // Profile parameters.
+    __m256i pidx = _mm256_mullo_epi32(profile, _mm256_set1_epi32(sizeof(struct qos_soft_profile) / 4));
+    __m256i pidx64 = _mm256_mullo_epi32(profile, _mm256_set1_epi32(sizeof(struct qos_soft_profile) / 8));
+    __m256i rate = _mm256_i32gather_epi32((const int *)&qos_soft_profiles->rate, pidx, 4);
+    __m256i cbs = _mm256_i32gather_epi32((const int *)&qos_soft_profiles->cbs, pidx, 4);
+    __m256i ebs = _mm256_i32gather_epi32((const int *)&qos_soft_profiles->ebs, pidx, 4);
+    __m256i fill_lo = _mm256_i32gather_epi64((const long long *)&qos_soft_profiles->fill_ns,
+        _mm256_castsi256_si128(pidx64), 8);
+    __m256i fill_hi = _mm256_i32gather_epi64((const long long *)&qos_soft_profiles->fill_ns,
+        _mm256_extracti128_si256(pidx64, 1), 8);
+
+    // Elapsed time, and whether the buckets fill up meanwhile.
+    __m256i now = _mm256_set1_epi64x((long long)time);
+    __m256i dt_lo = _mm256_sub_epi64(now, last_lo);
+    __m256i dt_hi = _mm256_sub_epi64(now, last_hi);
+    __m256i partial_lo = qos_soft_lt_epu64(dt_lo, fill_lo);
+    __m256i partial_hi = qos_soft_lt_epu64(dt_hi, fill_hi);
+    __m256i partial = qos_soft_pack_lo32(partial_lo, partial_hi);
+
+    // New tokens: dt * rate + frac in 64 bits, with the whole dt (it may take more than 32 bits to fill_ns).
+    __m256i acc_lo = qos_soft_acc_x4(dt_lo, _mm256_castsi256_si128(rate), _mm256_castsi256_si128(frac));
+    __m256i acc_hi = qos_soft_acc_x4(dt_hi, _mm256_extracti128_si256(rate, 1), _mm256_extracti128_si256(frac, 1));
+    __m256i tokens = qos_soft_pack_lo32(_mm256_srli_epi64(acc_lo, QOS_SOFT_RATE_SHIFT),
+        _mm256_srli_epi64(acc_hi, QOS_SOFT_RATE_SHIFT));
+    frac = _mm256_and_si256(qos_soft_pack_lo32(acc_lo, acc_hi), frac_mask);
+
+    // Committed bucket first, the overflow goes to the excess one. Full buckets if dt was long enough.
+    __m256i tc1 = _mm256_add_epi32(tc, tokens);
+    __m256i over = _mm256_sub_epi32(_mm256_max_epu32(tc1, cbs), cbs);
+    tc1 = _mm256_blendv_epi8(cbs, _mm256_min_epu32(tc1, cbs), partial);
+    __m256i te1 = _mm256_blendv_epi8(ebs, _mm256_min_epu32(_mm256_add_epi32(te, over), ebs), partial);
+
+    // Color: green if the committed bucket holds the packet, else yellow if the excess one does, else red.
+    __m256i len = _mm256_loadu_si256((const __m256i *)pkt_lens);
+    __m256i green = _mm256_cmpeq_epi32(_mm256_max_epu32(tc1, len), tc1);
+    __m256i yellow = _mm256_andnot_si256(green, _mm256_cmpeq_epi32(_mm256_max_epu32(te1, len), te1));
+    tc1 = _mm256_sub_epi32(tc1, _mm256_and_si256(len, green));
+    te1 = _mm256_sub_epi32(te1, _mm256_and_si256(len, yellow));
+    __m256i color = _mm256_add_epi32(_mm256_set1_epi32(RED),
+        _mm256_add_epi32(green, _mm256_or_si256(green, yellow))); // Masks are -1.
+
+    _mm256_storeu_si256((__m256i *)out_tc, tc1);
+    _mm256_storeu_si256((__m256i *)out_te, te1);
+    _mm256_storeu_si256((__m256i *)out_frac, frac);
+    _mm256_storeu_si256((__m256i *)out_ids, ids);
+    _mm256_storeu_si256((__m256i *)out_colors, color);
+
+    for (i = 0; i < QOS_SOFT_LANES; ++i) {
+        struct qos_flow *flow = &flows[out_ids[i]];
+        flow->time = time;
+        flow->tc = out_tc[i];
+        flow->te = out_te[i];
+        flow->frac = out_frac[i];
+        colors[i] = (enum qos_color)out_colors[i];
+    }
+}
+
+#endif
+
+void
+qos_meter_run_burst(const uint32_t *flow_ids, const uint32_t *pkt_lens, uint32_t n, uint64_t time,
+    enum qos_color *colors)
+{
+    uint32_t i = 0;
+
+#ifdef __AVX2__
+    struct qos_flow *flows = qos_soft_table.flows;
+
+    uint32_t j;
+    for (j = 0; j < n && j < QOS_SOFT_PREFETCH; ++j)
+        __builtin_prefetch(&flows[flow_ids[j]]);
+
+    // 8 packets at a time. Packets of the same flow must be metered in order: such groups go the scalar way.
+    // Gathers wait for every lane, so the flows of the next groups are prefetched.
+    for (; i + QOS_SOFT_LANES <= n; i += QOS_SOFT_LANES) {
+        for (j = i + QOS_SOFT_PREFETCH; j < n && j < i + QOS_SOFT_PREFETCH + QOS_SOFT_LANES; ++j)
+            __builtin_prefetch(&flows[flow_ids[j]]);
+
+        __m256i ids = _mm256_loadu_si256((const __m256i *)(flow_ids + i));
+        if (likely(!qos_soft_conflicts(ids))) {
+            qos_soft_meter_x8(flows, ids, pkt_lens + i, time, colors + i);
+            continue;
+        }
+
+        for (j = i; j < i + QOS_SOFT_LANES; ++j)
+            colors[j] = qos_soft_meter(qos_soft_flow_get(flow_ids[j]), pkt_lens[j], time);
+    }
+#endif
+
+    for (; i < n; ++i)
+        colors[i] = qos_soft_meter(qos_soft_flow_get(flow_ids[i]), pkt_lens[i], time);
+}
+
+
+/**
+ * WRED
+ */
+
+// Dropper parameters of every color, thresholds scaled as the average. Return -1 if out of range.
+static int
+qos_soft_red_config(struct qos_soft_red *reds, const struct qos_params *params)
+{
+    int i;
+    for (i = 0; i < QOS_SOFT_COLORS; ++i) {
+        if (params->red[i].wq_log2 == 0 || params->red[i].wq_log2 > 12 ||
+                params->red[i].min_th >= params->red[i].max_th || params->red[i].maxp_inv == 0)
+            return -1;
+
+        reds[i].wq_log2 = params->red[i].wq_log2;
+        reds[i].min_th = (uint32_t)params->red[i].min_th << QOS_SOFT_RED_SHIFT;
+        reds[i].max_th = (uint32_t)params->red[i].max_th << QOS_SOFT_RED_SHIFT;
+        reds[i].maxp_inv = params->red[i].maxp_inv;
+    }
+
+    return 0;
+}
+
+int
+qos_dropper_init(void)
+{
+    struct qos_params params = qos_soft_params;
+
+    /* The parameters of qos.c: enqueue as many green/yellow packets as possible, drop all red packets.
+     */
+    RED_CONFIG(GREEN, 9, 1022, 1023, 10);
+    RED_CONFIG(YELLOW, 9, 1022, 1023, 10);
+    RED_CONFIG(RED, 9, 0, 1, 10);
+
+    if (qos_soft_red_config(qos_soft_red_params, &params) != 0)
+        return -1;
+    qos_soft_params = params;
+
+    return 0;
+}
+
+static void
+qos_dropper_check_time(struct qos_soft_table *table, uint64_t time)
+{
+    if (time != table->last_time) // Time change detected. Clear all queues (lazily).
+        ++table->epoch;
+
+    table->last_time = time;
+}
+
+// xorshift32: 16 random bits.
+static inline uint32_t
+qos_soft_rand16(struct qos_soft_table *table)
+{
+    uint32_t x = table->rand;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    table->rand = x;
+
+    return x >> 16;
+}
+
+// avg * (1 - 2^-wq_log2)^m, with the factor in 16-bit fixed point by squaring.
+static inline uint32_t
+qos_soft_red_decay(uint32_t avg, uint32_t wq_log2, uint64_t m)
+{
+    uint64_t base = 65536 - (65536 >> wq_log2);
+    uint64_t factor = 65536;
+
+    if (m >= (32ULL << wq_log2)) // Below 2^-32.
+        return 0;
+
+    for (; m > 0 && factor > 0; m >>= 1) {
+        if (m & 1)
+            factor = (factor * base) >> 16;
+        base = (base * base) >> 16;
+    }
+
+    return (uint32_t)((avg * factor) >> 16);
+}
+
+// RED on queue `q` of a flow: update the average, then drop with a probability growing with it between the
+// thresholds, and with the packets enqueued since the last drop.
+static inline int
+qos_soft_red_enqueue(struct qos_soft_table *table, struct qos_flow *flow, enum qos_color color, uint32_t q,
+    uint64_t time)
+{
+    const struct qos_soft_red *red = &qos_soft_red_params[color];
+    uint32_t avg = flow->red_avg[color];
+
+    if (q > 0)
+        avg = (uint32_t)((int64_t)avg + (((int64_t)q << QOS_SOFT_RED_SHIFT) - avg) / (1 << red->wq_log2));
+    else
+        avg = qos_soft_red_decay(avg, red->wq_log2, (time - flow->q_time) / QOS_SOFT_RED_S);
+    flow->red_avg[color] = avg;
+
+    if (avg < red->min_th) {
+        flow->red_count[color] = 0;
+        return 0;
+    }
+    if (avg >= red->max_th) {
+        flow->red_count[color] = 0;
+        return 1;
+    }
+
+    // pb = maxp * (avg - min_th) / (max_th - min_th), pa = pb / (1 - count * pb), 16-bit fixed point.
+    uint64_t pb = ((uint64_t)(avg - red->min_th) << 16) / ((uint64_t)(red->max_th - red->min_th) * red->maxp_inv);
+    uint64_t count_pb = flow->red_count[color] * pb;
+    if (count_pb >= 65536 || (uint64_t)qos_soft_rand16(table) * (65536 - count_pb) < (pb << 16)) {
+        flow->red_count[color] = 0;
+        return 1;
+    }
+
+    ++flow->red_count[color];
+    return 0;
+}
+
+// Packets of all colors in the queue of a flow.
+static inline uint32_t
+qos_soft_flow_occupancy(const struct qos_flow *flow)
+{
+    return flow->queue_size[GREEN] + flow->queue_size[YELLOW] + flow->queue_size[RED];
+}
+
+static inline int
+qos_dropper_decide(struct qos_soft_table *table, uint32_t flow_id, enum qos_color color, uint64_t time)
+{
+    struct qos_flow *flow = qos_soft_flow_get(flow_id);
+
+    // First use in this epoch: clear the queues.
+    if (unlikely(flow->epoch != table->epoch) && !table->drained) {
+        memset(flow->queue_size, 0, sizeof(flow->queue_size));
+        flow->q_time = time;
+        flow->epoch = table->epoch;
+    }
+
+    // Make decision. A drained flow has one queue for all colors, as in qos.c.
+    uint32_t queue = table->drained ? qos_soft_flow_occupancy(flow) : flow->queue_size[color];
+    int result = qos_soft_red_enqueue(table, flow, color, queue, time);
+
+    // Enqueue if not dropped.
+    if (!result)
+        ++flow->queue_size[color];
+
+    return result;
+}
+
+int
+qos_dropper_run(uint32_t flow_id, enum qos_color color, uint64_t time)
+{
+    struct qos_soft_table *table = &qos_soft_table;
+
+    qos_dropper_check_time(table, time);
+
+    return qos_dropper_decide(table, flow_id, color, time);
+}
+
+uint32_t
+qos_dropper_run_burst(const uint32_t *flow_ids, const enum qos_color *colors, uint32_t n, uint64_t time,
+    uint8_t *drops)
+{
+    struct qos_soft_table *table = &qos_soft_table;
+    uint32_t i, dropped = 0;
+
+    // The whole burst shares one time stamp, so the period check is done once.
+    qos_dropper_check_time(table, time);
+
+    for (i = 0; i < n; ++i) {
+        drops[i] = (uint8_t)qos_dropper_decide(table, flow_ids[i], colors[i], time);
+        dropped += drops[i];
+    }
+
+    return dropped;
+}
+
+void
+qos_dropper_set_drained(int drained)
+{
+    qos_soft_table.drained = drained;
+}
+
+void
+qos_dropper_dequeue(uint32_t flow_id, enum qos_color color, uint64_t time)
+{
+    struct qos_flow *flow = qos_soft_flow_get(flow_id);
+
+    assert(flow->queue_size[color] > 0);
+
+    --flow->queue_size[color];
+
+    // The queue is empty only when no color is left in it.
+    if (qos_soft_flow_occupancy(flow) == 0)
+        flow->q_time = time;
+}
+
+double
+qos_flow_red_avg(const struct qos_flow *flow, enum qos_color color, uint16_t wq_log2)
+{
+    (void)wq_log2; // The average has a fixed scale.
+
+    return (double)flow->red_avg[color] / (1 << QOS_SOFT_RED_SHIFT);
+}
+
+
+/**
+ * Parameters
+ */
+
+void
+qos_params_get(struct qos_params *params)
+{
+    *params = qos_soft_params;
+}
+
+int
+qos_params_update(const struct qos_params *params)
+{
+    struct qos_soft_profile profiles[APP_PROFILES];
+    struct qos_soft_red reds[QOS_SOFT_COLORS];
+
+    if (qos_soft_profiles_config(profiles, params) != 0 || qos_soft_red_config(reds, params) != 0)
+        return -1;
+
+    // Buckets over their new size are trimmed by their next refill.
+    memcpy(qos_soft_profiles, profiles, sizeof(profiles));
+    memcpy(qos_soft_red_params, reds, sizeof(reds));
+    qos_soft_params = *params;
+
+    return 0;
+}
+
+void
+qos_reader_register(unsigned lcore_id)
+{
+    (void)lcore_id;
+}
+
+void
+qos_reader_unregister(unsigned lcore_id)
+{
+    (void)lcore_id;
+}
+
+void
+qos_quiescent(unsigned lcore_id)
+{
+    (void)lcore_id;
+}
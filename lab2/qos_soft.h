@@ -0,0 +1,37 @@
+#ifndef __QOS_SOFT_H__
+#define __QOS_SOFT_H__
+
+#include <stdint.h>
+
+#include "qos.h"
+
+/**
+ * Software implementation of qos.h, without DPDK: fixed-point srTCM and RED, and an AVX2 kernel metering 8
+ * packets at once in qos_meter_run_burst() (built with -mavx2). Build it with Makefile.soft
+ *
+ * Flows are those of the calling thread (qos_soft_flows_create), instead of a flow table. Time is in ns, as in
+ * main.c. qos_meter_run_mbufs() is not provided, as there are no mbufs
+ *
+ * qos_params_update() applies the parameters at once: call it between bursts of every thread. Reader
+ * registration and quiescent states are not needed, and do nothing
+ */
+
+/* Fixed-point formats */
+#define QOS_SOFT_RATE_SHIFT 16 // Token rate in bytes per ns, and fractions of bytes not yet in the buckets.
+#define QOS_SOFT_RED_SHIFT  10 // RED average queue size.
+#define QOS_SOFT_RATE_MIN   50 // Lowest token rate, rounded to within 1% (a CIR of 763 KB/s).
+
+/* Create flows 0 to nb_flows - 1 for the calling thread, flow i with profile i % APP_PROFILES, after
+   qos_meter_init. Return 0, or -1 if out of memory */
+int qos_soft_flows_create(uint32_t nb_flows);
+
+/* Free the flows of the calling thread */
+void qos_soft_flows_free(void);
+
+/* Profile of a flow of the calling thread */
+uint32_t qos_soft_flow_profile(uint32_t flow_id);
+
+/* Whether qos_meter_run_burst() uses the AVX2 kernel */
+int qos_soft_simd(void);
+
+#endif
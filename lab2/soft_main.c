@@ -0,0 +1,414 @@
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "qos.h"
+#include "qos_soft.h"
+
+/**
+ * main.c without DPDK: the same traffic through the software implementation, a check that bursts (AVX2 kernel)
+ * color packets as the per-packet path does, also after idle times over 2^32 ns, and ns/packet of both. The
+ * fixed-point meter and RED are checked against reference models in exact or floating-point arithmetic: srTCM as
+ * in RFC 2697, and RED as in Floyd and Jacobson's paper with the idle time decay of rte_red
+ */
+
+#define BENCH_PKTS (1 << 16) // Packets per benchmark run.
+#define BENCH_PERIOD_PKTS 1000 // Packets per time period in benchmark runs.
+#define REF_PKTS 100000 // Packets per reference check.
+#define REF_QUEUE_MAX 64 // Queue of the RED reference check (packets), above every max_th there.
+
+uint32_t app_flows = APP_PROFILES; // Number of flows (-f), flow i uses profile i % APP_PROFILES.
+
+uint32_t bench_flow_ids[BENCH_PKTS];
+uint32_t bench_pkt_lens[BENCH_PKTS];
+enum qos_color bench_colors[BENCH_PKTS];
+enum qos_color bench_ref_colors[BENCH_PKTS];
+uint8_t bench_drops[BENCH_PKTS];
+
+/** current time in ns */
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/** fresh flows, panic on failure */
+static void
+flows_reset(void)
+{
+    if (qos_soft_flows_create(app_flows) != 0) {
+        fprintf(stderr, "Cannot allocate %u flows\n", app_flows);
+        exit(1);
+    }
+}
+
+/** ns per packet to meter and drop BENCH_PKTS packets, `burst` at a time (0 for the per-packet path), from fresh
+    flows */
+static double
+bench_run(uint32_t burst, enum qos_color *colors)
+{
+    uint32_t i, n;
+    uint64_t time;
+
+    flows_reset();
+    uint64_t start = now_ns();
+
+    for (i = 0; i < BENCH_PKTS; i += n) {
+        time = 1000000 * (uint64_t)(1 + i / BENCH_PERIOD_PKTS);
+
+        if (!burst) {
+            n = 1;
+            colors[i] = qos_meter_run(bench_flow_ids[i], bench_pkt_lens[i], time);
+            bench_drops[i] = (uint8_t)qos_dropper_run(bench_flow_ids[i], colors[i], time);
+            continue;
+        }
+
+        // Bursts end at period ends, so every packet has the time of the per-packet path.
+        n = burst;
+        if (n > BENCH_PKTS - i)
+            n = BENCH_PKTS - i;
+        if (n > BENCH_PERIOD_PKTS - i % BENCH_PERIOD_PKTS)
+            n = BENCH_PERIOD_PKTS - i % BENCH_PERIOD_PKTS;
+        qos_meter_run_burst(&bench_flow_ids[i], &bench_pkt_lens[i], n, time, &colors[i]);
+        qos_dropper_run_burst(&bench_flow_ids[i], &colors[i], n, time, &bench_drops[i]);
+    }
+
+    return (double)(now_ns() - start) / BENCH_PKTS;
+}
+
+/** compare the per-packet path with bursts of 64 */
+static void
+bench(void)
+{
+    uint32_t i, mismatches = 0;
+
+    for (i = 0; i < BENCH_PKTS; i++) {
+        bench_flow_ids[i] = (uint32_t)rand() % app_flows;
+        bench_pkt_lens[i] = (uint32_t)(128 + rand() % 1024);
+    }
+
+    double per_packet = bench_run(0, bench_ref_colors);
+    double burst = bench_run(64, bench_colors);
+
+    for (i = 0; i < BENCH_PKTS; i++)
+        mismatches += bench_colors[i] != bench_ref_colors[i];
+
+    printf("ns/packet with %u flows: per-packet %.1f, burst 64 %.1f (%s)\n", app_flows, per_packet, burst,
+        qos_soft_simd() ? "AVX2" : "scalar");
+    printf("burst colors differing from per-packet ones: %u of %u\n", mismatches, BENCH_PKTS);
+}
+
+/** meter APP_BURST_MAX flows, one packet of pkt_len each, per packet or as a burst */
+static void
+idle_run(int burst, uint32_t pkt_len, uint64_t time, enum qos_color *colors)
+{
+    uint32_t flow_ids[APP_BURST_MAX], pkt_lens[APP_BURST_MAX];
+    uint32_t i;
+
+    for (i = 0; i < APP_BURST_MAX; i++) {
+        flow_ids[i] = i;
+        pkt_lens[i] = pkt_len;
+    }
+
+    if (burst) {
+        qos_meter_run_burst(flow_ids, pkt_lens, APP_BURST_MAX, time, colors);
+        return;
+    }
+    for (i = 0; i < APP_BURST_MAX; i++)
+        colors[i] = qos_meter_run(flow_ids[i], pkt_lens[i], time);
+}
+
+/** compare the per-packet path with bursts after idle times over 2^32 ns, with buckets taking 16 s to fill */
+static void
+idle_check(void)
+{
+    static const uint64_t idle_ns[] = {1000000000, 4000000000, 5000000000, 9000000000, 20000000000};
+    enum qos_color colors[2][APP_BURST_MAX];
+    struct qos_params saved, params;
+    uint32_t i, mismatches = 0;
+    int burst;
+
+    qos_params_get(&saved);
+    params = saved;
+    for (i = 0; i < APP_PROFILES; i++) {
+        params.srtcm[i].cir = 1000000;
+        params.srtcm[i].cbs = 8000000;
+        params.srtcm[i].ebs = 8000000;
+    }
+    if (qos_params_update(&params) != 0) {
+        fprintf(stderr, "Cannot set idle check parameters\n");
+        exit(1);
+    }
+
+    // Empty the buckets, stay idle, then send 4 MB: green only if all the tokens of the idle time came in.
+    for (i = 0; i < sizeof(idle_ns) / sizeof(idle_ns[0]); i++) {
+        for (burst = 0; burst < 2; burst++) {
+            if (qos_soft_flows_create(APP_BURST_MAX) != 0) {
+                fprintf(stderr, "Cannot allocate %u flows\n", APP_BURST_MAX);
+                exit(1);
+            }
+            idle_run(burst, 8000000, 1, colors[burst]);
+            idle_run(burst, 8000000, 1, colors[burst]);
+            idle_run(burst, 4000000, 1 + idle_ns[i], colors[burst]);
+        }
+        uint32_t j;
+        for (j = 0; j < APP_BURST_MAX; j++)
+            mismatches += colors[1][j] != colors[0][j];
+    }
+
+    if (qos_params_update(&saved) != 0) {
+        fprintf(stderr, "Cannot restore parameters\n");
+        exit(1);
+    }
+    flows_reset();
+
+    printf("burst colors differing from per-packet ones after long idle times: %u of %u\n", mismatches,
+        (uint32_t)(sizeof(idle_ns) / sizeof(idle_ns[0]) * APP_BURST_MAX));
+}
+
+/** set parameters, panic on failure */
+static void
+params_set(const struct qos_params *params)
+{
+    if (qos_params_update(params) != 0) {
+        fprintf(stderr, "Cannot set parameters\n");
+        exit(1);
+    }
+}
+
+/** compare colors with RFC 2697 srTCM for rates the fixed point holds exactly (multiples of 1953125 bytes/s):
+    tokens of a byte each, coming in at 1/CIR intervals, the ones finding both buckets full lost */
+static void
+ref_meter_check(void)
+{
+    static const uint64_t cir[APP_PROFILES] = {125000000, 31250000, 7812500, 1953125};
+    static const uint64_t cbs[APP_PROFILES] = {3000, 1500, 9000, 2000};
+    static const uint64_t ebs[APP_PROFILES] = {6000, 1500, 0, 1000};
+    uint64_t tc[APP_PROFILES], te[APP_PROFILES];
+    uint64_t last[APP_PROFILES], frac[APP_PROFILES]; // Time of the last packet, and 10^-9 of the next token.
+    struct qos_params saved, params;
+    uint64_t time = 1;
+    uint32_t i, mismatches = 0;
+
+    qos_params_get(&saved);
+    params = saved;
+    for (i = 0; i < APP_PROFILES; i++) {
+        params.srtcm[i].cir = cir[i];
+        params.srtcm[i].cbs = cbs[i];
+        params.srtcm[i].ebs = ebs[i];
+        tc[i] = cbs[i];
+        te[i] = ebs[i];
+        last[i] = 0; // As fresh flows.
+        frac[i] = 0;
+    }
+    params_set(&params);
+    if (qos_soft_flows_create(APP_PROFILES) != 0) {
+        fprintf(stderr, "Cannot allocate %u flows\n", APP_PROFILES);
+        exit(1);
+    }
+
+    for (i = 0; i < REF_PKTS; i++) {
+        uint32_t flow = (uint32_t)rand() % APP_PROFILES;
+        uint32_t pkt_len = (uint32_t)(64 + rand() % 1437);
+        enum qos_color color;
+
+        time += (uint64_t)(rand() % 20000);
+
+        // Tokens of the elapsed time: the committed bucket first, the overflow to the excess one.
+        uint64_t acc = (time - last[flow]) * cir[flow] + frac[flow];
+        last[flow] = time;
+        frac[flow] = acc % 1000000000;
+        tc[flow] += acc / 1000000000;
+        if (tc[flow] > cbs[flow]) {
+            te[flow] += tc[flow] - cbs[flow];
+            tc[flow] = cbs[flow];
+            if (te[flow] > ebs[flow])
+                te[flow] = ebs[flow];
+        }
+
+        if (tc[flow] >= pkt_len) {
+            tc[flow] -= pkt_len;
+            color = GREEN;
+        } else if (te[flow] >= pkt_len) {
+            te[flow] -= pkt_len;
+            color = YELLOW;
+        } else {
+            color = RED;
+        }
+
+        mismatches += qos_meter_run(flow, pkt_len, time) != color;
+    }
+
+    params_set(&saved);
+    flows_reset();
+
+    printf("colors differing from RFC 2697 srTCM: %u of %u\n", mismatches, REF_PKTS);
+}
+
+/** compare drops of a drained flow with RED in floating point. Below min_th all pass and from max_th on all drop;
+    decisions with an average within 0.5 packets of them or in between are random, and not compared */
+static void
+ref_red_check(void)
+{
+    static const uint16_t wq_log2[QOS_COLORS] = {2, 3, 4};
+    static const uint16_t min_th[QOS_COLORS] = {32, 16, 4};
+    static const uint16_t max_th[QOS_COLORS] = {48, 24, 8};
+    enum qos_color queue[REF_QUEUE_MAX];
+    double avg[QOS_COLORS] = {0, 0, 0};
+    struct qos_params saved, params;
+    uint32_t head = 0, size = 0, compared = 0, mismatches = 0;
+    uint64_t time = 1, q_time = 0;
+    uint32_t i;
+
+    qos_params_get(&saved);
+    params = saved;
+    for (i = 0; i < QOS_COLORS; i++) {
+        params.red[i].wq_log2 = wq_log2[i];
+        params.red[i].min_th = min_th[i];
+        params.red[i].max_th = max_th[i];
+        params.red[i].maxp_inv = 10;
+    }
+    params_set(&params);
+    qos_dropper_set_drained(1);
+    if (qos_soft_flows_create(1) != 0) {
+        fprintf(stderr, "Cannot allocate 1 flow\n");
+        exit(1);
+    }
+
+    // Arrivals and departures at random, about 1.1 arrivals per departure, with idle times between bursts.
+    for (i = 0; i < REF_PKTS; i++) {
+        time += (uint64_t)(rand() % 4 == 0 ? rand() % 100000 : rand() % 500);
+
+        if (size == REF_QUEUE_MAX || (size > 0 && rand() % 21 < 10)) {
+            qos_dropper_dequeue(0, queue[head], time);
+            head = (head + 1) % REF_QUEUE_MAX;
+            if (--size == 0)
+                q_time = time;
+            continue;
+        }
+
+        enum qos_color color = (enum qos_color)(rand() % QOS_COLORS);
+        double w = 1.0 / (1 << wq_log2[color]);
+
+        if (size > 0)
+            avg[color] += (size - avg[color]) * w;
+        else
+            avg[color] *= pow(1 - w, (double)((time - q_time) / 1000));
+
+        int drop = qos_dropper_run(0, color, time);
+        if (avg[color] < min_th[color] - 0.5 || avg[color] >= max_th[color] + 0.5) {
+            compared++;
+            mismatches += drop != (avg[color] >= max_th[color]);
+        }
+
+        if (!drop) {
+            queue[(head + size) % REF_QUEUE_MAX] = color;
+            size++;
+        }
+    }
+
+    qos_dropper_set_drained(0);
+    params_set(&saved);
+    flows_reset();
+
+    printf("drops differing from RED: %u of %u compared\n", mismatches, compared);
+}
+
+/** parse arguments */
+static void
+parse_args(int argc, char **argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:")) != -1) {
+        switch (opt) {
+        case 'f': // Number of flows.
+            app_flows = (uint32_t)atoi(optarg);
+            if (app_flows < APP_PROFILES) {
+                fprintf(stderr, "Invalid number of flows\n");
+                exit(1);
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-f flows]\n", argv[0]);
+            exit(1);
+        }
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    int i, j;
+
+    parse_args(argc, argv);
+
+    if (qos_meter_init() != 0 || qos_dropper_init() != 0) {
+        fprintf(stderr, "Cannot init meter or dropper\n");
+        exit(1);
+    }
+
+    flows_reset();
+    srand(time(NULL));
+
+    uint64_t time = 0;
+    uint64_t cnt_send[APP_PROFILES];
+    uint64_t cnt_pass[APP_PROFILES];
+    for (i = 0; i < APP_PROFILES; i++) {
+        cnt_send[i] = cnt_pass[i] = 0;
+    }
+
+    uint32_t flow_ids[APP_BURST_MAX];
+    uint32_t pkt_lens[APP_BURST_MAX];
+    enum qos_color colors[APP_BURST_MAX];
+    uint8_t drops[APP_BURST_MAX];
+
+    for (i = 0; i < 10; i++) {
+        /** 1000 packets per period averagely */
+        int burst = 500 + rand() % 1000;
+
+        while (burst > 0) {
+            int n = burst < APP_BURST_MAX ? burst : APP_BURST_MAX;
+            burst -= n;
+
+            for (j = 0; j < n; j++) {
+                flow_ids[j] = (uint32_t)rand() % app_flows;
+
+                /** 640 bytes per packet averagely */
+                pkt_lens[j] = (uint32_t)(128 + rand() % 1024);
+            }
+
+            /** get color */
+            qos_meter_run_burst(flow_ids, pkt_lens, (uint32_t)n, time, colors);
+
+            /** make decision: weather drop */
+            qos_dropper_run_burst(flow_ids, colors, (uint32_t)n, time, drops);
+
+            for (j = 0; j < n; j++) {
+                uint32_t profile = qos_soft_flow_profile(flow_ids[j]);
+                cnt_send[profile] += pkt_lens[j];
+                cnt_pass[profile] += drops[j] ? 0 : pkt_lens[j];
+            }
+        }
+        time += 1000000;
+    }
+
+    for (i = 0; i < APP_PROFILES; i++) {
+        printf("profile: %d, send: %" PRIu64 ", pass: %" PRIu64 "\n", i, cnt_send[i], cnt_pass[i]);
+    }
+
+    bench();
+    idle_check();
+    ref_meter_check();
+    ref_red_check();
+
+    qos_soft_flows_free();
+
+    return 0;
+}
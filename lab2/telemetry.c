@@ -0,0 +1,217 @@
+#include "rte_common.h"
+#include "rte_cycles.h"
+#include "rte_lcore.h"
+#include "rte_metrics.h"
+#include "rte_prefetch.h"
+
+#include "flow_table.h"
+#include "qos.h"
+#include "telemetry.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+
+#define TELEMETRY_PREFETCH_OFFSET 4 // How many packets ahead flow counters are prefetched.
+
+// Metrics: packets and bytes per class, the same per profile, active flows, then RED average queue size (x1000)
+// per color, mean and maximum.
+#define TELEMETRY_METRICS (2 * QOS_CLASSES * (1 + APP_PROFILES) + 1 + 2 * TELEMETRY_QUEUE_COLORS)
+
+static const char *class_names[QOS_CLASSES] = {"green", "yellow", "red", "dropped"};
+
+struct flow_table *telemetry_tables[RTE_MAX_LCORE]; // Table of every lcore, NULL if none.
+char telemetry_names[TELEMETRY_METRICS][RTE_METRICS_MAX_NAME_LEN];
+int telemetry_key = -1; // Key of the first metric.
+uint64_t telemetry_period = 0; // TSC cycles between publications, 0 for none.
+uint64_t telemetry_next = 0; // TSC of the next publication.
+
+
+void
+telemetry_init(uint32_t period_ms)
+{
+    const char *names[TELEMETRY_METRICS];
+    int c, p, k = 0;
+
+    for (c = 0; c < QOS_CLASSES; c++) {
+        snprintf(telemetry_names[k++], RTE_METRICS_MAX_NAME_LEN, "qos_%s_pkts", class_names[c]);
+        snprintf(telemetry_names[k++], RTE_METRICS_MAX_NAME_LEN, "qos_%s_bytes", class_names[c]);
+    }
+    for (p = 0; p < APP_PROFILES; p++) {
+        for (c = 0; c < QOS_CLASSES; c++) {
+            snprintf(telemetry_names[k++], RTE_METRICS_MAX_NAME_LEN, "qos_profile%d_%s_pkts", p, class_names[c]);
+            snprintf(telemetry_names[k++], RTE_METRICS_MAX_NAME_LEN, "qos_profile%d_%s_bytes", p, class_names[c]);
+        }
+    }
+    snprintf(telemetry_names[k++], RTE_METRICS_MAX_NAME_LEN, "qos_flows");
+    for (c = 0; c < TELEMETRY_QUEUE_COLORS; c++) {
+        snprintf(telemetry_names[k++], RTE_METRICS_MAX_NAME_LEN, "qos_%s_queue_avg_x1000", class_names[c]);
+        snprintf(telemetry_names[k++], RTE_METRICS_MAX_NAME_LEN, "qos_%s_queue_max_x1000", class_names[c]);
+    }
+    RTE_VERIFY(k == TELEMETRY_METRICS);
+
+    for (k = 0; k < TELEMETRY_METRICS; k++)
+        names[k] = telemetry_names[k];
+
+    rte_metrics_init((int)rte_socket_id());
+    telemetry_key = rte_metrics_reg_names(names, TELEMETRY_METRICS);
+    if (telemetry_key < 0)
+        rte_panic("Cannot register metrics\n");
+
+    telemetry_period = rte_get_tsc_hz() / 1000 * period_ms;
+    telemetry_next = rte_rdtsc() + telemetry_period;
+}
+
+void
+telemetry_register(unsigned lcore_id, struct flow_table *table)
+{
+    telemetry_tables[lcore_id] = table;
+}
+
+void
+telemetry_count_burst(struct flow_table *table, const uint32_t *flow_ids, const uint32_t *pkt_lens,
+    const enum qos_color *colors, const uint8_t *drops, uint32_t n)
+{
+    uint32_t i;
+
+    for (i = 0; i < n && i < TELEMETRY_PREFETCH_OFFSET; ++i)
+        rte_prefetch0(&table->counters[flow_ids[i]]);
+
+    for (i = 0; i < n; ++i) {
+        if (i + TELEMETRY_PREFETCH_OFFSET < n)
+            rte_prefetch0(&table->counters[flow_ids[i + TELEMETRY_PREFETCH_OFFSET]]);
+
+        struct qos_counters *counters = &table->counters[flow_ids[i]];
+        enum qos_class class = (enum qos_class)colors[i]; // Classes start with the colors.
+
+        counters->pkts[class]++;
+        counters->bytes[class] += pkt_lens[i];
+        table->total.pkts[class]++;
+        table->total.bytes[class] += pkt_lens[i];
+
+        if (drops != NULL && drops[i]) {
+            counters->pkts[QOS_CLASS_DROPPED]++;
+            counters->bytes[QOS_CLASS_DROPPED] += pkt_lens[i];
+            table->total.pkts[QOS_CLASS_DROPPED]++;
+            table->total.bytes[QOS_CLASS_DROPPED] += pkt_lens[i];
+        }
+    }
+}
+
+static void
+telemetry_add(struct qos_counters *sum, const struct qos_counters *counters)
+{
+    int c;
+
+    for (c = 0; c < QOS_CLASSES; c++) {
+        sum->pkts[c] += counters->pkts[c];
+        sum->bytes[c] += counters->bytes[c];
+    }
+}
+
+void
+telemetry_read(struct telemetry_snapshot *snapshot)
+{
+    struct qos_params params;
+    unsigned lcore_id;
+    uint32_t i;
+    int c;
+
+    memset(snapshot, 0, sizeof(*snapshot));
+    qos_params_get(&params); // On the lcore reloading them, if any.
+
+    // Counters are written while we read them: 64-bit loads are atomic, so every value is one the owner wrote,
+    // but values of a snapshot may be a few packets apart.
+    for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+        const struct flow_table *table = telemetry_tables[lcore_id];
+        if (table == NULL)
+            continue;
+
+        telemetry_add(&snapshot->total, &table->total);
+
+        for (i = 0; i <= table->capacity; i++) {
+            const struct qos_counters *counters = &table->counters[i];
+            if (counters->pkts[QOS_CLASS_GREEN] + counters->pkts[QOS_CLASS_YELLOW] +
+                    counters->pkts[QOS_CLASS_RED] == 0) // Unused.
+                continue;
+
+            const struct qos_flow *flow = &table->flows[i];
+            telemetry_add(&snapshot->profiles[flow->profile], counters);
+            snapshot->flows++;
+
+            for (c = 0; c < TELEMETRY_QUEUE_COLORS; c++) {
+                double avg = qos_flow_red_avg(flow, (enum qos_color)c, params.red[c].wq_log2);
+                snapshot->queue_avg[c] += avg;
+                snapshot->queue_avg_max[c] = RTE_MAX(snapshot->queue_avg_max[c], avg);
+            }
+        }
+    }
+
+    for (c = 0; c < TELEMETRY_QUEUE_COLORS; c++)
+        if (snapshot->flows > 0)
+            snapshot->queue_avg[c] /= snapshot->flows;
+}
+
+void
+telemetry_publish(void)
+{
+    struct telemetry_snapshot snapshot;
+    uint64_t values[TELEMETRY_METRICS];
+    int c, p, k = 0;
+
+    if (telemetry_key < 0)
+        return;
+
+    telemetry_read(&snapshot);
+
+    // In the order of the names.
+    for (c = 0; c < QOS_CLASSES; c++) {
+        values[k++] = snapshot.total.pkts[c];
+        values[k++] = snapshot.total.bytes[c];
+    }
+    for (p = 0; p < APP_PROFILES; p++) {
+        for (c = 0; c < QOS_CLASSES; c++) {
+            values[k++] = snapshot.profiles[p].pkts[c];
+            values[k++] = snapshot.profiles[p].bytes[c];
+        }
+    }
+    values[k++] = snapshot.flows;
+    for (c = 0; c < TELEMETRY_QUEUE_COLORS; c++) {
+        values[k++] = (uint64_t)(snapshot.queue_avg[c] * 1000);
+        values[k++] = (uint64_t)(snapshot.queue_avg_max[c] * 1000);
+    }
+
+    rte_metrics_update_values(RTE_METRICS_GLOBAL, (uint16_t)telemetry_key, values, TELEMETRY_METRICS);
+}
+
+void
+telemetry_poll(void)
+{
+    if (telemetry_period == 0)
+        return;
+
+    uint64_t now = rte_rdtsc();
+    if (now < telemetry_next)
+        return;
+
+    telemetry_next = now + telemetry_period;
+    telemetry_publish();
+}
+
+void
+telemetry_print(void)
+{
+    struct telemetry_snapshot snapshot;
+    int c;
+
+    telemetry_read(&snapshot);
+
+    for (c = 0; c < QOS_CLASSES; c++)
+        printf("qos %s: %" PRIu64 " pkts, %" PRIu64 " bytes\n", class_names[c], snapshot.total.pkts[c],
+            snapshot.total.bytes[c]);
+    printf("qos RED average queue over %u flows:", snapshot.flows);
+    for (c = 0; c < TELEMETRY_QUEUE_COLORS; c++)
+        printf(" %s %.1f (max %.1f)", class_names[c], snapshot.queue_avg[c], snapshot.queue_avg_max[c]);
+    printf("\n");
+}
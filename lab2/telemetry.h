@@ -0,0 +1,50 @@
+#ifndef __TELEMETRY_H__
+#define __TELEMETRY_H__
+
+#include <stdint.h>
+
+#include "flow_table.h"
+#include "qos.h"
+
+/**
+ * QoS telemetry: 64-bit packet and byte counters per flow and class (see enum qos_class), kept in the flow table of
+ * the lcore owning the flow, and summed per table. Only the owner writes them, so the datapath takes no lock and
+ * shares no cache line. Readers sum the tables of all lcores, and publish the result with rte_metrics (global
+ * metrics, e.g. for dpdk-procinfo --metrics) every `period_ms`
+ */
+
+#define TELEMETRY_QUEUE_COLORS 3 // RED queues per flow.
+
+/* Counters summed over all lcores */
+struct telemetry_snapshot {
+    struct qos_counters total; // All flows.
+    struct qos_counters profiles[APP_PROFILES]; // Flows of each profile.
+    uint32_t flows; // Flows that received packets.
+    double queue_avg[TELEMETRY_QUEUE_COLORS]; // RED average queue size per color: mean over flows,
+    double queue_avg_max[TELEMETRY_QUEUE_COLORS]; // and maximum.
+};
+
+/* Register the metrics, publish them every period_ms (0 to never publish on poll) */
+void telemetry_init(uint32_t period_ms);
+
+/* Read the table of an lcore (NULL to stop) */
+void telemetry_register(unsigned lcore_id, struct flow_table *table);
+
+/* Count a burst after the meter and dropper: n pkts of flows flow_ids[i] with lengths pkt_lens[i], colors[i] and
+   drops[i] (NULL if none were dropped). Call from the lcore owning the table */
+void telemetry_count_burst(struct flow_table *table, const uint32_t *flow_ids, const uint32_t *pkt_lens,
+    const enum qos_color *colors, const uint8_t *drops, uint32_t n);
+
+/* Sum the counters of all registered tables */
+void telemetry_read(struct telemetry_snapshot *snapshot);
+
+/* Read and publish the counters */
+void telemetry_publish(void);
+
+/* Publish if the period has elapsed since the last time. Cheap enough to call for every burst */
+void telemetry_poll(void);
+
+/* Read and print the counters */
+void telemetry_print(void);
+
+#endif
@@ -0,0 +1,214 @@
+#include "rte_atomic.h"
+#include "rte_byteorder.h"
+#include "rte_common.h"
+#include "rte_ether.h"
+#include "rte_hash_crc.h"
+#include "rte_ip.h"
+#include "rte_mbuf.h"
+#include "rte_mempool.h"
+#include "rte_ring.h"
+#include "rte_udp.h"
+
+#include "egress.h"
+#include "fifo.h"
+#include "flow_table.h"
+#include "qos.h"
+#include "telemetry.h"
+#include "worker.h"
+
+#include <string.h>
+
+
+volatile int app_quit = 0;
+
+#define PKT_HDR_LEN (sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr) + sizeof(struct udp_hdr))
+
+
+void
+pkt_build(struct rte_mbuf *m, const struct qos_flow_key *key, uint32_t pkt_len)
+{
+    char *data = rte_pktmbuf_append(m, (uint16_t)RTE_MAX(pkt_len, PKT_HDR_LEN));
+    if (data == NULL)
+        rte_panic("Packet too long: %u bytes\n", pkt_len);
+
+    struct ether_hdr *eth = (struct ether_hdr *)data;
+    struct ipv4_hdr *ip = (struct ipv4_hdr *)(eth + 1);
+    struct udp_hdr *udp = (struct udp_hdr *)(ip + 1);
+
+    memset(eth, 0, sizeof(*eth));
+    eth->ether_type = rte_cpu_to_be_16(ETHER_TYPE_IPv4);
+
+    memset(ip, 0, sizeof(*ip));
+    ip->version_ihl = 0x45; // IPv4, 20-byte header.
+    ip->total_length = rte_cpu_to_be_16((uint16_t)(rte_pktmbuf_pkt_len(m) - sizeof(*eth)));
+    ip->time_to_live = 64;
+    ip->next_proto_id = key->proto;
+    ip->src_addr = rte_cpu_to_be_32(key->src_ip);
+    ip->dst_addr = rte_cpu_to_be_32(key->dst_ip);
+
+    udp->src_port = rte_cpu_to_be_16(key->src_port);
+    udp->dst_port = rte_cpu_to_be_16(key->dst_port);
+    udp->dgram_len = rte_cpu_to_be_16((uint16_t)(rte_pktmbuf_pkt_len(m) - sizeof(*eth) - sizeof(*ip)));
+    udp->dgram_cksum = 0;
+}
+
+void
+pkt_parse(const struct rte_mbuf *m, struct qos_flow_key *key)
+{
+    memset(key, 0, sizeof(*key));
+
+    const struct ether_hdr *eth = rte_pktmbuf_mtod(m, const struct ether_hdr *);
+    if (rte_pktmbuf_data_len(m) < PKT_HDR_LEN || eth->ether_type != rte_cpu_to_be_16(ETHER_TYPE_IPv4))
+        return;
+
+    const struct ipv4_hdr *ip = (const struct ipv4_hdr *)(eth + 1);
+    const struct udp_hdr *udp = (const struct udp_hdr *)(ip + 1); // Ports of UDP and TCP are at the same place.
+
+    key->src_ip = rte_be_to_cpu_32(ip->src_addr);
+    key->dst_ip = rte_be_to_cpu_32(ip->dst_addr);
+    key->src_port = rte_be_to_cpu_16(udp->src_port);
+    key->dst_port = rte_be_to_cpu_16(udp->dst_port);
+    key->proto = ip->next_proto_id;
+}
+
+void
+pkt_free_bulk(struct rte_mbuf **pkts, uint32_t n)
+{
+    void *batch[APP_BURST_MAX];
+    struct rte_mempool *pool = NULL;
+    uint32_t i, k = 0;
+
+    for (i = 0; i < n; ++i) {
+        struct rte_mbuf *m = pkts[i];
+        if (m->next != NULL) { // Chained: free segment by segment.
+            rte_pktmbuf_free(m);
+            continue;
+        }
+
+        m = rte_pktmbuf_prefree_seg(m);
+        if (m == NULL) // Still referenced.
+            continue;
+
+        // Put runs of mbufs of the same pool at once.
+        if (m->pool != pool || k == APP_BURST_MAX) {
+            if (k > 0)
+                rte_mempool_put_bulk(pool, batch, k);
+            pool = m->pool;
+            k = 0;
+        }
+        batch[k++] = m;
+    }
+
+    if (k > 0)
+        rte_mempool_put_bulk(pool, batch, k);
+}
+
+uint32_t
+flow_hash(const struct qos_flow_key *key)
+{
+    return rte_hash_crc(key, sizeof(*key), 0);
+}
+
+int
+worker_main(void *arg)
+{
+    struct worker *w = (struct worker *)arg;
+    struct rte_mbuf *pkts[APP_BURST_MAX];
+    struct qos_flow_key keys[APP_BURST_MAX];
+    const struct qos_flow_key *key_ptrs[APP_BURST_MAX];
+    uint32_t flow_ids[APP_BURST_MAX];
+    uint32_t pkt_lens[APP_BURST_MAX];
+    enum qos_color colors[APP_BURST_MAX];
+    uint8_t drops[APP_BURST_MAX];
+    uint32_t i, j, n;
+
+    RTE_PER_LCORE(flow_table) = w->table;
+    if (w->fifo != NULL)
+        qos_dropper_set_drained(1);
+
+    for (i = 0; i < APP_BURST_MAX; ++i)
+        key_ptrs[i] = &keys[i];
+
+    qos_reader_register(w->lcore_id);
+
+    for (;;) {
+        qos_quiescent(w->lcore_id); // Between bursts.
+
+        if (w->egress != NULL)
+            egress_dequeue(w->egress, APP_BURST_MAX);
+        if (w->fifo != NULL)
+            fifo_dequeue(w->fifo, APP_BURST_MAX);
+
+        n = rte_ring_sc_dequeue_burst(w->ring, (void **)pkts, APP_BURST_MAX, NULL);
+        if (n == 0) {
+            if (app_quit) {
+                rte_smp_rmb(); // See the last packets enqueued before app_quit was set.
+                if (rte_ring_empty(w->ring) && (w->egress == NULL || w->egress->queued == 0) &&
+                        (w->fifo == NULL || w->fifo->queued == 0))
+                    break;
+            }
+            continue;
+        }
+
+        // Classify.
+        for (i = 0; i < n; ++i)
+            pkt_parse(pkts[i], &keys[i]);
+        flow_table_lookup_burst(w->table, key_ptrs, n, flow_ids);
+        for (i = 0; i < n; ++i) {
+            pkts[i]->hash.usr = flow_ids[i];
+            pkt_lens[i] = rte_pktmbuf_pkt_len(pkts[i]);
+        }
+
+        // Meter and drop runs of packets of the same time period.
+        for (i = 0; i < n; i = j) {
+            uint64_t time = pkts[i]->udata64;
+            for (j = i + 1; j < n && pkts[j]->udata64 == time; ++j)
+                ;
+
+            qos_meter_run_mbufs(pkts + i, j - i, time, colors + i);
+#ifdef RTE_SCHED_RED
+            if (w->egress != NULL) { // The scheduler runs WRED on its queues.
+                memset(drops + i, 0, j - i);
+                continue;
+            }
+#endif
+            w->drops += qos_dropper_run_burst(flow_ids + i, colors + i, j - i, time, drops + i);
+        }
+
+        w->pkts += n;
+        telemetry_count_burst(w->table, flow_ids, pkt_lens, colors, drops, n);
+
+        if (w->egress == NULL && w->fifo == NULL) {
+            for (i = 0; i < n; ++i)
+                w->bytes += drops[i] ? 0 : pkt_lens[i];
+            pkt_free_bulk(pkts, n);
+            continue;
+        }
+
+        // Pass the packets kept to the next stage, in place. Free the dropped ones at once.
+        uint64_t last_time = pkts[n - 1]->udata64;
+        struct rte_mbuf *dropped[APP_BURST_MAX];
+        uint32_t kept = 0, nb_dropped = 0;
+        for (i = 0; i < n; ++i) {
+            if (drops[i]) {
+                dropped[nb_dropped++] = pkts[i];
+                continue;
+            }
+            pkts[kept] = pkts[i];
+            flow_ids[kept] = flow_ids[i];
+            colors[kept] = colors[i];
+            kept++;
+        }
+        pkt_free_bulk(dropped, nb_dropped);
+        if (w->fifo != NULL)
+            w->drops += kept - fifo_enqueue(w->fifo, pkts, flow_ids, colors, kept, last_time);
+        else
+            w->drops += kept - egress_enqueue(w->egress, pkts, flow_ids, colors, kept);
+    }
+
+    qos_reader_unregister(w->lcore_id);
+    if (w->fifo != NULL)
+        qos_dropper_set_drained(0);
+
+    return 0;
+}
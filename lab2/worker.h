@@ -0,0 +1,61 @@
+#ifndef __WORKER_H__
+#define __WORKER_H__
+
+#include <stdint.h>
+
+#include "rte_common.h"
+
+#include "egress.h"
+#include "fifo.h"
+#include "flow_table.h"
+#include "qos.h"
+
+/**
+ * Multi-lcore datapath: an RX stage on the master lcore spreads packets over worker lcores through one rte_ring
+ * each. Flows are sharded by hash, so every flow is metered and dropped by one worker only, with its own flow
+ * table, and per-flow state is never shared
+ */
+
+#define APP_RING_SIZE       1024
+#define APP_PERIOD_PKTS     1000 // Packets per time period (1000000 ns) of generated traffic.
+
+struct rte_mbuf;
+struct rte_ring;
+
+struct worker {
+    unsigned lcore_id;
+    struct rte_ring *ring; // Packets from the RX stage.
+    struct flow_table *table; // Flows of this shard.
+    struct egress *egress; // Scheduler for the packets passed, NULL to count and free them.
+    struct fifo *fifo; // Per-flow queues for the packets passed, NULL if none (not with egress).
+    uint64_t pkts; // Statistics: packets processed.
+    uint64_t drops; // Statistics: packets dropped, by the dropper or the scheduler.
+    uint64_t bytes; // Statistics: bytes passed (sent by the egress stage, if any).
+} __rte_cache_aligned;
+
+/* Set once the RX stage has enqueued its last packet. Workers return when their ring is empty then */
+extern volatile int app_quit;
+
+/* Write Ethernet/IPv4/UDP headers for flow `key` into an empty mbuf and make it pkt_len bytes long */
+void pkt_build(struct rte_mbuf *m, const struct qos_flow_key *key, uint32_t pkt_len);
+
+/* Read the 5-tuple of a packet built by pkt_build (or received), zero if it is not IPv4 */
+void pkt_parse(const struct rte_mbuf *m, struct qos_flow_key *key);
+
+/* Free n packets, returning them to their mempool in bulk */
+void pkt_free_bulk(struct rte_mbuf **pkts, uint32_t n);
+
+/* Worker (out of nb_workers) owning a flow. Uses the high bits of the hash, the flow tables use the low ones */
+static inline uint32_t
+worker_of(uint32_t hash, uint32_t nb_workers)
+{
+    return (uint32_t)(((uint64_t)hash * nb_workers) >> 32);
+}
+
+/* Hash of a flow used to pick its worker */
+uint32_t flow_hash(const struct qos_flow_key *key);
+
+/* Main loop of a worker lcore, `arg` is its struct worker. Packets carry their time in udata64 */
+int worker_main(void *arg);
+
+#endif